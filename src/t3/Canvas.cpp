@@ -23,6 +23,7 @@
 #include "Log.h"
 #include "Session.h"
 #include "Database.h"
+#include "DbPool.h"
 #include "Book.h"
 #include "Tabs.h"
 #include "Repository.h"
@@ -573,7 +574,8 @@ Canvas::Canvas
     objs.log        = new Log;
     objs.book       = new Book;
     objs.cws        = new CentralWorkSaver;
-    objs.db         = new Database;
+    db_pool_set_profile( db_primitive_profile_lookup( objs.repository->database.m_read_profile.c_str(), DB_PROFILE_INTERACTIVE_READ ) );
+    objs.db         = new Database( objs.repository->database.m_file.c_str() );
     objs.tabs       = new Tabs;
     objs.gl         = NULL;
     GameLogic *gl   = new GameLogic( this, lb );
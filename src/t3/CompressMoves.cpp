@@ -95,7 +95,7 @@ CompressMoves & CompressMoves::operator= (const CompressMoves & copy_from_me )
     }
     for( int i=0; i<64; i++ )
     {
-        Tracker *p = copy_from_me.trackers[64];
+        Tracker *p = copy_from_me.trackers[i];
         Tracker *q=0;
         if( p )
         {
@@ -472,7 +472,6 @@ int CompressMoves::compress_move( thc::Move mv, char *storage )
     trackers[src] = NULL;
     trackers[dst] = pt;
     cr.PlayMove(mv);
-    Check(true,"After compress_moves() tracker check",NULL);
     *storage = (char)(tracker_id + code);
     if( nbr_bytes > 1 )
     {
@@ -792,10 +791,10 @@ int CompressMoves::decompress_move( const char *storage, thc::Move &mv )
     else if( special == thc::SPECIAL_WEN_PASSANT )
         captured_sq = SOUTH(dst);
     pt = trackers[src];
-    char desc[100];
-    sprintf( desc, "pt is NULL; decompress_move() code=%02x, src=%s, dst=%s", val&0xff, SqToStr(src).c_str(), SqToStr(dst).c_str() );
     if( pt == NULL )
     {
+        char desc[100];
+        sprintf( desc, "pt is NULL; decompress_move() code=%02x, src=%s, dst=%s", val&0xff, SqToStr(src).c_str(), SqToStr(dst).c_str() );
         Check( false, desc, NULL );
     }
     if( captured_sq >= 0 )
@@ -822,7 +821,6 @@ int CompressMoves::decompress_move( const char *storage, thc::Move &mv )
     trackers[src] = NULL;
     trackers[dst] = pt;
     cr.PlayMove(mv);
-    Check( true, desc+12, NULL );
     return nbr_bytes;
 }
 
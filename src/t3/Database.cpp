@@ -7,31 +7,47 @@
 #define _CRT_SECURE_NO_DEPRECATE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "wx/wx.h"
 #include "thc.h"
 #include "Portability.h"
 #include "DebugPrintf.h"
 #include "sqlite3.h"
 #include "CompressMoves.h"
 #include "DbPrimitives.h"
+#include "PositionIndex.h"
+#include "GameIdList.h"
+#include "DbPool.h"
 #include "Database.h"
 #include "wx/msgout.h"
 #include "wx/progdlg.h"
 
 
-// Create a handle for database connection, create a pointer to sqlite3
+// The UI thread's connection to the database, from the pool of read-only
+//  connections (see DbPool.h). The background loader and page prefetch each
+//  take a connection of their own from the pool while they run
 static sqlite3 *gbl_handle;
 
-// A prepared statement for fetching from positions table
-static sqlite3_stmt *gbl_stmt;
-
-// Whereabouts we are in the virtual list control
-static int gbl_expected;
-
 // Whereabouts we are in the virtual list control
 static int gbl_current;
 
-// Number of elements in the virtual list control
+// Number of elements in the virtual list control, the games that reach the
+//  position with hash gbl_count_hash
 static int gbl_count;
+static uint64_t gbl_count_hash;
+
+// Pages of rows for the virtual list control (see GetRow() below)
+static void pages_reset();
+static void pages_set_query( bool start_pos, int table_nbr, sqlite3_int64 hash, const std::string &player_name, const std::string &player_cond );
+
+// Rendered move text (see db_calculate_move_txt() below)
+static void move_txt_cache_clear();
 
 // The position we are looking for
 thc::ChessPosition gbl_position;
@@ -45,29 +61,543 @@ void db_set_gbl_position( thc::ChessPosition &pos )   // FIXME this is an abomin
 
 #define NBR_BUCKETS 4096
 
-Database::Database()
+// Databases from schema version 3 have the full 64 bit hash (including the
+//  side to move) in the positions_N tables, older ones only the low 32 bits of
+//  a hash without the side to move (see DbPrimitives.cpp)
+static bool gbl_legacy_keys;
+
+// The positions_N table and position_hash value to search for
+static void position_key( uint64_t hash, bool white_to_play, int &table_nbr, sqlite3_int64 &key )
+{
+    if( gbl_legacy_keys )
+    {
+        if( !white_to_play )
+            hash ^= thc::ChessPosition::HASH64_BLACK_TO_MOVE;
+        key = (int)hash;
+    }
+    else
+        key = (sqlite3_int64)hash;
+    table_nbr = ((int)(hash>>32))&(NBR_BUCKETS-1);
+}
+
+bool db_exact_position_keys()
+{
+    return !gbl_legacy_keys;
+}
+
+// Databases from schema version 4 have an opening tree table
+static bool gbl_opening_tree;
+
+// Databases from schema version 5 have players and game_players tables
+static bool gbl_players;
+
+// Databases from schema version 6 have a game_details table
+static bool gbl_details;
+
+// Databases created from the version that added positions_N.blob_offset
+static bool gbl_blob_offsets;
+
+// Where the current position is reached in each of its games, (game_id,
+//  blob_offset) in game_id order, read the first time the games are loaded
+static bool gbl_offsets_read;
+static std::vector< std::pair<int,int> > gbl_offsets;
+
+// Optional binary position index file, if present and up to date it replaces
+//  the positions_N tables for position searches without a player name
+static PositionIndex gbl_index;
+static bool gbl_use_index;
+static POSTING_LIST gbl_index_list;
+
+// Rows can come from a list of game ids rather than an SQL query, either the
+//  position index or the games of a player that reach the position
+static bool gbl_by_game_id;
+static GAME_ID_LIST gbl_game_ids;       // if not from the position index
+
+// The game ids of rows row ... row+nbr-1, most recent games first (same order
+//  as ORDER BY games.rowid DESC). From the position index only the blocks of
+//  the posting list that hold the rows are decoded
+static void rows_game_ids( int row, int nbr, std::vector<int> &game_ids )
+{
+    game_ids.clear();
+    if( row+nbr > gbl_count )
+        nbr = gbl_count - row;
+    if( nbr <= 0 )
+        return;
+    if( gbl_use_index )
+    {
+        gbl_index.GameIds( gbl_index_list, gbl_count-row-nbr, nbr, game_ids );
+        std::reverse( game_ids.begin(), game_ids.end() );
+    }
+    else
+    {
+        for( int i=0; i<nbr; i++ )
+            game_ids.push_back( gbl_game_ids[gbl_count-1-row-i] );
+    }
+}
+
+// Results of recent SetPosition() calls, so that revisiting a position (stepping
+//  back and forth through a game) doesn't repeat the search. Least recently
+//  used dropped first, within a memory budget
+#define NBR_CACHED_QUERIES 256
+#define QUERY_CACHE_BYTES  (32*1024*1024)
+struct QUERY_RESULT
+{
+    std::string key;            // position hash and search criteria
+    unsigned int last_used;
+    int count;
+    bool by_game_id;            // else the rows are paged with SQL
+    GAME_ID_LIST game_ids;
+};
+static std::vector<QUERY_RESULT> gbl_queries;
+static unsigned int gbl_query_clock;
+static size_t gbl_query_bytes;
+static uint32_t gbl_query_change_counter;
+
+static size_t query_bytes( const QUERY_RESULT &q )
+{
+    return sizeof(q) + q.key.length() + q.game_ids.size()*sizeof(int);
+}
+
+static std::string query_key( uint64_t hash, const DB_SEARCH &search )
+{
+    char buf[200];
+    sprintf( buf, "%016llx %d %d %d %d %d ", (unsigned long long)hash, search.player.length()?search.player_colour:0,
+                        search.year_min, search.year_max, search.elo_min, search.elo_max );
+    return buf + search.result + "\n" + search.eco + "\n" + search.player;
+}
+
+static void query_cache_clear()
+{
+    gbl_queries.clear();
+    gbl_query_bytes = 0;
+}
+
+// Changes whenever the database is modified. Our connections are read only,
+//  so every change is made by another connection (in this process or another
+//  one), which is what PRAGMA data_version reports
+static uint32_t db_change_counter()
+{
+    uint32_t counter = 0;
+    if( !gbl_handle )
+        return counter;
+    sqlite3_stmt *stmt;
+    if( 0 == sqlite3_prepare_v2( gbl_handle, "PRAGMA data_version", -1, &stmt, 0 ) )
+    {
+        bool have_version = (SQLITE_ROW == sqlite3_step(stmt));
+        if( have_version )
+            counter = (uint32_t)sqlite3_column_int64( stmt, 0 );
+        sqlite3_finalize(stmt);
+        if( have_version )
+            return counter;
+    }
+
+    // SQLite before 3.8.4 ignores that pragma, instead read the file change
+    //  counter (bytes 24-27 of the database header) through the connection's
+    //  own open file
+    sqlite3_file *file = NULL;
+    if( SQLITE_OK == sqlite3_file_control( gbl_handle, "main", SQLITE_FCNTL_FILE_POINTER, &file ) && file && file->pMethods )
+    {
+        unsigned char buf[4];
+        if( SQLITE_OK == file->pMethods->xRead( file, buf, sizeof(buf), 24 ) )
+            counter = ((uint32_t)buf[0]<<24) | (buf[1]<<16) | (buf[2]<<8) | buf[3];
+    }
+    return counter;
+}
+
+static QUERY_RESULT *query_cache_find( const std::string &key )
+{
+    uint32_t counter = db_change_counter();
+    if( counter != gbl_query_change_counter )
+    {
+        cprintf( "Database changed, query and move text caches cleared\n" );
+        query_cache_clear();
+        move_txt_cache_clear();
+        gbl_query_change_counter = counter;
+    }
+    for( unsigned int i=0; i<gbl_queries.size(); i++ )
+    {
+        if( gbl_queries[i].key == key )
+        {
+            gbl_queries[i].last_used = ++gbl_query_clock;
+            return &gbl_queries[i];
+        }
+    }
+    return NULL;
+}
+
+static void query_cache_add( const std::string &key, int count, bool by_game_id, const GAME_ID_LIST &game_ids )
+{
+    QUERY_RESULT q;
+    q.key = key;
+    q.count = count;
+    q.by_game_id = by_game_id;
+    size_t bytes = query_bytes(q) + game_ids.size()*sizeof(int);
+    if( bytes > QUERY_CACHE_BYTES/4 )
+        return;     // don't flush everything else for one huge result
+    while( gbl_queries.size()>0 && (gbl_queries.size()>=NBR_CACHED_QUERIES || gbl_query_bytes+bytes>QUERY_CACHE_BYTES) )
+    {
+        unsigned int lru = 0;
+        for( unsigned int i=1; i<gbl_queries.size(); i++ )
+        {
+            if( gbl_queries[i].last_used < gbl_queries[lru].last_used )
+                lru = i;
+        }
+        gbl_query_bytes -= query_bytes( gbl_queries[lru] );
+        gbl_queries.erase( gbl_queries.begin()+lru );
+    }
+    q.game_ids = game_ids;
+    q.last_used = ++gbl_query_clock;
+    gbl_query_bytes += bytes;
+    gbl_queries.push_back(q);
+}
+
+static void offsets_read()
+{
+    gbl_offsets_read = true;
+    gbl_offsets.clear();
+    int table_nbr;
+    sqlite3_int64 hash;
+    position_key( gbl_hash, gbl_position.white, table_nbr, hash );
+    char buf[200];
+    sprintf( buf, "SELECT game_id, MIN(blob_offset) FROM positions_%d WHERE position_hash=? GROUP BY game_id", table_nbr );
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("sqlite3_prepare_v2(SELECT blob_offset) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+        return;
+    }
+    sqlite3_bind_int64( stmt, 1, hash );
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        if( sqlite3_column_type(stmt,1) != SQLITE_NULL )
+            gbl_offsets.push_back( std::make_pair( sqlite3_column_int(stmt,0), sqlite3_column_int(stmt,1) ) );
+    }
+    if( retval != SQLITE_DONE )
+        cprintf("sqlite3_step(SELECT blob_offset) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+    sqlite3_finalize(stmt);
+    std::sort( gbl_offsets.begin(), gbl_offsets.end() );
+}
+
+static int offset_find( int game_id )
+{
+    std::vector< std::pair<int,int> >::iterator it = std::lower_bound( gbl_offsets.begin(), gbl_offsets.end(), std::make_pair(game_id,INT_MIN) );
+    if( it!=gbl_offsets.end() && it->first==game_id )
+        return it->second;
+    return -1;
+}
+
+// Set position_offset in games[from] onwards, so DbStats can find the path
+//  to the position in each game without replaying it
+static void offsets_apply( std::vector<DB_GAME_INFO> &games, size_t from, bool start_pos )
+{
+    if( !start_pos && !gbl_blob_offsets )
+        return;
+    if( !start_pos && !gbl_offsets_read )
+        offsets_read();
+    for( size_t i=from; i<games.size(); i++ )
+        games[i].position_offset = start_pos ? 0 : offset_find( games[i].game_id );
+}
+
+// The games of a player (as white, black or either) in ascending order, from
+//  the game_players table
+static bool player_game_ids( const std::string &player_name, int player_colour, GAME_ID_LIST &game_ids )
+{
+    game_ids.clear();
+    sqlite3_stmt *stmt;
+    const char *sql = player_colour==PLAYER_EITHER ?
+        "SELECT game_players.game_id FROM players JOIN game_players ON game_players.player_id = players.player_id "
+        "WHERE players.name=? ORDER BY game_players.game_id" :
+        "SELECT game_players.game_id FROM players JOIN game_players ON game_players.player_id = players.player_id "
+        "WHERE players.name=? AND game_players.colour=? ORDER BY game_players.game_id";
+    int retval = sqlite3_prepare_v2( gbl_handle, sql, -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("sqlite3_prepare_v2(SELECT game_players) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+        return false;
+    }
+    sqlite3_bind_text( stmt, 1, player_name.c_str(), -1, SQLITE_TRANSIENT );
+    if( player_colour != PLAYER_EITHER )
+        sqlite3_bind_int( stmt, 2, player_colour );
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+        game_ids.push_back( sqlite3_column_int(stmt,0) );
+    if( retval != SQLITE_DONE )
+        cprintf("sqlite3_step(SELECT game_players) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+    sqlite3_finalize(stmt);
+    game_ids.erase( std::unique(game_ids.begin(),game_ids.end()), game_ids.end() );  // a player who played themselves
+    return retval == SQLITE_DONE;
+}
+
+// The games that reach a position in ascending order, from the position index
+//  if available, otherwise the positions_N table
+static bool position_game_ids( int table_nbr, sqlite3_int64 hash, GAME_ID_LIST &game_ids )
+{
+    game_ids.clear();
+    if( gbl_index.IsOpen() )
+    {
+        POSTING_LIST list;
+        int count = gbl_index.Lookup( gbl_hash, list );
+        gbl_index.GameIds( list, 0, count, game_ids );
+        return true;
+    }
+    char buf[200];
+    sprintf( buf, "SELECT game_id FROM positions_%d WHERE position_hash=? ORDER BY game_id", table_nbr );
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("sqlite3_prepare_v2(SELECT positions_%d) FAILED %s\n", table_nbr, sqlite3_errmsg(gbl_handle) );
+        return false;
+    }
+    sqlite3_bind_int64( stmt, 1, hash );
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+        game_ids.push_back( sqlite3_column_int(stmt,0) );
+    if( retval != SQLITE_DONE )
+        cprintf("sqlite3_step(SELECT positions_%d) FAILED %s\n", table_nbr, sqlite3_errmsg(gbl_handle) );
+    sqlite3_finalize(stmt);
+    game_ids.erase( std::unique(game_ids.begin(),game_ids.end()), game_ids.end() );  // repeated positions
+    return retval == SQLITE_DONE;
+}
+
+// The games with game_details rows that match, the text parameters are bound
+//  to ?1 and ?2 (if present)
+static bool details_game_ids( const char *where, const std::string &text1, const std::string &text2, GAME_ID_LIST &game_ids )
+{
+    game_ids.clear();
+    if( !gbl_details )
+    {
+        cprintf( "No game details in this database (schema version < 6)\n" );
+        return false;
+    }
+    std::string sql = std::string("SELECT game_id FROM game_details WHERE ") + where;
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, sql.c_str(), -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("sqlite3_prepare_v2(%s) FAILED %s\n", sql.c_str(), sqlite3_errmsg(gbl_handle) );
+        return false;
+    }
+    int nbr_params = sqlite3_bind_parameter_count(stmt);
+    if( nbr_params >= 1 )
+        sqlite3_bind_text( stmt, 1, text1.c_str(), -1, SQLITE_TRANSIENT );
+    if( nbr_params >= 2 )
+        sqlite3_bind_text( stmt, 2, text2.c_str(), -1, SQLITE_TRANSIENT );
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+        game_ids.push_back( sqlite3_column_int(stmt,0) );
+    if( retval != SQLITE_DONE )
+        cprintf("sqlite3_step(%s) FAILED %s\n", sql.c_str(), sqlite3_errmsg(gbl_handle) );
+    sqlite3_finalize(stmt);
+
+    // An equality comes out of the index in game_id order, a range doesn't
+    if( !std::is_sorted(game_ids.begin(),game_ids.end()) )
+        game_ids_sort( game_ids );
+    return retval == SQLITE_DONE;
+}
+
+// A range "lo-hi", "lo-", "-hi" or just "n", 0 for an open end
+static bool parse_range( const std::string &txt, int &lo, int &hi )
+{
+    size_t dash = txt.find('-');
+    std::string s_lo = txt.substr( 0, dash );
+    std::string s_hi = (dash==std::string::npos ? s_lo : txt.substr(dash+1));
+    if( s_lo.length()==0 && s_hi.length()==0 )
+        return false;
+    for( size_t i=0; i<s_lo.length(); i++ )
+    {
+        if( !isdigit((unsigned char)s_lo[i]) )
+            return false;
+    }
+    for( size_t i=0; i<s_hi.length(); i++ )
+    {
+        if( !isdigit((unsigned char)s_hi[i]) )
+            return false;
+    }
+    lo = atoi( s_lo.c_str() );
+    hi = atoi( s_hi.c_str() );
+    return true;
+}
+
+bool db_search_parse( const std::string &txt, DB_SEARCH &search )
 {
+    size_t pos = 0;
+    while( pos < txt.length() )
+    {
+        if( isspace((unsigned char)txt[pos]) )
+        {
+            pos++;
+            continue;
+        }
+        size_t end = pos;
+        while( end<txt.length() && !isspace((unsigned char)txt[end]) )
+            end++;
+        std::string item = txt.substr( pos, end-pos );
+        pos = end;
+        size_t eq = item.find('=');
+        if( eq == std::string::npos )
+            return false;
+        std::string name  = item.substr( 0, eq );
+        std::string value = item.substr( eq+1 );
+        if( name == "result" )
+        {
+            if( value!="1-0" && value!="0-1" && value!="1/2-1/2" )
+                return false;
+            search.result = value;
+        }
+        else if( name == "year" )
+        {
+            if( !parse_range( value, search.year_min, search.year_max ) )
+                return false;
+        }
+        else if( name == "elo" )
+        {
+            if( !parse_range( value, search.elo_min, search.elo_max ) )
+                return false;
+        }
+        else if( name == "eco" )
+        {
+            if( value.length()<1 || value.length()>3 || value[0]<'A' || value[0]>'E' )
+                return false;
+            search.eco = value;
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+// A list of game ids for each criterion of the search, intersected. Games
+//  without a known year or Elo don't match a search on them. Returns false if
+//  a query fails
+static bool search_game_ids( bool start_pos, int table_nbr, sqlite3_int64 hash, const DB_SEARCH &search, GAME_ID_LIST &game_ids )
+{
+    std::vector<GAME_ID_LIST> lists;
+    GAME_ID_LIST ids;
+    std::string empty;
+    char buf[200];
+    bool ok = true;
+    if( ok && !start_pos )
+    {
+        ok = position_game_ids( table_nbr, hash, ids );
+        lists.push_back( ids );
+    }
+    if( ok && search.player.length()>0 )
+    {
+        ok = player_game_ids( search.player, search.player_colour, ids );
+        lists.push_back( ids );
+    }
+    if( ok && search.result.length()>0 )
+    {
+        ok = details_game_ids( "result=?1", search.result, empty, ids );
+        lists.push_back( ids );
+    }
+    if( ok && (search.year_min>0 || search.year_max>0) )
+    {
+        sprintf( buf, "year BETWEEN %d AND %d", search.year_min>0?search.year_min:1, search.year_max>0?search.year_max:INT_MAX );
+        ok = details_game_ids( buf, empty, empty, ids );
+        lists.push_back( ids );
+    }
+    if( ok && (search.elo_min>0 || search.elo_max>0) )
+    {
+        int lo = search.elo_min>0 ? search.elo_min : 1;
+        int hi = search.elo_max>0 ? search.elo_max : INT_MAX;
+        sprintf( buf, "white_elo BETWEEN %d AND %d", lo, hi );
+        ok = details_game_ids( buf, empty, empty, ids );
+        lists.push_back( ids );
+        sprintf( buf, "black_elo BETWEEN %d AND %d", lo, hi );
+        if( ok )
+            ok = details_game_ids( buf, empty, empty, ids );
+        lists.push_back( ids );
+    }
+    if( ok && search.eco.length()>0 )
+    {
+        ok = details_game_ids( "eco>=?1 AND eco<=?2", search.eco, search.eco+"~", ids );
+        lists.push_back( ids );
+    }
+    game_ids.clear();
+    if( ok )
+        game_ids_intersect_all( lists, game_ids );
+    return ok;
+}
+
+// The SQL condition for a player's games, value is a parameter
+static std::string player_condition( int player_colour, const std::string &value )
+{
+    if( player_colour == PLAYER_BLACK )
+        return "games.black=" + value;
+    else if( player_colour == PLAYER_EITHER )
+        return "(games.white=" + value + " OR games.black=" + value + ")";
+    return "games.white=" + value;
+}
+
+Database::Database( const char *db_file )
+{
+    has_details = false;
+    query_cache_clear();
+    move_txt_cache_clear();
+
     // Access the database.
-    int retval = sqlite3_open(DB_FILE,&gbl_handle);
+    db_pool_open(db_file);
+    gbl_handle = db_pool_acquire();
+    gbl_query_change_counter = db_change_counter();
+    int retval = gbl_handle ? 0 : -1;
     
     // If connection failed, handle returns NULL
     tprintf( "DATABASE CONSTRUCTOR %s\n", retval ? "FAILED" : "SUCCESSFUL" );
+    if( retval == 0 )
+    {
+        sqlite3_int64 schema_version = 0;
+        sqlite3_stmt *stmt;
+        if( 0 == sqlite3_prepare_v2( gbl_handle, "SELECT value FROM meta WHERE key='schema_version'", -1, &stmt, 0 ) )
+        {
+            if( SQLITE_ROW == sqlite3_step(stmt) )
+                schema_version = sqlite3_column_int64( stmt, 0 );
+            sqlite3_finalize(stmt);
+        }
+        gbl_legacy_keys = (schema_version < 3);
+        gbl_opening_tree = (schema_version >= 4);
+        gbl_players = (schema_version >= 5);
+        gbl_details = (schema_version >= 6);
+        gbl_blob_offsets = false;
+        if( 0 == sqlite3_prepare_v2( gbl_handle, "PRAGMA table_info(positions_0)", -1, &stmt, 0 ) )
+        {
+            while( SQLITE_ROW == sqlite3_step(stmt) )
+            {
+                const char *name = (const char *)sqlite3_column_text( stmt, 1 );
+                if( name && 0==strcmp(name,"blob_offset") )
+                    gbl_blob_offsets = true;
+            }
+            sqlite3_finalize(stmt);
+        }
+        tprintf( "DATABASE SCHEMA VERSION %d%s\n", (int)schema_version, gbl_legacy_keys?", 32 BIT POSITION KEYS":"" );
+        std::string filename = std::string(db_file) + POSITION_INDEX_SUFFIX;
+        if( gbl_index.Open(filename.c_str()) )
+        {
+            // The index is stale if games have been added since it was built
+            sqlite3_int64 max_rowid = -1;
+            if( 0 == sqlite3_prepare_v2( gbl_handle, "SELECT MAX(rowid) FROM games", -1, &stmt, 0 ) )
+            {
+                if( SQLITE_ROW == sqlite3_step(stmt) )
+                    max_rowid = sqlite3_column_int64( stmt, 0 );
+                sqlite3_finalize(stmt);
+            }
+            bool stale = (max_rowid != gbl_index.MaxRowid());
+            tprintf( "POSITION INDEX %s\n", stale ? "STALE, NOT USED" : "OPEN" );
+            if( stale )
+                gbl_index.Close();
+        }
+    }
 }
 
 Database::~Database()
 {
     cprintf( "DATABASE DESTRUCTOR\n" );
 #if 0
-    if( gbl_stmt )
-    {
-        sqlite3_finalize(gbl_stmt);
-        gbl_stmt = NULL;
-    }
     if( gbl_handle )
     {
-        sqlite3_close(gbl_handle);
+        db_pool_release(gbl_handle);
         gbl_handle = NULL;
     }
+    db_pool_close();
 #endif
 }
 
@@ -78,13 +608,29 @@ int Database::SetPosition( thc::ChessRules &cr )
 }
 
 
-int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
+int Database::SetPosition( thc::ChessRules &cr, std::string &player_name, int player_colour )
 {
+    DB_SEARCH search;
+    search.player = player_name;
+    search.player_colour = player_colour;
+    return SetPosition( cr, search );
+}
+
+int Database::SetPosition( thc::ChessRules &cr, const DB_SEARCH &search )
+{
+    const std::string &player_name = search.player;
+    int player_colour = search.player_colour;
     if( !gbl_handle )
         return 0;
-    gbl_expected = -1;
+    LoadAllGamesCancel();
+    pages_reset();
+    gbl_use_index = false;
+    gbl_by_game_id = false;
+    gbl_game_ids.clear();
+    gbl_offsets_read = false;
     int game_count = 0;
     this->player_name = player_name;
+    has_details = search.HasDetails();
     
     //cr.Forsyth("r1bqk2r/ppp1bppp/2n1pn2/3p4/Q1PP4/P3PN2/1P1N1PPP/R1B1KB1R b KQkq - 0 7");
     gbl_hash = cr.Hash64Calculate();
@@ -93,59 +639,96 @@ int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
     // select matching rows from the table
     char buf[1000];
     int table_nbr;
-    int hash;
-    uint64_t temp=gbl_hash;
-    table_nbr = ((int)(temp>>32))&(NBR_BUCKETS-1);
-    hash = (int)(temp);
+    sqlite3_int64 hash;
+    position_key( gbl_hash, cr.white, table_nbr, hash );
     thc::ChessPosition start_pos;
     is_start_pos = false;
+    // The name is bound to :player, never embedded in the SQL
+    std::string cond = player_name.length() ? player_condition(player_colour,":player") : "";
     if( player_name.length() == 0 )
-        where_white="";
-    else
     {
-        where_white = " WHERE games.white='";
-        where_white += player_name;
-        where_white += + "'";
-    }
-    if( player_name.length() == 0 )
+        where_white = "";
         white_and = "";
+    }
     else
     {
-        white_and = "games.white='";
-        white_and += player_name;
-        white_and += + "' AND ";
+        where_white = " WHERE " + cond;
+        white_and = cond + " AND ";
     }
-    if( cr == start_pos )
+    pages_set_query( cr==start_pos, table_nbr, hash, player_name, cond );
+    is_start_pos = (cr == start_pos);
+    bool player_search = (player_name.length()>0 && gbl_players) || search.HasDetails();
+    if( !player_search && !is_start_pos && gbl_index.IsOpen() && player_name.length()==0 )
     {
-        is_start_pos = true;
-        sprintf( buf, "SELECT COUNT(*) from games%s", where_white.c_str() );
+        // A binary search, no SQL at all (and nothing worth caching)
+        gbl_use_index = true;
+        gbl_by_game_id = true;
+        game_count = gbl_index.Lookup( gbl_hash, gbl_index_list );
+        tprintf( "Game count (position index) = %d\n", game_count );
+        gbl_count = game_count;
+        gbl_count_hash = gbl_hash;
+        return game_count;
+    }
+    std::string key = query_key( gbl_hash, search );
+    QUERY_RESULT *cached = query_cache_find( key );
+    if( cached )
+    {
+        gbl_by_game_id = cached->by_game_id;
+        gbl_game_ids = cached->game_ids;
+        game_count = cached->count;
+        tprintf( "Game count (cached) = %d\n", game_count );
+        gbl_count = game_count;
+        gbl_count_hash = gbl_hash;
+        return game_count;
+    }
+    if( player_search || (!is_start_pos && player_name.length()==0) )
+    {
+        // Intersect a list of games for each criterion, all in game_id order,
+        //  or just read the position's list of games
+        bool ok = player_search ? search_game_ids( is_start_pos, table_nbr, hash, search, gbl_game_ids )
+                                : position_game_ids( table_nbr, hash, gbl_game_ids );
+        gbl_by_game_id = true;
+        game_count = gbl_game_ids.size();
+        tprintf( "Game count (game ids) = %d\n", game_count );
+        if( ok )
+            query_cache_add( key, game_count, true, gbl_game_ids );
+        gbl_count = game_count;
+        gbl_count_hash = gbl_hash;
+        return game_count;
     }
+    if( is_start_pos )
+        sprintf( buf, "SELECT COUNT(*) from games%s", where_white.c_str() );
     else
     {
-        sprintf( buf, "SELECT COUNT(*) from games, positions_%d WHERE %spositions_%d.position_hash=%d AND games.game_id = positions_%d.game_id",
-                table_nbr, white_and.c_str(), table_nbr, hash, table_nbr );
+        // A game that repeats the position has a positions_N row for each time
+        sprintf( buf, "SELECT COUNT(DISTINCT positions_%d.game_id) from games, positions_%d WHERE %spositions_%d.position_hash=%lld AND games.game_id = positions_%d.game_id",
+                table_nbr, table_nbr, white_and.c_str(), table_nbr, (long long)hash, table_nbr );
     }
     //sprintf( buf, "SELECT COUNT(*) from games, positions_%d WHERE games.white = 'Carlsen, Magnus'  AND positions_%d.position_hash=%d AND games.game_id = positions_%d.game_id", table_nbr, table_nbr, hash, table_nbr );
     //    sprintf( buf, "SELECT COUNT(*) from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE games.white = 'Carlsen, Magnus' AND positions_%d.position_hash=%d", table_nbr, table_nbr, table_nbr, hash );
     //    sprintf( buf, "SELECT COUNT(*) from positions_%d WHERE position_hash=%d", table_nbr, hash );
     //    sprintf( buf, "SELECT COUNT(*) from games WHERE games.white = 'Carlsen, Magnus' AND games.game_id = positions_%d.game_id AND positions_%d.position_hash=%d", table_nbr, table_nbr, hash );
     cprintf("QUERY IN: %s\n",buf);
-    int retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &gbl_stmt, 0 );
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &stmt, 0 );
     cprintf("QUERY OUT: %s\n",buf);
     if( retval )
     {
         cprintf("SELECTING DATA FROM DB FAILED 1\n");
         return 0;
     }
+    int idx = sqlite3_bind_parameter_index( stmt, ":player" );
+    if( idx )
+        sqlite3_bind_text( stmt, idx, player_name.c_str(), -1, SQLITE_TRANSIENT );
     
     // Read the number of rows fetched
-    int cols = sqlite3_column_count(gbl_stmt);
+    int cols = sqlite3_column_count(stmt);
     
     cprintf( "Get games count begin\n");
     while(1)
     {
         // fetch a row's status
-        retval = sqlite3_step(gbl_stmt);
+        retval = sqlite3_step(stmt);
         
         if(retval == SQLITE_ROW)
         {
@@ -154,8 +737,8 @@ int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
             // sqlite3_column_text returns a const void* , typecast it to const char*
             for( int col=0; col<cols; col++ )
             {
-                const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                //printf("%s:%s\t",sqlite3_column_name(gbl_stmt,col),val);
+                const char *val = (const char*)sqlite3_column_text(stmt,col);
+                //printf("%s:%s\t",sqlite3_column_name(stmt,col),val);
                 if( col == 0 )
                 {
                     //int game_id = atoi(val);
@@ -168,91 +751,204 @@ int Database::SetPosition( thc::ChessRules &cr, std::string &player_name )
         else if( retval == SQLITE_DONE )
         {
             // All rows finished
-            sqlite3_finalize(gbl_stmt);
-            gbl_stmt = NULL;
             break;
         }
         else
         {
             // Some error encountered
             cprintf("SOME ERROR ENCOUNTERED\n");
+            break;
         }
     }
+    sqlite3_finalize(stmt);
     tprintf("Get games count end\n");
+    if( retval == SQLITE_DONE )
+        query_cache_add( key, game_count, false, gbl_game_ids );
     gbl_count = game_count;
+    gbl_count_hash = gbl_hash;
     return game_count;
 }
 
 
+static void loader_read_game( sqlite3_stmt *stmt, int first_col, DB_GAME_INFO &info )
+{
+    const char *val = (const char*)sqlite3_column_text(stmt,first_col);
+    info.white = val ? std::string(val) : "Whoops";
+    val = (const char*)sqlite3_column_text(stmt,first_col+1);
+    info.black = val ? std::string(val) : "Whoops";
+    val = (const char*)sqlite3_column_text(stmt,first_col+2);
+    info.result = val ? std::string(val) : "*";
+    int len = sqlite3_column_bytes(stmt,first_col+3);
+    const char *blob = (const char*)sqlite3_column_blob(stmt,first_col+3);
+    if( len && blob )
+        info.str_blob.assign(blob,len);
+    else
+        info.str_blob = "";
+}
+
+// Fetch a single game, with a statement prepared once and reused
+static sqlite3_stmt *gbl_game_stmt;
+
 static int virtual_dump_game( DB_GAME_INFO *info, int game_id )
 {
-    // Get white player
-    char buf[100];
-    sqlite3_stmt *stmt;    // A prepared statement for fetching from games table
-    int retval;
-    sprintf( buf, "SELECT white,black,result,moves from games WHERE game_id=%d", game_id );
-    retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &stmt, 0 );
-    if( retval )
+    int retval = 0;
+    if( !gbl_game_stmt )
     {
-        cprintf("SELECTING DATA FROM DB FAILED\n");
-        return retval;
+        retval = sqlite3_prepare_v2( gbl_handle, "SELECT white,black,result,moves from games WHERE game_id=?", -1, &gbl_game_stmt, 0 );
+        if( retval )
+        {
+            cprintf("sqlite3_prepare_v2(SELECT game) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+            gbl_game_stmt = NULL;
+            return retval;
+        }
     }
-    // Read the number of rows fetched
-    int cols = sqlite3_column_count(stmt);
-    retval = sqlite3_step(stmt);
+    sqlite3_bind_int( gbl_game_stmt, 1, game_id );
+    retval = sqlite3_step(gbl_game_stmt);
     if( retval == SQLITE_ROW )
     {
-        for( int col=0; col<cols; col++ )
+        info->game_id = game_id;
+        loader_read_game( gbl_game_stmt, 0, *info );
+        retval = 0;
+    }
+    else
+        cprintf("sqlite3_step(SELECT game %d) FAILED %s\n", game_id, sqlite3_errmsg(gbl_handle) );
+    sqlite3_reset(gbl_game_stmt);
+    return retval;
+}
+
+// Fetch a batch of games, one query for up to GAMES_PER_QUERY games rather
+//  than a query per game. The games are returned in the order of the game_ids
+#define GAMES_PER_QUERY 500     // SQLite allows at most 999 parameters
+
+static int games_read( sqlite3 *handle, const int *game_ids, int nbr, std::vector<DB_GAME_INFO> &games )
+{
+    int retval = 0;
+    for( int base=0; retval==0 && base<nbr; base+=GAMES_PER_QUERY )
+    {
+        int n = nbr-base<GAMES_PER_QUERY ? nbr-base : GAMES_PER_QUERY;
+        std::string sql = "SELECT game_id,white,black,result,moves from games WHERE game_id IN (?";
+        for( int i=1; i<n; i++ )
+            sql += ",?";
+        sql += ")";
+        sqlite3_stmt *stmt;
+        retval = sqlite3_prepare_v2( handle, sql.c_str(), -1, &stmt, 0 );
+        if( retval )
         {
-            switch(col)
-            {
-                case 0:
-                {
-                    // sqlite3_column_text returns a const void* , typecast it to const char*
-                    const char *val = (const char*)sqlite3_column_text(stmt,col);
-                    info->white = val;
-                    break;
-                }
-                case 1:
-                {
-                    const char *val = (const char*)sqlite3_column_text(stmt,col);
-                    info->black = val;
-                    break;
-                }
-                case 2:
-                {
-                    const char *val = (const char*)sqlite3_column_text(stmt,col);
-                    info->result = val;
-                    break;
-                }
-                case 3:
-                {
-                    int len = sqlite3_column_bytes(stmt,col);
-                    //fprintf(f,"Move len = %d\n",len);
-                    const char *blob = (const char*)sqlite3_column_blob(stmt,col);
-                    std::string str_blob(blob,len);
-                    info->str_blob = str_blob;
-                    break;
-                }
-            }
+            cprintf("sqlite3_prepare_v2(SELECT games IN) FAILED %s\n", sqlite3_errmsg(handle) );
+            break;
+        }
+        for( int i=0; i<n; i++ )
+            sqlite3_bind_int( stmt, i+1, game_ids[base+i] );
+        std::vector<DB_GAME_INFO> rows;
+        std::map<int,int> row_idx;  // game_id -> rows[] idx
+        while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+        {
+            DB_GAME_INFO info;
+            info.game_id = sqlite3_column_int(stmt,0);
+            loader_read_game( stmt, 1, info );
+            row_idx[info.game_id] = rows.size();
+            rows.push_back(info);
+        }
+        if( retval == SQLITE_DONE )
+            retval = 0;
+        else
+            cprintf("sqlite3_step(SELECT games IN) FAILED %s\n", sqlite3_errmsg(handle) );
+        sqlite3_finalize(stmt);
+        for( int i=0; i<n; i++ )
+        {
+            std::map<int,int>::iterator it = row_idx.find( game_ids[base+i] );
+            if( it != row_idx.end() )
+                games.push_back( rows[it->second] );
         }
     }
-    sqlite3_finalize(stmt);
-    stmt = NULL;
-    return 0;
+    return retval;
+}
+
+int Database::GetGames( const std::vector<int> &game_ids, std::vector<DB_GAME_INFO> &games )
+{
+    games.clear();
+    if( !gbl_handle )
+        return -1;
+    if( game_ids.size() != 1 )
+        return games_read( gbl_handle, game_ids.size() ? &game_ids[0] : NULL, game_ids.size(), games );
+    DB_GAME_INFO info;
+    int retval = virtual_dump_game( &info, game_ids[0] );
+    if( retval == 0 )
+        games.push_back(info);
+    return retval;
+}
+
+// The move text of games displayed recently. The list control asks for each
+//  row's text again every time it is redrawn, and generating the moves in SAN
+//  is comparatively expensive. Keyed by game_id and the hash of the position
+//  searched for (the position fixes the ply the text starts from), so it
+//  stays valid from one SetPosition() to the next. When full the least
+//  recently used text is dropped, found from the last_used clock values
+#define NBR_CACHED_MOVE_TXTS 20000
+struct MOVE_TXT
+{
+    std::string move_txt;
+    std::string next_move;
+    unsigned int last_used;
+};
+static std::map< std::pair<int,uint64_t>, MOVE_TXT > gbl_move_txts;
+static std::map< unsigned int, std::pair<int,uint64_t> > gbl_move_txts_by_age;  // last_used -> key
+static unsigned int gbl_move_txt_clock;
+
+static void move_txt_cache_clear()
+{
+    gbl_move_txts.clear();
+    gbl_move_txts_by_age.clear();
 }
 
 void db_calculate_move_txt( DB_GAME_INFO *info )
 {
+    std::pair<int,uint64_t> key( info->game_id, gbl_hash );
+    std::map< std::pair<int,uint64_t>, MOVE_TXT >::iterator it = gbl_move_txts.find(key);
+    if( it != gbl_move_txts.end() )
+    {
+        info->move_txt  = it->second.move_txt;
+        info->next_move = it->second.next_move;
+        gbl_move_txts_by_age.erase( it->second.last_used );
+        it->second.last_used = ++gbl_move_txt_clock;
+        gbl_move_txts_by_age[it->second.last_used] = key;
+        return;
+    }
+
+    // Replay up to the position. If its offset in the blob is known the moves
+    //  are only decompressed, else the position is found by its hash
     CompressMoves press;
     std::string move_txt;
-    size_t len = info->str_blob.length();
+    int len = (int)info->str_blob.length();
     const char *blob = (const char*)info->str_blob.c_str();
+    int offset = info->position_offset;
+    if( offset > len )
+        offset = -1;    // not from this blob somehow, find the position by its hash
     uint64_t hash = press.cr.Hash64Calculate();
-    bool triggered=(hash==gbl_hash), first=true;
-    for( int count=0, nbr=0; nbr<len; count++ )
+    bool triggered=(offset>=0 ? offset==0 : hash==gbl_hash), first=true;
+    int count=0, nbr=0;
+    while( !triggered && nbr<len )
+    {
+        thc::ChessPosition cr = press.cr;   // not ChessRules, no need to copy the move history
+        thc::Move mv;
+        int nbr_used = press.decompress_move( blob, mv );
+        if( nbr_used == 0 )
+            break;
+        blob += nbr_used;
+        nbr += nbr_used;
+        count++;
+        if( offset >= 0 )
+            triggered = (nbr >= offset);
+        else
+        {
+            hash = cr.Hash64Update( hash, mv );
+            triggered = (hash == gbl_hash);
+        }
+    }
+
+    // Then the moves from the position
+    for( ; triggered && nbr<len; count++ )
     {
-        
         thc::ChessRules cr = press.cr;
         thc::Move mv;
         int nbr_used = press.decompress_move( blob, mv );
@@ -260,35 +956,40 @@ void db_calculate_move_txt( DB_GAME_INFO *info )
             break;
         blob += nbr_used;
         nbr += nbr_used;
-        if( triggered )
+        std::string s = mv.NaturalOut(&cr);
+        if( first )
         {
-            std::string s = mv.NaturalOut(&cr);
-            if( first )
-            {
-                info->next_move = s;
-            }
-            if( count%2 == 0 || first )
+            info->next_move = s;
+        }
+        if( count%2 == 0 || first )
+        {
+            first = false;
+            char buf[20];
+            sprintf( buf, "%d%s", count/2+1, count%2==0?".":"..." );
+            move_txt += buf;
+        }
+        move_txt += s;
+        move_txt += " ";
+        if( nbr >= len )
+            move_txt += info->result;
+            else if( nbr<len-5 && move_txt.length()>100 )
             {
-                first = false;
-                char buf[20];
-                sprintf( buf, "%d%s", count/2+1, count%2==0?".":"..." );
-                move_txt += buf;
+                move_txt += "...";  // very long lines get over truncated by the list control (sad but true), see example below
+                break;
             }
-            move_txt += s;
-            move_txt += " ";
-            if( nbr >= len )
-                move_txt += info->result;
-                else if( nbr<len-5 && move_txt.length()>100 )
-                {
-                    move_txt += "...";  // very long lines get over truncated by the list control (sad but true), see example below
-                    break;
-                }
-        }
-        hash = cr.Hash64Update( hash, mv );
-        if( hash == gbl_hash )
-            triggered = true;
     }
     info->move_txt = move_txt;
+    if( gbl_move_txts.size() >= NBR_CACHED_MOVE_TXTS )
+    {
+        std::map< unsigned int, std::pair<int,uint64_t> >::iterator lru = gbl_move_txts_by_age.begin();
+        gbl_move_txts.erase( lru->second );
+        gbl_move_txts_by_age.erase( lru );
+    }
+    MOVE_TXT &cached = gbl_move_txts[key];
+    cached.move_txt  = info->move_txt;
+    cached.next_move = info->next_move;
+    cached.last_used = ++gbl_move_txt_clock;
+    gbl_move_txts_by_age[cached.last_used] = key;
     //fprintf(f,"\n");
     
     // very long line example;
@@ -308,7 +1009,7 @@ int db_calculate_move_vector( DB_GAME_INFO *info, std::vector<thc::Move> &moves
     for( int nbr=0; nbr<len;  )
     {
         thc::Move mv;
-        thc::ChessRules cr = press.cr;
+        thc::ChessPosition cr = press.cr;
         int nbr_used = press.decompress_move( blob, mv );
         if( nbr_used == 0 )
             break;
@@ -322,266 +1023,570 @@ int db_calculate_move_vector( DB_GAME_INFO *info, std::vector<thc::Move> &moves
     return ret;
 }
 
-static bool gbl_protect_recursion;   // FIXME
 
 
-int Database::GetRow( DB_GAME_INFO *info, int row )
+/*
+    The virtual list control asks for its rows one at a time. Rows are read a
+    page at a time, each page query seeks from the sort key of the last row of
+    the page before (keyset pagination) rather than stepping over all the
+    preceding rows with LIMIT offset,count, so a page deep into the list costs
+    no more than the first page. The most recently used pages are kept and the
+    page after the one being read is prefetched on a background thread with
+    its own (read only) connection. Jumping to a page whose start isn't known
+    yet (dragging the scroll bar thumb) first reads the sort keys of all the
+    rows, a single index scan, keeping the key each page starts after.
+ */
+#define PAGE_SIZE 100
+#define NBR_CACHED_PAGES 16
+
+// A row's place in the sort order, games.white then games.rowid at the
+//  start position, otherwise positions_N.game_id (descending)
+struct PAGE_KEY
+{
+    std::string white;
+    sqlite3_int64 id;
+};
+
+struct GAME_PAGE
+{
+    int page_nbr;
+    unsigned int last_used;
+    std::vector<DB_GAME_INFO> games;
+    PAGE_KEY last;      // sort key of the last row
+};
+
+// The page queries for the current SetPosition()
+struct PAGE_QUERY
 {
-    if( gbl_protect_recursion )
+    std::string sql_first;  // the first page
+    std::string sql_seek;   // any other page, the rows after :white,:id
+    std::string sql_keys;   // the sort keys of all the rows
+    std::string player;     // bound to :player, if used
+    sqlite3_int64 hash;     // bound to :hash, if used
+};
+
+static PAGE_QUERY gbl_page_query;
+static std::vector<GAME_PAGE> gbl_pages;            // least recently used dropped first
+static unsigned int gbl_page_clock;
+static std::map<int,PAGE_KEY> gbl_page_starts;      // page number -> key of the row before it
+static bool gbl_page_keys_read;
+
+static std::thread *gbl_prefetch;
+static std::atomic<bool> gbl_prefetch_done;
+static GAME_PAGE gbl_prefetch_page;                 // valid once the thread is done
+static bool gbl_prefetch_ok;
+static sqlite3 *gbl_prefetch_handle;                // from the pool while the thread runs
+
+static void page_bind( sqlite3_stmt *stmt, const PAGE_QUERY &pq, const PAGE_KEY *after )
+{
+    int idx = sqlite3_bind_parameter_index( stmt, ":player" );
+    if( idx )
+        sqlite3_bind_text( stmt, idx, pq.player.c_str(), -1, SQLITE_TRANSIENT );
+    idx = sqlite3_bind_parameter_index( stmt, ":hash" );
+    if( idx )
+        sqlite3_bind_int64( stmt, idx, pq.hash );
+    if( after )
     {
-        cprintf( "Didn't expect that\n");
-        return 0;
+        idx = sqlite3_bind_parameter_index( stmt, ":white" );
+        if( idx )
+            sqlite3_bind_text( stmt, idx, after->white.c_str(), -1, SQLITE_TRANSIENT );
+        idx = sqlite3_bind_parameter_index( stmt, ":id" );
+        if( idx )
+            sqlite3_bind_int64( stmt, idx, after->id );
+    }
+}
+
+// Read one page, the rows after the key (or the first page if none)
+static bool page_read( sqlite3 *handle, const PAGE_QUERY &pq, int page_nbr, const PAGE_KEY *after, GAME_PAGE &page )
+{
+    page.page_nbr = page_nbr;
+    page.games.clear();
+    const std::string &sql = after ? pq.sql_seek : pq.sql_first;
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( handle, sql.c_str(), -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("sqlite3_prepare_v2(%s) FAILED %s\n", sql.c_str(), sqlite3_errmsg(handle) );
+        return false;
+    }
+    page_bind( stmt, pq, after );
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        DB_GAME_INFO info;
+        info.game_id = sqlite3_column_int(stmt,0);
+        loader_read_game( stmt, 1, info );
+        info.transpo_nbr = 0;
+        page.games.push_back(info);
+        const char *val = (const char*)sqlite3_column_text(stmt,5);
+        page.last.white = val ? val : "";
+        page.last.id = sqlite3_column_int64(stmt,6);
     }
+    if( retval != SQLITE_DONE )
+        cprintf("sqlite3_step(page %d) FAILED %s\n", page_nbr, sqlite3_errmsg(handle) );
+    sqlite3_finalize(stmt);
+    return retval == SQLITE_DONE;
+}
+
+// Read the sort keys of all the rows, keeping the key each page starts after
+static void page_read_keys()
+{
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, gbl_page_query.sql_keys.c_str(), -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("sqlite3_prepare_v2(%s) FAILED %s\n", gbl_page_query.sql_keys.c_str(), sqlite3_errmsg(gbl_handle) );
+        return;
+    }
+    page_bind( stmt, gbl_page_query, NULL );
+    int row = 0;
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        row++;
+        if( row%PAGE_SIZE == 0 )
+        {
+            PAGE_KEY key;
+            const char *val = (const char*)sqlite3_column_text(stmt,0);
+            key.white = val ? val : "";
+            key.id = sqlite3_column_int64(stmt,1);
+            gbl_page_starts[row/PAGE_SIZE] = key;
+        }
+    }
+    if( retval != SQLITE_DONE )
+        cprintf("sqlite3_step(page keys) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+    sqlite3_finalize(stmt);
+    gbl_page_keys_read = true;
+    cprintf( "Page keys read, %d rows\n", row );
+}
+
+static GAME_PAGE *page_cache_add( GAME_PAGE &page )
+{
+    if( page.games.size() == PAGE_SIZE )
+        gbl_page_starts[page.page_nbr+1] = page.last;
+    if( gbl_pages.size() >= NBR_CACHED_PAGES )
+    {
+        unsigned int lru = 0;
+        for( unsigned int i=1; i<gbl_pages.size(); i++ )
+        {
+            if( gbl_pages[i].last_used < gbl_pages[lru].last_used )
+                lru = i;
+        }
+        gbl_pages.erase( gbl_pages.begin()+lru );
+    }
+    page.last_used = ++gbl_page_clock;
+    gbl_pages.push_back(page);
+    return &gbl_pages.back();
+}
+
+static GAME_PAGE *page_cache_find( int page_nbr )
+{
+    for( unsigned int i=0; i<gbl_pages.size(); i++ )
+    {
+        if( gbl_pages[i].page_nbr == page_nbr )
+        {
+            gbl_pages[i].last_used = ++gbl_page_clock;
+            return &gbl_pages[i];
+        }
+    }
+    return NULL;
+}
+
+static void prefetch_thread( PAGE_QUERY pq, int page_nbr, PAGE_KEY after )
+{
+    gbl_prefetch_ok = page_read( gbl_prefetch_handle, pq, page_nbr, &after, gbl_prefetch_page );
+    gbl_prefetch_done = true;
+}
+
+// Wait for the prefetch thread, keeping what it read unless cancelled
+static void prefetch_join( bool cancel )
+{
+    if( !gbl_prefetch )
+        return;
+    if( cancel )
+        sqlite3_interrupt( gbl_prefetch_handle );
+    gbl_prefetch->join();
+    delete gbl_prefetch;
+    gbl_prefetch = NULL;
+    db_pool_release( gbl_prefetch_handle );
+    gbl_prefetch_handle = NULL;
+    if( !cancel && gbl_prefetch_ok && !page_cache_find(gbl_prefetch_page.page_nbr) )
+        page_cache_add( gbl_prefetch_page );
+}
+
+static void prefetch_begin( int page_nbr, const PAGE_KEY &after )
+{
+    if( gbl_prefetch )
+        return;
+    gbl_prefetch_handle = db_pool_acquire();
+    if( !gbl_prefetch_handle )
+        return;
+    gbl_prefetch_done = false;
+    gbl_prefetch = new std::thread( prefetch_thread, gbl_page_query, page_nbr, after );
+}
+
+// Column 0 is the game_id, 1-4 the game (as loader_read_game()), 5-6 the sort key
+static void pages_set_query( bool start_pos, int table_nbr, sqlite3_int64 hash, const std::string &player_name, const std::string &player_cond )
+{
+    PAGE_QUERY &pq = gbl_page_query;
+    char buf[1000];
+    pq.player = player_name;
+    pq.hash = hash;
+    std::string player_and = player_cond.length() ? player_cond+" AND " : "";
+    std::string where_player = player_cond.length() ? " WHERE "+player_cond : "";
+    const char *player = player_and.c_str();
+    const char *columns = "games.game_id, games.white, games.black, games.result, games.moves";
+    if( start_pos )
+    {
+        sprintf( buf, "SELECT %s, games.white, games.rowid FROM games%s ORDER BY games.white, games.rowid LIMIT %d",
+                 columns, where_player.c_str(), PAGE_SIZE );
+        pq.sql_first = buf;
+        sprintf( buf, "SELECT %s, games.white, games.rowid FROM games WHERE %sgames.white>=:white AND (games.white>:white OR games.rowid>:id) "
+                      "ORDER BY games.white, games.rowid LIMIT %d", columns, player, PAGE_SIZE );
+        pq.sql_seek = buf;
+        sprintf( buf, "SELECT games.white, games.rowid FROM games%s ORDER BY games.white, games.rowid",
+                 where_player.c_str() );
+        pq.sql_keys = buf;
+    }
+    else
+    {
+        // Seek by positions_N.game_id (not games.rowid) so that the (position_hash,game_id) index gives
+        //  the order, the game_ids are allocated in rowid order. Grouped by game_id, a game that
+        //  repeats the position has more than one positions_N row but is one row of the list.
+        //  Databases get that index when they are built, an older one (indexed on position_hash
+        //  alone) only from the extra indexes step, until then each page sorts all the position's rows
+        const char *from = player_cond.length() ? "positions_%d JOIN games ON games.game_id = positions_%d.game_id" : "positions_%d";
+        char from_buf[200];
+        sprintf( from_buf, from, table_nbr, table_nbr );
+        sprintf( buf, "SELECT %s, '', positions_%d.game_id FROM positions_%d JOIN games ON games.game_id = positions_%d.game_id "
+                      "WHERE %spositions_%d.position_hash=:hash GROUP BY positions_%d.game_id ORDER BY positions_%d.game_id DESC LIMIT %d",
+                      columns, table_nbr, table_nbr, table_nbr, player, table_nbr, table_nbr, table_nbr, PAGE_SIZE );
+        pq.sql_first = buf;
+        sprintf( buf, "SELECT %s, '', positions_%d.game_id FROM positions_%d JOIN games ON games.game_id = positions_%d.game_id "
+                      "WHERE %spositions_%d.position_hash=:hash AND positions_%d.game_id<:id GROUP BY positions_%d.game_id "
+                      "ORDER BY positions_%d.game_id DESC LIMIT %d",
+                      columns, table_nbr, table_nbr, table_nbr, player, table_nbr, table_nbr, table_nbr, table_nbr, PAGE_SIZE );
+        pq.sql_seek = buf;
+        sprintf( buf, "SELECT DISTINCT '', positions_%d.game_id FROM %s WHERE %spositions_%d.position_hash=:hash ORDER BY positions_%d.game_id DESC",
+                      table_nbr, from_buf, player, table_nbr, table_nbr );
+        pq.sql_keys = buf;
+    }
+}
+
+// Forget the pages of the previous SetPosition()
+static void pages_reset()
+{
+    prefetch_join( true );
+    gbl_pages.clear();
+    gbl_page_starts.clear();
+    gbl_page_keys_read = false;
+}
+
+int Database::GetRow( DB_GAME_INFO *info, int row )
+{
     gbl_current = row;
-    cprintf( "db_virtual_row() IN row=%d, expected=%d,%smatch\n", row, gbl_expected, row==gbl_expected?" ":" no " );
     int retval = -1;
     if( !gbl_handle || row>=gbl_count )
     {
         return retval;
     }
-    static int cols;
-    for(;;)
+
+    int page_nbr = row / PAGE_SIZE;
+    if( gbl_prefetch && gbl_prefetch_done )
+        prefetch_join( false );
+    GAME_PAGE *page = page_cache_find( page_nbr );
+    if( !page && gbl_by_game_id )
+    {
+        std::vector<int> game_ids;
+        rows_game_ids( page_nbr*PAGE_SIZE, PAGE_SIZE, game_ids );
+        GAME_PAGE fetched;
+        fetched.page_nbr = page_nbr;
+        retval = GetGames( game_ids, fetched.games );
+        if( retval )
+            return retval;
+        page = page_cache_add( fetched );
+        retval = -1;
+        cprintf( "db_virtual_row() page %d read (game ids), %d rows\n", page_nbr, (int)page->games.size() );
+    }
+    if( !page && gbl_prefetch )
+    {
+        prefetch_join( false );     // most likely reading the page we want
+        page = page_cache_find( page_nbr );
+    }
+    if( !page )
     {
-        if( row == gbl_expected )
+        std::map<int,PAGE_KEY>::iterator it = gbl_page_starts.find( page_nbr );
+        if( page_nbr>0 && it==gbl_page_starts.end() && !gbl_page_keys_read )
         {
-            gbl_expected++;
-            for(;;)
-            {
-                // fetch a row's status
-                retval = sqlite3_step(gbl_stmt);
-                if( retval == SQLITE_ROW )
-                {
-                    // SQLITE_ROW means fetched a row
-                    
-                    // sqlite3_column_text returns a const void* , typecast it to const char*
-                    for( int col=0; col<cols; col++ )
-                    {
-                        const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                        //printf("%s:%s\t",sqlite3_column_name(gbl_stmt,col),val);
-                        if( col == 0 )
-                        {
-                            int game_id = atoi(val);
-                            retval = virtual_dump_game( info, game_id );
-                            db_calculate_move_txt(info);
-                            cprintf( "db_virtual_row() SUCCESS game_id = %d\n", game_id );
-                            return retval;
-                        }
-                    }
-                }
-                else if( retval == SQLITE_DONE )
-                {
-                    // All rows finished
-                    sqlite3_finalize(gbl_stmt);
-                    gbl_stmt = NULL;
-                    gbl_expected = -1;
-                    cprintf( "Limit reached\n");
-                    break;
-                }
-                else
-                {
-                    // Some error encountered
-                    cprintf("SOME ERROR ENCOUNTERED\n");
-                    return retval;
-                }
-            }
+            page_read_keys();
+            it = gbl_page_starts.find( page_nbr );
         }
-        else
+        if( page_nbr>0 && it==gbl_page_starts.end() )
         {
-            // select matching rows from the table
-            char buf[1000];
-            gbl_expected = row;
-            // sprintf( buf, "SELECT game_id from positions WHERE position_hash=%d LIMIT %d,100", gbl_hash, row );
-//            sprintf( buf, "SELECT positions.game_id from positions JOIN games ON games.game_id = positions.game_id AND positions.position_hash=%d ORDER BY games.white LIMIT %d,100", gbl_hash, row );
-            //sprintf( buf, "SELECT positions.game_id from positions JOIN games ON games.game_id = positions.game_id AND positions.position_hash=%d LIMIT %d,100", gbl_hash, row );
-            uint64_t temp = gbl_hash;
-            int hash = (int)(temp);
-            int table_nbr = (int)((temp>>32)&(NBR_BUCKETS-1));
-            // sprintf( buf, "SELECT positions_%d.game_id from positions_%d JOIN games ON games.game_id = positions_%d.game_id AND positions_%d.position_hash=%d LIMIT %d,100",
-            //        table_nbr, table_nbr, table_nbr, table_nbr, hash, row );
-            if( is_start_pos )
-            {
-                sprintf( buf,
-                        "SELECT games.game_id from games%s ORDER BY games.white ASC LIMIT %d,100", where_white.c_str(), row );
-            }
-            else
-            {
-                sprintf( buf,
-//#define NO_REVERSE
-#ifdef NO_REVERSE
-                        "SELECT games.game_id from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d LIMIT %d,100",
-#else
-                        "SELECT games.game_id from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d ORDER BY games.rowid DESC LIMIT %d,100",
-#endif
-                        table_nbr, table_nbr, white_and.c_str(), table_nbr, hash, row );
-            }
-            retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &gbl_stmt, 0 );
-            cprintf( "db_virtual_row() START query: %s\n",buf);
-            if( retval )
-            {
-                cprintf("SELECTING DATA FROM DB FAILED 2\n");
-                return retval;
-            }
-
-            // Read the number of rows fetched
-            cols = sqlite3_column_count(gbl_stmt);
+            cprintf( "db_virtual_row() row=%d, no key for page %d\n", row, page_nbr );
+            return retval;
         }
+        GAME_PAGE fetched;
+        if( !page_read( gbl_handle, gbl_page_query, page_nbr, page_nbr>0 ? &it->second : NULL, fetched ) )
+            return retval;
+        page = page_cache_add( fetched );
+        cprintf( "db_virtual_row() page %d read, %d rows\n", page_nbr, (int)page->games.size() );
     }
+    unsigned int offset = row % PAGE_SIZE;
+    if( offset >= page->games.size() )
+        return retval;
+    *info = page->games[offset];
+    if( gbl_offsets_read )
+        info->position_offset = offset_find( info->game_id );    // if the games have been loaded anyway
+    if( !gbl_by_game_id && page->games.size()==PAGE_SIZE && (page_nbr+1)*PAGE_SIZE<gbl_count && !page_cache_find(page_nbr+1) )
+        prefetch_begin( page_nbr+1, page->last );
+    db_calculate_move_txt(info);
+    return 0;
 }
 
 
-int Database::LoadAllGames( std::vector<DB_GAME_INFO> &cache, int nbr_games )
+// A single indexed read of the opening tree, the rows identify each move by
+//  the hash of the position it leads to
+bool Database::GetMoveStats( thc::ChessRules &cr, std::map< uint32_t, MOVE_STATS > &stats )
 {
-    gbl_protect_recursion = true;
+    stats.clear();
+    uint64_t hash = cr.Hash64Calculate();
 
-    wxProgressDialog progress( "Loading games", "Loading games", 100, NULL,
-                              wxPD_APP_MODAL+
-                              wxPD_AUTO_HIDE+
-                              wxPD_ELAPSED_TIME+
-                              wxPD_CAN_ABORT+
-                              wxPD_ESTIMATED_TIME );
-    
-    int retval=-1;
-    cache.clear();
-    
-    // select matching rows from the table
+    // The tree is only complete if every game that reaches the position does
+    //  so in its first OPENING_TREE_PLIES plies (with a move to follow), which
+    //  is checked below against the number of games SetPosition() found
+    if( !gbl_handle || !gbl_opening_tree || player_name.length()>0 || has_details || hash!=gbl_count_hash || gbl_count==0 )
+        return false;
+    std::map< uint64_t, thc::Move > moves;
+    std::vector<thc::Move> legal;
+    cr.GenLegalMoveList( legal );
+    for( unsigned int i=0; i<legal.size(); i++ )
+        moves[ cr.Hash64Update(hash,legal[i]) ] = legal[i];
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, "SELECT next_hash, nbr_games, nbr_white_wins, nbr_black_wins, nbr_draws, elo_total, nbr_elo "
+                                                 "FROM opening_tree WHERE position_hash=?", -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("sqlite3_prepare_v2(SELECT opening_tree) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+        return false;
+    }
+    sqlite3_bind_int64( stmt, 1, (sqlite3_int64)hash );
+    int nbr_games = 0;
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        std::map< uint64_t, thc::Move >::iterator it = moves.find( (uint64_t)sqlite3_column_int64(stmt,0) );
+        if( it == moves.end() )
+            continue;   // a hash collision, from some other position
+        MOVE_STATS ms;
+        ms.nbr_games      = sqlite3_column_int  ( stmt, 1 );
+        ms.nbr_white_wins = sqlite3_column_int  ( stmt, 2 );
+        ms.nbr_black_wins = sqlite3_column_int  ( stmt, 3 );
+        ms.nbr_draws      = sqlite3_column_int  ( stmt, 4 );
+        ms.elo_total      = sqlite3_column_int64( stmt, 5 );
+        ms.nbr_elo        = sqlite3_column_int  ( stmt, 6 );
+        uint32_t imv;
+        memcpy( &imv, &it->second, sizeof(imv) );
+        stats[imv] = ms;
+        nbr_games += ms.nbr_games;
+    }
+    sqlite3_finalize(stmt);
+    if( retval != SQLITE_DONE )
+    {
+        cprintf("sqlite3_step(SELECT opening_tree) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+        stats.clear();
+        return false;
+    }
+
+    // Fewer games in the tree than reach the position, so some reach it later
+    //  (by transposition or from a set up position) or end there
+    if( nbr_games != gbl_count )
+    {
+        stats.clear();
+        return false;
+    }
+    return true;
+}
+
+// The query for all the games found by SetPosition(), game_id, white, black,
+//  result and moves columns. A player name is bound to :player
+std::string Database::AllGamesQuery()
+{
     char buf[1000];
-    gbl_expected = -1;
-    uint64_t temp = gbl_hash;
-    int hash = (int)(temp);
-    int table_nbr = (int)((temp>>32)&(NBR_BUCKETS-1));
+    int table_nbr;
+    sqlite3_int64 hash;
+    position_key( gbl_hash, gbl_position.white, table_nbr, hash );
     if( is_start_pos )
     {
         sprintf( buf,
-                "SELECT games.game_id from games%s ORDER BY games.white ASC", where_white.c_str() );
+                "SELECT games.game_id, games.white, games.black, games.result, games.moves from games%s ORDER BY games.white ASC", where_white.c_str() );
     }
     else
     {
         sprintf( buf,
 #ifdef NO_REVERSE
-                "SELECT games.game_id, games.white, games.black, games.result, games.moves from games, positions_%d WHERE games.game_id = positions_%d.game_id AND %spositions_%d.position_hash=%d",
+                "SELECT games.game_id, games.white, games.black, games.result, games.moves from games, positions_%d WHERE games.game_id = positions_%d.game_id AND %spositions_%d.position_hash=%lld GROUP BY games.game_id",
                 //"SELECT games.game_id, games.white, games.black, games.result, games.moves from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d",
 #else
-                "SELECT games.game_id, games.white, games.black, games.result, games.moves from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%d ORDER BY games.rowid DESC",
+                "SELECT games.game_id, games.white, games.black, games.result, games.moves from games JOIN positions_%d ON games.game_id = positions_%d.game_id WHERE %spositions_%d.position_hash=%lld GROUP BY games.game_id ORDER BY games.rowid DESC",
 #endif
-                table_nbr, table_nbr, white_and.c_str(), table_nbr, hash);
+                table_nbr, table_nbr, white_and.c_str(), table_nbr, (long long)hash);
     }
-    cprintf( "LoadAllGames() START query: %s\n",buf);
-    retval = sqlite3_prepare_v2( gbl_handle, buf, -1, &gbl_stmt, 0 );
-    if( retval )
+    return std::string(buf);
+}
+
+/*
+    Background load of all the games found by SetPosition(). A thread with its
+    own (read only) connection from the pool runs the query and hands over the games in
+    batches, the dialog polls for them (from a timer) so it stays responsive
+    and can show the games as they arrive. Cancelling interrupts the SQLite
+    statement, rather than waiting for it to complete.
+ */
+#define LOADER_BATCH 1000
+
+static std::thread *gbl_loader;
+static sqlite3 *gbl_loader_handle;                  // from the pool while the thread runs
+static std::atomic<bool> gbl_loader_cancel;
+static std::mutex gbl_loader_mutex;                 // protects the following
+static std::vector<DB_GAME_INFO> gbl_loader_games;  // loaded but not yet polled
+static bool gbl_loader_done;
+
+static void loader_hand_over( std::vector<DB_GAME_INFO> &batch )
+{
+    std::lock_guard<std::mutex> lock(gbl_loader_mutex);
+    gbl_loader_games.insert( gbl_loader_games.end(), batch.begin(), batch.end() );
+    batch.clear();
+}
+
+// Either run the query, or (if there are game ids from the position index)
+//  read the games a batch at a time
+static void loader_thread( sqlite3 *handle, std::string query, std::string player, std::vector<int> game_ids )
+{
+    int retval = 0;
+    std::vector<DB_GAME_INFO> batch;
+    int nbr_games = 0;
+    if( game_ids.size() > 0 )
     {
-        cprintf("SELECTING DATA FROM DB FAILED 2\n");
-        gbl_protect_recursion = false;
-        return retval;
+        for( unsigned int i=0; retval==0 && !gbl_loader_cancel && i<game_ids.size(); i+=LOADER_BATCH )
+        {
+            int n = game_ids.size()-i < LOADER_BATCH ? game_ids.size()-i : LOADER_BATCH;
+            retval = games_read( handle, &game_ids[i], n, batch );
+            nbr_games += batch.size();
+            loader_hand_over(batch);
+        }
     }
-    
-    // Read the game info
-    int cols = sqlite3_column_count(gbl_stmt);
-    for(;;)
+    else
     {
-        retval = sqlite3_step(gbl_stmt);
-        if( retval == SQLITE_ROW )
+        sqlite3_stmt *stmt;
+        retval = sqlite3_prepare_v2( handle, query.c_str(), -1, &stmt, 0 );
+        if( retval && !gbl_loader_cancel )
+            cprintf("sqlite3_prepare_v2(%s) FAILED %s\n", query.c_str(), sqlite3_errmsg(handle) );
+        int idx = retval ? 0 : sqlite3_bind_parameter_index( stmt, ":player" );
+        if( idx )
+            sqlite3_bind_text( stmt, idx, player.c_str(), -1, SQLITE_TRANSIENT );
+        while( retval==0 && !gbl_loader_cancel )
         {
-            DB_GAME_INFO info;
-
-            // SQLITE_ROW means fetched a row
-            
-            // sqlite3_column_text returns a const void* , typecast it to const char*
-            for( int col=0; col<cols; col++ )
-            {
-                if( col == 0 )
-                {
-                    const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                    info.game_id = atoi(val);
-                }
-                else if( col == 1 )
-                {
-                    const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                    info.white = val ? std::string(val) : "Whoops";
-                }
-                else if( col == 2 )
-                {
-                    const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                    info.black = val ? std::string(val) : "Whoops";
-                }
-                else if( col == 3 )
-                {
-                    const char *val = (const char*)sqlite3_column_text(gbl_stmt,col);
-                    info.result = val ? std::string(val) : "*";
-                }
-                else if( col == 4 )
-                {
-                    int len = sqlite3_column_bytes(gbl_stmt,col);
-                    //fprintf(f,"Move len = %d\n",len);
-                    const char *blob = (const char*)sqlite3_column_blob(gbl_stmt,col);
-                    if( len && blob )
-                    {
-                        std::string str_blob(blob,len);
-                        info.str_blob = str_blob;
-                    }
-                    else
-                        info.str_blob = "";
-                }
-            }
-            cache.push_back( info );
-
-            int percent = (cache.size()*100) / (nbr_games?nbr_games:1);
-            if( percent < 1 )
-                percent = 1;
-            if( !progress.Update( percent>100 ? 100 : percent ) )
+            retval = sqlite3_step(stmt);
+            if( retval == SQLITE_ROW )
             {
-                cache.clear();
-                break;
+                DB_GAME_INFO info;
+                info.game_id = sqlite3_column_int(stmt,0);
+                loader_read_game( stmt, 1, info );
+                batch.push_back(info);
+                nbr_games++;
+                if( batch.size() >= LOADER_BATCH )
+                    loader_hand_over(batch);
+                retval = 0;
             }
+            else if( retval!=SQLITE_DONE && !gbl_loader_cancel )
+                cprintf("sqlite3_step(load games) FAILED %s\n", sqlite3_errmsg(handle) );
         }
-        else if( retval == SQLITE_DONE )
-        {
-            // All rows finished
-            sqlite3_finalize(gbl_stmt);
-            gbl_stmt = NULL;
-            cprintf("LoadAllGames(): %u game_ids loaded\n", cache.size() );
-            break;
-        }
-        else
-        {
-            // Some error encountered
-            cprintf("SOME ERROR ENCOUNTERED\n");
-            gbl_protect_recursion = false;
-            return retval;
-        }
+        loader_hand_over(batch);
+        if( stmt )
+            sqlite3_finalize(stmt);
     }
-    gbl_protect_recursion = false;
-    return retval;
+    cprintf("Background load: %d games loaded\n", nbr_games );
+    std::lock_guard<std::mutex> lock(gbl_loader_mutex);
+    gbl_loader_done = true;
 }
 
-// Returns row
-int Database::FindRow( std::string &name )
+bool Database::LoadAllGamesBegin()
 {
-    int row=0;
-    char upper='A', lower='a';
-    if( isalpha(name[0]) )
+    LoadAllGamesCancel();
+    if( !gbl_handle )
+        return false;
+    std::string query;
+    std::vector<int> game_ids;
+    if( gbl_by_game_id )
     {
-        upper = name[0];
-        lower = tolower(upper);
-        upper = toupper(lower);
+        rows_game_ids( 0, gbl_count, game_ids );
+        if( game_ids.size() == 0 )
+            return false;
     }
-    int retval = sqlite3_prepare_v2( gbl_handle, "SELECT games.white from games ORDER BY games.white ASC", -1, &gbl_stmt, 0 );
-    bool okay = !retval;
-    while( okay )
+    else
+        query = AllGamesQuery();
+    gbl_loader_handle = db_pool_acquire();
+    if( !gbl_loader_handle )
+        return false;
+    cprintf( "Background load begin: %s\n", gbl_by_game_id ? "(game ids)" : query.c_str() );
+    gbl_loader_games.clear();
+    gbl_loader_done = false;
+    gbl_loader_cancel = false;
+    gbl_loader = new std::thread( loader_thread, gbl_loader_handle, query, player_name, game_ids );
+    return true;
+}
+
+bool Database::LoadAllGamesPoll( std::vector<DB_GAME_INFO> &cache )
+{
+    if( !gbl_loader )
+        return false;
+    bool done;
+    size_t before = cache.size();
     {
-        retval = sqlite3_step(gbl_stmt);
-        okay = ( retval == SQLITE_ROW );
-        if( okay )
-        {
-            const char *val = (const char*)sqlite3_column_text(gbl_stmt,0);
-            std::string srow(val);
-            if( srow >= name ) //&& (*val==lower || *val==upper) )
-                break;
-            row++;
-        }
+        std::lock_guard<std::mutex> lock(gbl_loader_mutex);
+        cache.insert( cache.end(), gbl_loader_games.begin(), gbl_loader_games.end() );
+        gbl_loader_games.clear();
+        done = gbl_loader_done;
     }
-    sqlite3_finalize(gbl_stmt);
-    gbl_stmt = NULL;
-    gbl_expected = -1;
+    offsets_apply( cache, before, is_start_pos );
+    if( done )
+    {
+        gbl_loader->join();
+        delete gbl_loader;
+        gbl_loader = NULL;
+        db_pool_release( gbl_loader_handle );
+        gbl_loader_handle = NULL;
+    }
+    return !done;
+}
+
+void Database::LoadAllGamesCancel()
+{
+    if( !gbl_loader )
+        return;
+    gbl_loader_cancel = true;
+    sqlite3_interrupt( gbl_loader_handle );
+    gbl_loader->join();
+    delete gbl_loader;
+    gbl_loader = NULL;
+    db_pool_release( gbl_loader_handle );
+    gbl_loader_handle = NULL;
+    gbl_loader_games.clear();
+    cprintf( "Background load cancelled\n" );
+}
+
+// Returns row, the number of games with a white player that sorts before name
+int Database::FindRow( std::string &name )
+{
+    int row=0;
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( gbl_handle, "SELECT COUNT(*) from games WHERE games.white<?", -1, &stmt, 0 );
+    if( retval )
+    {
+        cprintf("sqlite3_prepare_v2(SELECT COUNT white) FAILED %s\n", sqlite3_errmsg(gbl_handle) );
+        return row;
+    }
+    sqlite3_bind_text( stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT );
+    if( SQLITE_ROW == sqlite3_step(stmt) )
+        row = sqlite3_column_int(stmt,0);
+    sqlite3_finalize(stmt);
     return row;
 }
 
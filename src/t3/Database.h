@@ -9,11 +9,12 @@
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include <map>
 #include "thc.h"
-#include "GameDocument.h"
 
 struct DB_GAME_INFO
 {
+    DB_GAME_INFO() { game_id=0; transpo_nbr=0; position_offset=-1; }
     int game_id;
     std::string white;
     std::string black;
@@ -22,29 +23,91 @@ struct DB_GAME_INFO
     std::string str_blob;
     std::string next_move;
     int transpo_nbr;
+    int position_offset;    // length of str_blob up to the position searched for, -1 if not known
+};
+
+// Each move in a given position has stats associated with it
+struct MOVE_STATS
+{
+    int nbr_games;
+    int nbr_white_wins;
+    int nbr_black_wins;
+    int nbr_draws;
+    int nbr_elo;            // players who made the move with a known Elo
+    int64_t elo_total;      //  and the sum of their Elos
+
+    // Sort according to number of games
+    bool operator < (const MOVE_STATS& ms)  const { return nbr_games < ms.nbr_games; }
+    bool operator > (const MOVE_STATS& ms)  const { return nbr_games > ms.nbr_games; }
+    bool operator == (const MOVE_STATS& ms) const { return nbr_games == ms.nbr_games; }
 };
 
 //FIXME - reorganise these
 void db_calculate_move_txt( DB_GAME_INFO *info );
 int  db_calculate_move_vector( DB_GAME_INFO *info, std::vector<thc::Move> &moves );
+bool db_exact_position_keys();  // false for an old database, whose searches can find false matches
+
+// Which of a player's games a player name search finds
+#define PLAYER_WHITE  0
+#define PLAYER_BLACK  1
+#define PLAYER_EITHER 2
+
+// Criteria for a search, as well as the position, a game must match all of them
+struct DB_SEARCH
+{
+    DB_SEARCH() { player_colour=PLAYER_WHITE; year_min=year_max=0; elo_min=elo_max=0; }
+    std::string player;     // "" for any
+    int player_colour;      // PLAYER_WHITE, PLAYER_BLACK or PLAYER_EITHER
+    std::string result;     // "1-0", "0-1", "1/2-1/2" or "" for any
+    int year_min;           // 0 for no limit
+    int year_max;
+    int elo_min;            // both players, 0 for no limit
+    int elo_max;
+    std::string eco;        // an ECO code or the start of one ("B" or "B9"), "" for any
+    bool HasDetails() const { return result.length()>0 || year_min>0 || year_max>0 || elo_min>0 || elo_max>0 || eco.length()>0; }
+};
+
+// Set the game details criteria of a search from text like
+//  "result=1-0 year=1990-1999 elo=2500- eco=B9". Ranges can be open at either
+//  end. Returns false if the text isn't understood
+bool db_search_parse( const std::string &txt, DB_SEARCH &search );
 
 class Database
 {
 public:
-    Database();
+    Database( const char *db_file );
     ~Database();
 
     int SetPosition( thc::ChessRules &cr );
-    int SetPosition( thc::ChessRules &cr, std::string &player_name );
+    int SetPosition( thc::ChessRules &cr, std::string &player_name, int player_colour=PLAYER_WHITE );
+    int SetPosition( thc::ChessRules &cr, const DB_SEARCH &search );
     int GetRow( DB_GAME_INFO *info, int row );
-    int LoadAllGames( std::vector<DB_GAME_INFO> &cache, int nbr_games );
+
+    // Fetch games by game_id with a single query (per 500 games), in the
+    //  order of the game_ids
+    int GetGames( const std::vector<int> &game_ids, std::vector<DB_GAME_INFO> &games );
+
+    // Next move stats from the opening tree, keyed by the move's 32 bit image,
+    //  for the position of the last SetPosition(). Returns false if not
+    //  available (an old database, a player name or game details search, or
+    //  some of the position's games don't reach it in the tree's first plies)
+    bool GetMoveStats( thc::ChessRules &cr, std::map< uint32_t, MOVE_STATS > &stats );
+
+    // Load all the games found by SetPosition() on a background thread. Poll
+    //  adds the games loaded so far to cache and returns false once the load
+    //  is complete (or cancelled, or never started)
+    bool LoadAllGamesBegin();
+    bool LoadAllGamesPoll( std::vector<DB_GAME_INFO> &cache );
+    void LoadAllGamesCancel();
     bool TestNextRow();
     bool TestPrevRow();
     int GetCurrent();
     int FindRow( std::string &name );
     
 private:
+    std::string AllGamesQuery();
     std::string player_name;
+    bool has_details;       // a search on game details as well
     bool is_start_pos;
     std::string where_white;
     std::string white_and;
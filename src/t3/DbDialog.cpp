@@ -69,6 +69,7 @@ BEGIN_EVENT_TABLE( DbDialog, wxDialog )
     EVT_LIST_ITEM_ACTIVATED(ID_PGN_LISTBOX, DbDialog::OnListSelected)
     EVT_LIST_COL_CLICK(ID_PGN_LISTBOX, DbDialog::OnListColClick)
     EVT_NOTEBOOK_PAGE_CHANGED( wxID_ANY, DbDialog::OnTabSelected)
+    EVT_TIMER( ID_DB_LOAD_TIMER, DbDialog::OnLoadTimer )
 END_EVENT_TABLE()
 
 // It's a pity we have these static vars, but unfortunately OnGetItemText() must be const for some reason
@@ -90,26 +91,13 @@ bool DbDialog::ReadItemFromMemory( int item )
     {
         in_memory = true;
         gbl_info = games[item];
-        gbl_info.transpo_nbr = 0;
         cprintf( "ReadItemFromMemory(%d), white=%s\n", item, gbl_info.white.c_str() );
         if( gbl_info.move_txt.length() == 0 )
-        {
             db_calculate_move_txt(&gbl_info);
-            if( transpo_activated && transpositions.size() > 1 )
-            {
-                for( unsigned int j=0; j<transpositions.size(); j++ )
-                {
-                    std::string &this_one = transpositions[j].blob;
-                    const char *p = this_one.c_str();
-                    size_t len = this_one.length();
-                    if( gbl_info.str_blob.length()>=len && 0 == memcmp(p,gbl_info.str_blob.c_str(),len) )
-                    {
-                        gbl_info.transpo_nbr = j+1;
-                        break;
-                    }
-                }
-            }
-        }
+
+        // The path to the position was found when the stats were calculated
+        if( !transpo_activated || transpositions.size() <= 1 )
+            gbl_info.transpo_nbr = 0;
     }
     return in_memory;
 }
@@ -124,6 +112,7 @@ public:
     {
         focus_idx = 0;
         focus_offset = 0;
+        focus_move_txt_offset = -1;
         gbl_last_item = -1;
     }
     //~wxVirtualListCtrl();
@@ -136,6 +125,12 @@ public:
     int initial_focus_offset;
     MiniBoard *mini_board;
 
+    // The focus row's move text is drawn again on every refresh, so the last
+    //  one calculated is kept, with its position, until the focus moves
+    mutable int focus_move_txt_offset;
+    mutable std::string focus_move_txt;
+    mutable thc::ChessPosition focus_move_txt_position;
+
     // Read game information from games or database
     void ReadItem( int item ) const
     {
@@ -167,6 +162,7 @@ public:
         bufb[19] = '\0';
         sprintf( buf, "%s - %s", bufw, bufb );
         initial_focus_offset = focus_offset = db_calculate_move_vector( &gbl_info, gbl_focus_moves );
+        focus_move_txt_offset = -1;
         if( mini_board )
         {
             CalculateMoveTxt();
@@ -179,6 +175,11 @@ public:
 
     std::string CalculateMoveTxt() const
     {
+        if( focus_move_txt_offset == focus_offset )
+        {
+            gbl_updated_position = focus_move_txt_position;
+            return focus_move_txt;
+        }
         std::string move_txt;
         thc::ChessRules cr;
         bool first=true;
@@ -215,6 +216,9 @@ public:
             move_txt = gbl_info.result;
         }
         //cprintf( "CalculateMoveTxt(): [%s]%s\n", move_txt.c_str(), gbl_updated_position.ToDebugStr().c_str() );
+        focus_move_txt_offset = focus_offset;
+        focus_move_txt = move_txt;
+        focus_move_txt_position = gbl_updated_position;
         return move_txt;
     }
     
@@ -326,6 +330,10 @@ void DbDialog::Init()
     db_game_set = false;
     activated_at_least_once = false;
     transpo_activated = false;
+    loading = false;
+    stats_cache_size = 0;
+    tree_stats_ok = false;
+    load_timer.SetOwner( this, ID_DB_LOAD_TIMER );
     wxAcceleratorEntry entries[5];
     entries[0].Set(wxACCEL_CTRL,  (int) 'X',     wxID_CUT);
     entries[1].Set(wxACCEL_CTRL,  (int) 'C',     wxID_COPY);
@@ -560,23 +568,29 @@ void DbDialog::CreateControls()
                                  wxT("&Filter"), wxDefaultPosition, wxDefaultSize, 0 );
     vsiz_panel_buttons->Add(filter_ctrl, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
     filter_ctrl->SetValue( false );
+
+    // Text control for the game details filter, see db_search_parse()
+    filter_text_ctrl = new wxTextCtrl ( this, ID_DB_FILTER_TEXT, wxT(""), wxDefaultPosition, wxDefaultSize, 0 );
+    vsiz_panel_buttons->Add(filter_text_ctrl, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
+    filter_text_ctrl->SetSize((sz2.x*118)/32,sz2.y);
+    filter_text_ctrl->SetValue("year=1990- elo=2400-");
     
     /*radio_ctrl = new wxRadioButton( this,  ID_DB_RADIO,
      wxT("&Radio"), wxDefaultPosition, wxDefaultSize,  wxRB_GROUP );
      vsiz_panel_buttons->Add(radio_ctrl, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
      radio_ctrl->SetValue( false ); */
     
+    // Which of the named player's games to find, in PLAYER_WHITE,
+    //  PLAYER_BLACK, PLAYER_EITHER order
     wxString combo_array[9];
-    combo_array[0] = "Equals";
-    combo_array[1] = "Starts with";
-    combo_array[2] = "Ends with";
+    combo_array[PLAYER_WHITE]  = "As White";
+    combo_array[PLAYER_BLACK]  = "As Black";
+    combo_array[PLAYER_EITHER] = "Either colour";
     combo_ctrl = new wxComboBox ( this, ID_DB_COMBO,
-                                 "None", wxDefaultPosition,
+                                 combo_array[PLAYER_WHITE], wxDefaultPosition,
                                  wxSize(50, wxDefaultCoord), 3, combo_array, wxCB_READONLY );
     vsiz_panel_buttons->Add(combo_ctrl, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
-    wxString combo;
-    combo = "None";
-    combo_ctrl->SetValue(combo);
+    combo_ctrl->SetSelection(PLAYER_WHITE);
     wxSize sz3=combo_ctrl->GetSize();
     combo_ctrl->SetSize((sz3.x*118)/32,sz3.y);      // temp temp
     
@@ -728,7 +742,6 @@ void DbDialog::LoadGame( int idx )
         CompressMoves press;
         for( int nbr=0; nbr<len;  )
         {
-            thc::ChessRules cr = press.cr;
             thc::Move mv;
             int nbr_used = press.decompress_move( blob, mv );
             if( nbr_used == 0 )
@@ -851,13 +864,16 @@ void DbDialog::OnSpin( wxCommandEvent& event )
 
 void DbDialog::OnComboBox( wxCommandEvent& event )
 {
+    cprintf( "OnComboBox()\n");
+    wxCommandEvent dummy;
+    OnReload( dummy );
 }
 
 void DbDialog::OnCheckBox( wxCommandEvent& event )
 {
     cprintf( "OnCheckBox()\n");
-    list_ctrl->SetItemCount(20);//gbl_nbr);
-    list_ctrl->RefreshItems(0,19);
+    wxCommandEvent dummy;
+    OnReload( dummy );
 }
 
 
@@ -867,8 +883,8 @@ void DbDialog::OnReload( wxCommandEvent& WXUNUSED(event) )
     std::string sname(name.c_str());
     thc::ChessPosition start_cp;
     
-    // Temp - do a "find on page type feature"
-    if( sname.length()>0 && cr==start_cp )
+    // Temp - do a "find on page type feature" (the list is in White's order)
+    if( sname.length()>0 && cr==start_cp && !filter_ctrl->GetValue() && combo_ctrl->GetSelection()==PLAYER_WHITE )
     {
         int row = objs.db->FindRow( sname );
         list_ctrl->EnsureVisible( row );   // get vaguely close
@@ -877,7 +893,26 @@ void DbDialog::OnReload( wxCommandEvent& WXUNUSED(event) )
     }
     else
     {
-        gbl_nbr = objs.db->SetPosition( cr, sname );
+        DB_SEARCH search;
+        if( sname != "Name" )   // the prompt, not a player
+            search.player = sname;
+        int sel = combo_ctrl->GetSelection();
+        if( sel==PLAYER_BLACK || sel==PLAYER_EITHER )
+            search.player_colour = sel;
+        if( filter_ctrl->GetValue() )
+        {
+            std::string filter( filter_text_ctrl->GetValue().c_str() );
+            if( !db_search_parse( filter, search ) )
+            {
+                wxMessageBox( "Filter not understood, use for example\n"
+                              "result=1-0 year=1990-1999 elo=2500- eco=B9",
+                              "Database filter", wxOK|wxICON_ERROR, this );
+                return;
+            }
+        }
+        load_timer.Stop();  // SetPosition() cancels any background load
+        loading = false;
+        gbl_nbr = objs.db->SetPosition( cr, search );
         char buf[200];
         sprintf(buf,"List of %d matching games from the database",gbl_nbr);
         title_ctrl->SetLabel( buf );
@@ -898,10 +933,9 @@ template<typename A, typename B>
 std::multimap<B,A> flip_and_sort_map(const std::map<A,B> &src)
 {
     std::multimap<B,A> dst;
-#ifdef MAC_FIX_LATER    // doesn't compile in Visual C++
-    std::transform(src.begin(), src.end(), std::inserter(dst, dst.begin()),
-                   flip_pair<A,B>);
-#endif
+    typename std::map<A,B>::const_iterator it;
+    for( it=src.begin(); it!=src.end(); it++ )
+        dst.insert( flip_pair<A,B>(*it) );
     return dst;
 }
 
@@ -970,28 +1004,56 @@ double AutoTimer::End()
 
 void DbDialog::OnUtility( wxCommandEvent& WXUNUSED(event) )
 {
+    // Load all the matching games from the database in the background, the
+    //  stats are calculated as the games arrive
+    load_timer.Stop();
+    cache.clear();
+    stats_cache_size = 0;
+    moves_from_base_position.clear();
+    moves_in_this_position.clear();
+    loading = objs.db->LoadAllGamesBegin();
+    if( loading )
+        load_timer.Start( 250 );
+}
+
+void DbDialog::OnLoadTimer( wxTimerEvent& WXUNUSED(event) )
+{
+    size_t before = cache.size();
+    loading = objs.db->LoadAllGamesPoll( cache );
+    if( !loading )
     {
-        AutoTimer at("1) Load games into memory");
-        
-        // Load all the matching games from the database
-        objs.db->LoadAllGames( cache, gbl_nbr );
+        load_timer.Stop();
+        cprintf( "Background load complete, %lu games\n", (unsigned long)cache.size() );
     }
+
+    // Games are only ever added to the end of the list, so after the first
+    //  batch the user's place in the list can be kept, and only the new
+    //  games need be added to the stats
+    if( cache.size()>before || !loading )
     {
-        AutoTimer at("2) Calculate stats");
-        moves_from_base_position.clear();
-        moves_in_this_position.clear();
-        StatsCalculate();
+        AutoTimer at("Calculate stats");
+        StatsCalculate( before > 0, true );
     }
 }
 
-void DbDialog::StatsCalculate()
+// Calculate the stats for the games in cache, or with more==true add the
+//  games loaded since the last calculation
+void DbDialog::StatsCalculate( bool keep_focus, bool more )
 {
-    transpositions.clear();
-    stats.clear();
-    games.clear();
-    cprintf( "Remove focus %d\n", list_ctrl->focus_idx );
-    list_ctrl->SetItemState( list_ctrl->focus_idx, 0, wxLIST_STATE_FOCUSED );
-    list_ctrl->SetItemState( list_ctrl->focus_idx, 0, wxLIST_STATE_SELECTED );
+    if( stats_cache_size==0 || stats_cache_size>cache.size() )
+        more = false;
+    if( !more )
+    {
+        transpositions.clear();
+        stats.clear();
+        games.clear();
+    }
+    if( !keep_focus )
+    {
+        cprintf( "Remove focus %d\n", list_ctrl->focus_idx );
+        list_ctrl->SetItemState( list_ctrl->focus_idx, 0, wxLIST_STATE_FOCUSED );
+        list_ctrl->SetItemState( list_ctrl->focus_idx, 0, wxLIST_STATE_SELECTED );
+    }
 
     
     thc::ChessRules cr_to_match = this->cr;
@@ -1013,105 +1075,20 @@ void DbDialog::StatsCalculate()
     extern void db_set_gbl_position( thc::ChessPosition &pos );   // FIXME this is an abomination
     db_set_gbl_position( cr_to_match );   // FIXME this is an abomination
 
-    // hash to match
-    uint64_t gbl_hash = cr_to_match.Hash64Calculate();
-    
-    int maxlen = 1000000;   // absurdly large until a match found
-
-    // For each cached game
-    for( unsigned int i=0; i<cache.size(); i++ )
+    // An old database's position keys can give false matches
+    bool exact = db_exact_position_keys();
+    if( more )
+        db_stats_calculate_more( cache, stats_cache_size, cr_to_match, exact, games, transpositions, stats );
+    else
     {
-        DB_GAME_INFO info = cache[i];
-    
-        // Search for a match to this game
-        bool new_transposition_found=false;
-        bool found=false;
-        int found_idx=0;
-        for( unsigned int j=0; !found && j<transpositions.size(); j++ )
-        {
-            std::string &this_one = transpositions[j].blob;
-            const char *p = this_one.c_str();
-            size_t len = this_one.length();
-            if( info.str_blob.length()>=len && 0 == memcmp(p,info.str_blob.c_str(),len) )
-            {
-                found = true;
-                found_idx = j;
-            }
-        }
-        
-        // If none so far add the one from this game
-        if( !found )
-        {
-            PATH_TO_POSITION ptp;
-            size_t len = info.str_blob.length();
-            const char *blob = (const char*)info.str_blob.c_str();
-            uint64_t hash = ptp.press.cr.Hash64Calculate();
-            int nbr=0;
-            found = (hash==gbl_hash && ptp.press.cr==cr_to_match );
-            while( !found && nbr<len && nbr<maxlen )
-            {
-                thc::ChessRules cr_hash = ptp.press.cr;
-                thc::Move mv;
-                int nbr_used = ptp.press.decompress_move( blob, mv );
-                if( nbr_used == 0 )
-                    break;
-                blob += nbr_used;
-                nbr += nbr_used;
-                hash = cr_hash.Hash64Update( hash, mv );
-                if( hash == gbl_hash && ptp.press.cr==cr_to_match )
-                    found = true;
-            }
-            if( found )
-            {
-                maxlen = nbr+8;
-                new_transposition_found = true;
-                ptp.blob =info.str_blob.substr(0,nbr);
-                transpositions.push_back(ptp);
-                found_idx = transpositions.size()-1;
-            }
-        }
+        db_stats_calculate( cache, cr_to_match, exact, games, transpositions, stats );
 
-        if( found )
-        {
-            games.push_back(info);
-            PATH_TO_POSITION *p = &transpositions[found_idx];
-            p->frequency++;
-            size_t len = p->blob.length();
-            if( len < info.str_blob.length() ) // must be more moves
-            {
-                const char *compress_move_ptr = info.str_blob.c_str()+len;
-                thc::Move mv;
-                p->press.decompress_move_stay( compress_move_ptr, mv );
-                uint32_t imv = 0;
-                assert( sizeof(imv) == sizeof(mv) );
-                memcpy( &imv, &mv, sizeof(mv) ); // FIXME
-                std::map< uint32_t, MOVE_STATS >::iterator it;
-                it = stats.find(imv);
-                if( it == stats.end() )
-                {
-                    MOVE_STATS empty;
-                    empty.nbr_games = 0;
-                    empty.nbr_white_wins = 0;
-                    empty.nbr_black_wins = 0;
-                    empty.nbr_draws = 0;
-                    stats[imv] = empty;
-                    it = stats.find(imv);
-                }
-                it->second.nbr_games++;
-                if( info.result == "1-0" )
-                    it->second.nbr_white_wins++;
-                else if( info.result== "0-1" )
-                    it->second.nbr_black_wins++;
-                else if( info.result== "1/2-1/2" )
-                    it->second.nbr_draws++;
-            }
-        }
-        
-        if( new_transposition_found )
-        {
-            std::sort( transpositions.rbegin(), transpositions.rend() );
-        }
+        // If the position is in the opening tree, the stats cover every game in
+        //  the database rather than just the games loaded (so loading more
+        //  games doesn't change them)
+        tree_stats_ok = objs.db->GetMoveStats( cr_to_match, tree_stats );
     }
+    stats_cache_size = cache.size();
 
     wxArrayString strings;
     if( !list_ctrl_stats )
@@ -1131,7 +1108,7 @@ void DbDialog::StatsCalculate()
     moves_in_this_position.clear();
 
     // Sort the stats according to number of games
-    std::multimap< MOVE_STATS,  uint32_t > dst = flip_and_sort_map(stats);
+    std::multimap< MOVE_STATS,  uint32_t > dst = flip_and_sort_map( tree_stats_ok ? tree_stats : stats );
     std::multimap< MOVE_STATS,  uint32_t >::reverse_iterator it;
     for( it=dst.rbegin(); it!=dst.rend(); it++ )
     {
@@ -1161,6 +1138,8 @@ void DbDialog::StatsCalculate()
                 s.c_str(),
                 nbr_games, percentage_score,
                 nbr_white_wins, nbr_black_wins, nbr_draws );
+        if( it->first.nbr_elo > 0 )
+            sprintf( buf+strlen(buf), ", average Elo %d", (int)(it->first.elo_total/it->first.nbr_elo) );
         cprintf( "%s\n", buf );
         wxString wstr(buf);
         strings.Add(wstr);
@@ -1210,10 +1189,13 @@ void DbDialog::StatsCalculate()
     gbl_nbr = games.size();
     list_ctrl->SetItemCount(gbl_nbr);
     list_ctrl->RefreshItems( 0, gbl_nbr-1 );
-    list_ctrl->SetItemState(0, wxLIST_STATE_SELECTED, wxLIST_STATE_SELECTED);
-    list_ctrl->ReceiveFocus(0);
+    if( !keep_focus )
+    {
+        list_ctrl->SetItemState(0, wxLIST_STATE_SELECTED, wxLIST_STATE_SELECTED);
+        list_ctrl->ReceiveFocus(0);
+    }
     char buf[200];
-    sprintf(buf,"List of %d matching games from the database",gbl_nbr);
+    sprintf(buf,"List of %d matching games from the database%s",gbl_nbr, loading?" (loading)":"");
     title_ctrl->SetLabel( buf );
 
     int top = list_ctrl->GetTopItem();
@@ -1222,7 +1204,8 @@ void DbDialog::StatsCalculate()
         count = gbl_nbr;
     for( int i=0; i<count; i++ )
         list_ctrl->RefreshItem(top++);
-    list_ctrl->SetFocus();
+    if( !keep_focus )
+        list_ctrl->SetFocus();
 }
 
 // Move Stats or Transpostitions selected
@@ -1352,6 +1335,8 @@ void DbDialog::OnNextMove( wxCommandEvent &event )
 bool DbDialog::ShowModalOk()
 {
     bool ok = (wxID_OK == ShowModal());
+    load_timer.Stop();
+    objs.db->LoadAllGamesCancel();
     objs.repository->nv.m_col0  = list_ctrl->GetColumnWidth( 0 );    // "Game #"
     objs.repository->nv.m_col1  = list_ctrl->GetColumnWidth( 1 );    // "White"
     objs.repository->nv.m_col2  = list_ctrl->GetColumnWidth( 2 );    // "Elo W"
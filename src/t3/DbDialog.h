@@ -9,6 +9,7 @@
 #include "wx/spinctrl.h"
 #include "wx/statline.h"
 #include "wx/accel.h"
+#include "wx/timer.h"
 #include "SuspendEngine.h"
 #include "GamesCache.h"
 #include "GameDocument.h"
@@ -16,6 +17,7 @@
 #include "MiniBoard.h"
 #include "CompressMoves.h"
 #include "Database.h"
+#include "DbStats.h"
 #include "PgnDialog.h"
 
 // Control identifiers
@@ -29,40 +31,13 @@ enum
     ID_DB_TEXT          = 10005,
     ID_DB_LISTBOX_GAMES = 10006,
     ID_DB_LISTBOX_STATS = 10007,
-    ID_DB_LISTBOX_TRANSPO = 10008
+    ID_DB_LISTBOX_TRANSPO = 10008,
+    ID_DB_LOAD_TIMER    = 10009,
+    ID_DB_FILTER_TEXT   = 10010
 };
 
 class wxVirtualListCtrl;
 
-// Each move in a given position has stats associated with it
-struct MOVE_STATS
-{
-    int nbr_games;
-    int nbr_white_wins;
-    int nbr_black_wins;
-    int nbr_draws;
-    
-    // Sort according to number of games
-    bool operator < (const MOVE_STATS& ms)  const { return nbr_games < ms.nbr_games; }
-    bool operator > (const MOVE_STATS& ms)  const { return nbr_games > ms.nbr_games; }
-    bool operator == (const MOVE_STATS& ms) const { return nbr_games == ms.nbr_games; }
-};
-
-// Individual path to a given position
-struct PATH_TO_POSITION
-{
-    PATH_TO_POSITION() { frequency=0; }
-    int frequency;
-    std::string blob;
-    CompressMoves press;    // Each of the different blobs has its own decompressor - necessary for situations where
-    //  for example the knights have swapped places - position is same but compressor state is not
-    
-    // Sort according to frequency
-    bool operator < (const PATH_TO_POSITION& ptp)  const { return frequency < ptp.frequency; }
-    bool operator > (const PATH_TO_POSITION& ptp)  const { return frequency > ptp.frequency; }
-    bool operator == (const PATH_TO_POSITION& ptp) const { return frequency == ptp.frequency; }
-};
-
 // DbDialog class declaration
 class DbDialog: public wxDialog
 {    
@@ -80,6 +55,11 @@ private:
     
     // Map each move in the position to move stats
     std::map< uint32_t, MOVE_STATS > stats;
+    size_t stats_cache_size;    // the games in cache that the above cover
+
+    // The same from the opening tree, if it covers the position
+    std::map< uint32_t, MOVE_STATS > tree_stats;
+    bool tree_stats_ok;
     
 public:
 
@@ -129,6 +109,7 @@ public:
     void OnListColClick( wxListEvent &event );
     void OnTabSelected( wxBookCtrlEvent &event );
     void OnNextMove( wxCommandEvent &event );
+    void OnLoadTimer( wxTimerEvent &event );
 
     // wxEVT_COMMAND_BUTTON_CLICKED event handler for wxID_OK
     void OnOkClick( wxCommandEvent& event );
@@ -157,7 +138,7 @@ public:
     void OnCheckBox( wxCommandEvent& event );
     
     bool ReadItemFromMemory( int item ); //const
-    void StatsCalculate();
+    void StatsCalculate( bool keep_focus=false, bool more=false );
     
 //  void OnClose( wxCloseEvent& event );
 //  void SaveColumns();
@@ -190,12 +171,15 @@ private:
     wxRadioButton *radio_ctrl;
     wxComboBox *combo_ctrl;
     wxTextCtrl *text_ctrl;
+    wxTextCtrl *filter_text_ctrl;   // game details criteria, used if filter_ctrl is checked
     wxListBox *list_ctrl_stats;
     wxListBox *list_ctrl_transpo;
     wxButton *utility;
     MiniBoard *mini_board;
     bool activated_at_least_once;
     bool transpo_activated;
+    bool loading;           // games are being loaded into cache in the background
+    wxTimer load_timer;     // polls for them
     
     wxWindowID  id;
     int file_game_idx;
@@ -6,139 +6,157 @@
  ****************************************************************************/
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include "thc.h"
 #include "PgnRead.h"
+#include "PgnSource.h"
 #include "CompressMoves.h"
+#include "QgnFile.h"
 #include "DbPrimitives.h"
 #include "DbMaintenance.h"
 
-//-- Temp - hardwire .pgn file and database name
-#define PGN_FILE        "/Users/billforster/Documents/ChessDatabases/twic_minimal_overlap.pgn"
-#define PGN_OUT_FILE    "/Users/billforster/Documents/ChessDatabases/twic_minimal_overlap.pgn"
-#define QGN_FILE        "/Users/billforster/Documents/ChessDatabases/twic_minimal_overlap.qgn"
-
 static FILE *ifile;
 static FILE *ofile;
+static void close_files();
 
-static void decompress_game( const char *compressed_header, const char *compressed_moves );
+static QgnWriter *qgn_writer;
+static int  decompress_pipeline( QgnReader *reader, FILE *ofile );
 static void game_to_qgn_file( const char *event, const char *site, const char *date, const char *round,
                              const char *white, const char *black, const char *result, const char *white_elo, const char *black_elo, const char *eco,
                              int nbr_moves, thc::Move *moves, uint64_t *hashes );
-static void compress_moves_to_str( int nbr_moves, thc::Move *moves, char *dst, thc::ChessPosition *positions );
-static void decompress_moves_from_str( int nbr_moves, char *src, thc::Move *moves, thc::ChessPosition *positions  );
-static void verify_compression_algorithm( int nbr_moves, thc::Move *moves );
+static void verify_pgn_game( void *callback_context, const char *white, const char *black, const char *event, int nbr_moves, thc::Move *moves );
+static int  verify_pipeline( FILE *ifile, bool database );
+static void ingest_game_to_batch( void *callback_context, const char *white, const char *black, const char *event, const char *site, const char *date, const char *result,
+                                 const char *white_elo, const char *black_elo, const char *eco, int nbr_moves, thc::Move *moves, uint64_t *hashes );
+static int  ingest_pipeline( FILE *ifile );
 
 void db_maintenance_speed_tests()
 {
     db_primitive_speed_tests();
 }
 
-void db_maintenance_decompress_pgn()
+static void close_files()
 {
-    static char header_buf[2000];
-    static char moves_buf[2000];
-    bool ok = false;
-    ifile = fopen( QGN_FILE, "rb" );
-    if( !ifile )
-        printf( "Cannot open %s\n", QGN_FILE );
-    else
-    {
-        ofile = fopen( PGN_OUT_FILE, "wb" );
-        if( ofile )
-            ok = true;
-        else
-            printf( "Cannot open %s\n", PGN_OUT_FILE );
-    }
-    int nbr_games=0;
-    while( ok )
-    {
-        if( !fgets( header_buf, sizeof(header_buf)-5, ifile ) )
-            break;
-        if( !fgets( moves_buf, sizeof(moves_buf)-5, ifile ) )
-            break;
-        size_t len = strlen(header_buf);
-        if( len>0 && header_buf[len-1]=='\n' )
-            header_buf[len-1] = '\0';
-        len = strlen(moves_buf);
-        if( len>0 && moves_buf[len-1]=='\n' )
-            moves_buf[len-1] = '\0';
-        decompress_game( header_buf, moves_buf );
-        nbr_games++;
-        if(
-           ((nbr_games%100) == 0 ) /* ||
-                                      (
-                                      (nbr_games < 100) &&
-                                      ((nbr_games%10) == 0 )
-                                      ) */
-           )
-            printf( "%d games\n", nbr_games );
-    }
-    printf( "%d games\n", nbr_games );
     if( ifile )
         fclose(ifile);
     if( ofile )
         fclose(ofile);
+    ifile = NULL;
+    ofile = NULL;
+}
+
+// Returns the number of games decompressed, or -1 if the .qgn file cannot be
+//  opened or is damaged
+int db_maintenance_decompress_pgn( const char *qgn_filename, const char *pgn_filename )
+{
+    int nbr_games = -1;
+    QgnReader reader;
+    if( !reader.Open(qgn_filename) )
+        printf( "Cannot open %s (or it is not a binary .qgn file)\n", qgn_filename );
+    else
+    {
+        ofile = fopen( pgn_filename, "wb" );
+        if( !ofile )
+            printf( "Cannot open %s\n", pgn_filename );
+        else
+        {
+            nbr_games = decompress_pipeline( &reader, ofile );
+            if( fclose(ofile) != 0 )
+            {
+                printf( "Error writing %s\n", pgn_filename );
+                nbr_games = -1;
+            }
+            ofile = NULL;
+        }
+    }
+    close_files();
+    return nbr_games;
 }
 
-void db_maintenance_verify_compression()
+// Returns the number of failures, or -1 if the file cannot be opened
+int db_maintenance_verify_compression_pgn( const char *pgn_filename )
 {
-    ifile = fopen( PGN_FILE, "rt" );
+    int nbr_failures = -1;
+    ifile = fopen( pgn_filename, "rt" );
     if( !ifile )
-        printf( "Cannot open %s\n", PGN_FILE );
+        printf( "Cannot open %s\n", pgn_filename );
     else
     {
-        PgnRead *pgn = new PgnRead('V');
-        pgn->Process(ifile);
+        printf( "Verify compression, %s\n", pgn_filename );
+        nbr_failures = verify_pipeline( ifile, false );
     }
-    if( ifile )
-        fclose(ifile);
-    if( ofile )
-        fclose(ofile);
+    close_files();
+    return nbr_failures;
 }
 
-void db_maintenance_compress_pgn()
+// Returns the number of failures
+int db_maintenance_verify_compression_database()
 {
-    ifile = fopen( PGN_FILE, "rt" );
+    printf( "Verify compression, %s\n", db_primitive_get_database_file() );
+    db_primitive_open_multi();
+    int nbr_failures = verify_pipeline( NULL, true );
+    db_primitive_close();
+    return nbr_failures;
+}
+
+// Returns false if the files cannot be opened
+bool db_maintenance_compress_pgn( const char *pgn_filename, const char *qgn_filename )
+{
+    bool ok = false;
+    ifile = fopen( pgn_filename, "rt" );
     if( !ifile )
-        printf( "Cannot open %s\n", PGN_FILE );
+        printf( "Cannot open %s\n", pgn_filename );
     else
     {
-        ofile = fopen( QGN_FILE, "wb" );
-        if( !ofile )
-            printf( "Cannot open %s\n", QGN_FILE );
+        QgnWriter writer;
+        if( !writer.Open(qgn_filename) )
+            printf( "Cannot open %s\n", qgn_filename );
         else
         {
+            qgn_writer = &writer;
             PgnRead *pgn = new PgnRead('P');
             pgn->Process(ifile);
+            delete pgn;
+            qgn_writer = NULL;
+            ok = writer.Close();
+            if( !ok )
+                printf( "Error writing %s\n", qgn_filename );
+            printf( "%d games\n", (int)writer.NbrGames() );
         }
     }
-    if( ifile )
-        fclose(ifile);
-    if( ofile )
-        fclose(ofile);
+    close_files();
+    return ok;
 }
 
-
-void db_maintenance_create_or_append_to_database(  const char *pgn_filename )
+// Returns the number of games added, or -1 if the file cannot be opened or
+//  the build failed (the games of the failed transaction are rolled back)
+int db_maintenance_create_or_append_to_database(  const char *pgn_filename )
 {
+    int nbr_added = -1;
     ifile = fopen( pgn_filename , "rt" );
     if( !ifile )
         printf( "Cannot open %s\n", pgn_filename );
     else
     {
-        PgnRead *pgn = new PgnRead('A');
         db_primitive_open_multi();
         db_primitive_transaction_begin();
         db_primitive_count_games();
-        pgn->Process(ifile);
+        nbr_added = ingest_pipeline(ifile);
         db_primitive_create_indexes_multi();
-        db_primitive_transaction_end();
+        if( !db_primitive_transaction_end() )
+            nbr_added = -1;
         db_primitive_close();
     }
-    if( ifile )
-        fclose(ifile);
-    if( ofile )
-        fclose(ofile);
+    close_files();
+    return nbr_added;
 }
 
 void db_maintenance_create_extra_indexes()
@@ -150,7 +168,14 @@ void db_maintenance_create_extra_indexes()
     db_primitive_close();
 }
 
-void hook_gameover( char callback_code, const char *event, const char *site, const char *date, const char *round,
+void db_maintenance_create_position_index()
+{
+    db_primitive_open_multi();
+    db_primitive_build_position_index();
+    db_primitive_close();
+}
+
+void hook_gameover( char callback_code, void *callback_context, const char *event, const char *site, const char *date, const char *round,
                   const char *white, const char *black, const char *result, const char *white_elo, const char *black_elo, const char *eco,
                   int nbr_moves, thc::Move *moves, uint64_t *hashes )
 {
@@ -160,218 +185,407 @@ void hook_gameover( char callback_code, const char *event, const char *site, con
         case 'P': game_to_qgn_file( event, site, date, round, white, black, result, white_elo, black_elo, eco, nbr_moves, moves, hashes );  break;
             
         // Append
-        case 'A': db_primitive_insert_game_multi( white, black, event, site, result, nbr_moves, moves, hashes ); break;
+        case 'A': db_primitive_insert_game_multi( white, black, event, site, date, result, atoi(white_elo), atoi(black_elo), eco, nbr_moves, moves, hashes ); break;
             
         // Verify
-        case 'V': verify_compression_algorithm( nbr_moves, moves ); break;
+        case 'V': verify_pgn_game( callback_context, white, black, event, nbr_moves, moves ); break;
+
+        // Ingest pipeline worker
+        case 'T': ingest_game_to_batch( callback_context, white, black, event, site, date, result, white_elo, black_elo, eco, nbr_moves, moves, hashes ); break;
     }
 }
 
 
-// Compress
-static void game_to_qgn_file( const char *event, const char *site, const char *date, const char *round,
-                       const char *white, const char *black, const char *result, const char *white_elo, const char *black_elo, const char *eco,
-                       int nbr_moves, thc::Move *moves, uint64_t *hashes )
+/*
+    Multi-threaded ingest pipeline
 
+    A reader thread splits the .pgn file into chunks of whole games. A pool of
+    worker threads each run their own PgnRead on a chunk, producing a batch of
+    games with compressed moves and 64 bit position hashes. A single writer
+    thread (the only user of the sqlite handle) puts the batches back in file
+    order before inserting them, so game ids are exactly the same as for a
+    simple single threaded read of the file.
+ */
+
+#define INGEST_CHUNK_SIZE       1000000     // approx bytes of .pgn per chunk
+#define INGEST_COMMIT_QUOTA     100000      // games per transaction
+
+struct INGEST_CHUNK
 {
-    static char last_event    [ FIELD_BUFLEN + 10];
-    static char last_site     [ FIELD_BUFLEN + 10];
-    static char last_date     [ FIELD_BUFLEN + 10];
-    static char last_round    [ FIELD_BUFLEN + 10];
-    static char last_white    [ FIELD_BUFLEN + 10];
-    static char last_black    [ FIELD_BUFLEN + 10];
-    static char last_result   [ FIELD_BUFLEN + 10];
-    static char last_white_elo[ FIELD_BUFLEN + 10];
-    static char last_black_elo[ FIELD_BUFLEN + 10];
-    static char last_eco      [ FIELD_BUFLEN + 10];
-    static char buf[ 10 * sizeof(last_eco) ];
-    char *dst = buf;
-    char *last;
-    const char *src;
-    for( int i=0; i<10; i++ )
-    {
-        switch(i)
+    int seq;
+    const char *ptr;        // either a span of a memory mapped file
+    size_t len;
+    std::string text;       //  or a copy if the file couldn't be mapped
+};
+
+struct INGEST_GAME
+{
+    std::string white;
+    std::string black;
+    std::string date;
+    std::string result;
+    int white_elo;
+    int black_elo;
+    std::string eco;
+    std::string blob;
+    std::vector<uint64_t> hashes;
+};
+
+struct INGEST_BATCH
+{
+    int seq;
+    std::vector<INGEST_GAME> games;
+};
+
+// A simple bounded blocking queue, Push() blocks while the queue is full, Pop()
+//  blocks while it is empty, Pop() returns false once the queue is closed and drained
+template <class T> class IngestQueue
+{
+public:
+    IngestQueue( size_t capacity ) { this->capacity=capacity; closed=false; }
+    void Push( T &&item )
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_full.wait( lock, [this]{ return q.size()<capacity; } );
+        q.push_back( std::move(item) );
+        not_empty.notify_one();
+    }
+    bool Pop( T &item )
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_empty.wait( lock, [this]{ return closed || q.size()>0; } );
+        if( q.size() == 0 )
+            return false;
+        item = std::move(q.front());
+        q.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+    void Close()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        closed = true;
+        not_empty.notify_all();
+    }
+private:
+    std::deque<T> q;
+    size_t capacity;
+    bool closed;
+    std::mutex mtx;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+// Callback from a worker's PgnRead
+static void ingest_game_to_batch( void *callback_context, const char *white, const char *black, const char *event, const char *site, const char *date, const char *result,
+                                 const char *white_elo, const char *black_elo, const char *eco, int nbr_moves, thc::Move *moves, uint64_t *hashes )
+{
+    char blob_buf[2000];    // up to 2 bytes per move
+    INGEST_BATCH *batch = (INGEST_BATCH *)callback_context;
+    batch->games.push_back( INGEST_GAME() );
+    INGEST_GAME &game = batch->games.back();
+    game.white  = white;
+    game.black  = black;
+    game.date   = date;
+    game.result = result;
+    game.white_elo = atoi(white_elo);
+    game.black_elo = atoi(black_elo);
+    game.eco = eco;
+    int blob_len = db_primitive_compress_moves( nbr_moves, moves, blob_buf, sizeof(blob_buf) );
+    game.blob.assign( blob_buf, blob_len );
+    game.hashes.assign( hashes, hashes+nbr_moves );
+}
+
+// Split the file into chunks of whole games
+static void ingest_reader( PgnSource *source, IngestQueue<INGEST_CHUNK> *chunks )
+{
+    PGN_SPAN span;
+    int seq = 0;
+    while( source->GetGames(span,INGEST_CHUNK_SIZE) )
+    {
+        INGEST_CHUNK chunk;
+        chunk.seq = seq++;
+        if( source->IsMapped() )
         {
-            case 0: src=white;      last=last_white;        break;
-            case 1: src=white_elo;  last=last_white_elo;    break;
-            case 2: src=black;      last=last_black;        break;
-            case 3: src=black_elo;  last=last_black_elo;    break;
-            case 4: src=result;     last=last_result;       break;
-            case 5: src=date;       last=last_date;         break;
-            case 6: src=event;      last=last_event;        break;
-            case 7: src=site;       last=last_site;         break;
-            case 8: src=round;      last=last_round;        break;
-            case 9: src=eco;        last=last_eco;          break;
+            chunk.ptr = span.ptr;   // zero copy, the mapping outlives the workers
+            chunk.len = span.len;
         }
-        if( *src )
+        else
         {
-            bool same               = (0==strcmp(src,last));
-            bool same_as_black_name = (i==0 && (0==strcmp(src,last_black))); 
-            bool same_as_black_elo  = (i==1 && (0==strcmp(src,last_black_elo))); 
-            bool same_as_white_name = (i==2 && (0==strcmp(src,last_white))); 
-            bool same_as_white_elo  = (i==3 && (0==strcmp(src,last_white_elo)));
-            if( i>3 && !same ) 
-                strcpy( last, src );
-            else if( i == 3 )
-            {
-                strcpy( last_white,      white      );
-                strcpy( last_white_elo,  white_elo  );
-                strcpy( last_black,      black      );
-                strcpy( last_black_elo,  black_elo  );
-            }
-            bool result             = (i==4);
-            if( result && 0==strcmp(src,"1-0") ) 
-                *dst++ = '1';
-            else if( result && 0==strcmp(src,"0-1") ) 
-                *dst++ = '0';
-            else if( result && 0==strcmp(src,"1/2-1/2") ) 
-                *dst++ = '=';
-            else if( result )
-                *dst++ = '*';
-            else if( same )
-                *dst++ = '^';
-            else if( same_as_black_name )
-                *dst++ = '>';
-            else if( same_as_black_elo )
-                *dst++ = '>';
-            else if( same_as_white_name )
-                *dst++ = '<';
-            else if( same_as_white_elo )
-                *dst++ = '<';
-            else
+            chunk.ptr = NULL;
+            chunk.len = 0;
+            chunk.text.assign( span.ptr, span.len );
+        }
+        chunks->Push( std::move(chunk) );
+    }
+    chunks->Close();
+}
+
+static void ingest_worker( IngestQueue<INGEST_CHUNK> *chunks, IngestQueue<INGEST_BATCH> *batches )
+{
+    INGEST_CHUNK chunk;
+    INGEST_BATCH batch;
+    PgnRead *pgn = new PgnRead('T',&batch);
+    while( chunks->Pop(chunk) )
+    {
+        batch.seq = chunk.seq;
+        batch.games.clear();
+        if( chunk.ptr )
+            pgn->Process( chunk.ptr, chunk.len );
+        else
+            pgn->Process( chunk.text.c_str(), chunk.text.length() );
+        batches->Push( std::move(batch) );
+        batch = INGEST_BATCH();
+    }
+    delete pgn;
+}
+
+// Batches can arrive out of order, hold them until their turn comes
+static void ingest_writer( IngestQueue<INGEST_BATCH> *batches, int *nbr_added )
+{
+    std::map<int,INGEST_BATCH> pending;
+    INGEST_BATCH batch;
+    int next_seq = 0;
+    int nbr_games = 0;
+    int nbr_duplicates = 0;
+    int nbr_uncommitted = 0;
+    bool ok = true;     // else the batches are just drained, so the workers finish
+    while( batches->Pop(batch) )
+    {
+        pending[batch.seq] = std::move(batch);
+        std::map<int,INGEST_BATCH>::iterator it;
+        while( (it=pending.find(next_seq)) != pending.end() )
+        {
+            std::vector<INGEST_GAME> &games = it->second.games;
+            for( size_t i=0; ok && i<games.size(); i++ )
             {
-                while( *src )
-                {
-                    if( *src == '|' )
-                        *dst++ = '-';
-                    else
-                        *dst++ = *src;
-                    src++;
-                }
+                INGEST_GAME &game = games[i];
+                bool inserted = db_primitive_insert_game_compressed( game.white.c_str(), game.black.c_str(), game.date.c_str(), game.result.c_str(),
+                                                     game.white_elo, game.black_elo, game.eco.c_str(), game.blob.c_str(), (int)game.blob.length(), (int)game.hashes.size(), game.hashes.data() );
+                if( !inserted )
+                    nbr_duplicates++;
             }
+            nbr_games       += games.size();
+            nbr_uncommitted += games.size();
+            pending.erase(it);
+            next_seq++;
+        }
+        if( ok && nbr_uncommitted >= INGEST_COMMIT_QUOTA )
+        {
+            ok = db_primitive_transaction_end();
+            if( ok )
+                db_primitive_transaction_begin();
+            nbr_uncommitted = 0;
+            printf( ok ? "%d games committed\n" : "Build FAILED after %d games\n", nbr_games );
         }
-        if( i+1 < 10 )
-            *dst++ = '|';
     }
-    *dst = '\0';
-    fputs( buf,  ofile );    
-    fputs( "\n", ofile );    
+    printf( "Finished %d total games, %d duplicates skipped\n", nbr_games, nbr_duplicates );
+    db_primitive_report_duplicates();
+    *nbr_added = ok ? nbr_games - nbr_duplicates : -1;
+}
+
+// Returns the number of games added, or -1 if the build failed
+static int ingest_pipeline( FILE *ifile )
+{
+    int nbr_workers = std::thread::hardware_concurrency();
+    if( nbr_workers > 1 )
+        nbr_workers--;  // leave a core for the reader and writer
+    if( nbr_workers < 1 )
+        nbr_workers = 1;
+    printf( "Ingest pipeline, %d worker threads\n", nbr_workers );
+    IngestQueue<INGEST_CHUNK> chunks( 2*nbr_workers );
+    IngestQueue<INGEST_BATCH> batches( 2*nbr_workers );
+    int nbr_added = 0;
+    std::thread writer( ingest_writer, &batches, &nbr_added );
+    std::vector<std::thread> workers;
+    for( int i=0; i<nbr_workers; i++ )
+        workers.push_back( std::thread(ingest_worker,&chunks,&batches) );
+    PgnSource source;
+    source.Open(ifile);
+    ingest_reader( &source, &chunks );
+    for( int i=0; i<nbr_workers; i++ )
+        workers[i].join();
+    batches.Close();
+    writer.join();
+    return nbr_added;
+}
+
+
+// Compress
+static void game_to_qgn_file( const char *event, const char *site, const char *date, const char *round,
+                       const char *white, const char *black, const char *result, const char *white_elo, const char *black_elo, const char *eco,
+                       int nbr_moves, thc::Move *moves, uint64_t *hashes )
+
+{
+    QGN_GAME game;
+    game.fields[QGN_WHITE]     = white;
+    game.fields[QGN_WHITE_ELO] = white_elo;
+    game.fields[QGN_BLACK]     = black;
+    game.fields[QGN_BLACK_ELO] = black_elo;
+    game.fields[QGN_RESULT]    = result;
+    game.fields[QGN_DATE]      = date;
+    game.fields[QGN_EVENT]     = event;
+    game.fields[QGN_SITE]      = site;
+    game.fields[QGN_ROUND]     = round;
+    game.fields[QGN_ECO]       = eco;
     CompressMoves press;
-    dst = buf;
-    for( int i=0; i<nbr_moves && dst<buf+sizeof(buf)-5; i++ )
+    char buf[4];
+    for( int i=0; i<nbr_moves; i++ )
     {
-        thc::Move mv = *moves++;
-        int nbr = press.compress_move( mv, dst );
-        dst += nbr;
+        int nbr = press.compress_move( moves[i], buf );
+        game.blob.append( buf, nbr );
     }
-    *dst = '\0';
-    fputs( buf, ofile );    
-    fputs( "\n", ofile );    
+    qgn_writer->AddGame( game );
 }
 
 
-static void decompress_game( const char *compressed_header, const char *compressed_moves )
-{
-    static char event         [ FIELD_BUFLEN + 10];
-    static char site          [ FIELD_BUFLEN + 10];
-    static char date          [ FIELD_BUFLEN + 10];
-    static char round         [ FIELD_BUFLEN + 10];
-    static char white         [ FIELD_BUFLEN + 10];
-    static char black         [ FIELD_BUFLEN + 10];
-    static char result        [ FIELD_BUFLEN + 10];
-    static char white_elo     [ FIELD_BUFLEN + 10];
-    static char black_elo     [ FIELD_BUFLEN + 10];
-    static char eco           [ FIELD_BUFLEN + 10];
-    static char last_event    [ FIELD_BUFLEN + 10];
-    static char last_site     [ FIELD_BUFLEN + 10];
-    static char last_date     [ FIELD_BUFLEN + 10];
-    static char last_round    [ FIELD_BUFLEN + 10];
-    static char last_white    [ FIELD_BUFLEN + 10];
-    static char last_black    [ FIELD_BUFLEN + 10];
-    static char last_result   [ FIELD_BUFLEN + 10];
-    static char last_white_elo[ FIELD_BUFLEN + 10];
-    static char last_black_elo[ FIELD_BUFLEN + 10];
-    static char last_eco      [ FIELD_BUFLEN + 10];
-    char *dst, *last;
-    const char *src = compressed_header;
-    for( int i=0; i<10; i++ )
-    {
-        switch(i)
+/*
+    Parallel decompression of a binary .qgn file
+
+    The main thread reads the blocks of the file in order. A pool of worker
+    threads each test the checksum of a block, decode it and convert its
+    games to .pgn text. A writer thread puts the text back in file order.
+ */
+struct QGN_CHUNK
+{
+    int seq;
+    bool ok;
+    int nbr_games;
+    QGN_BLOCK block;
+    std::string pgn;
+};
+
+// Quick natural (SAN) move output, the same text as thc::Move::NaturalOut()
+//  but without generating every reply (NaturalOut() evaluates each legal
+//  move to find check and mate, which dominates decompression time)
+class PgnRules : public thc::ChessRules
+{
+public:
+    void NaturalOut( thc::Move mv, std::string &out )
+    {
+        char buf[10];
+        char *p = buf;
+        char piece = (char)toupper( (unsigned char)squares[mv.src] );
+        if( mv.special==thc::SPECIAL_WK_CASTLING || mv.special==thc::SPECIAL_BK_CASTLING )
+            p += sprintf( p, "O-O" );
+        else if( mv.special==thc::SPECIAL_WQ_CASTLING || mv.special==thc::SPECIAL_BQ_CASTLING )
+            p += sprintf( p, "O-O-O" );
+        else if( piece == 'P' )
         {
-            case 0: dst=white;      last=last_white;        break;
-            case 1: dst=white_elo;  last=last_white_elo;    break;
-            case 2: dst=black;      last=last_black;        break;
-            case 3: dst=black_elo;  last=last_black_elo;    break;
-            case 4: dst=result;     last=last_result;       break;
-            case 5: dst=date;       last=last_date;         break;
-            case 6: dst=event;      last=last_event;        break;
-            case 7: dst=site;       last=last_site;         break;
-            case 8: dst=round;      last=last_round;        break;
-            case 9: dst=eco;        last=last_eco;          break;
+            if( mv.capture != ' ' )
+            {
+                *p++ = FILE_CHAR(mv.src);
+                *p++ = 'x';
+            }
+            *p++ = FILE_CHAR(mv.dst);
+            *p++ = RANK_CHAR(mv.dst);
+            switch( mv.special )
+            {
+                case thc::SPECIAL_PROMOTION_QUEEN:  *p++='='; *p++='Q'; break;
+                case thc::SPECIAL_PROMOTION_ROOK:   *p++='='; *p++='R'; break;
+                case thc::SPECIAL_PROMOTION_BISHOP: *p++='='; *p++='B'; break;
+                case thc::SPECIAL_PROMOTION_KNIGHT: *p++='='; *p++='N'; break;
+                default: break;
+            }
         }
-        bool same               = (0==strcmp(src,"^")) || (0==memcmp(src,"^|",2));
-        bool same_as_black_name = (i==0 && (0==memcmp(src,">|",2))); 
-        bool same_as_black_elo  = (i==1 && (0==memcmp(src,">|",2))); 
-        bool same_as_white_name = (i==2 && (0==memcmp(src,"<|",2))); 
-        bool same_as_white_elo  = (i==3 && (0==memcmp(src,"<|",2)));
-        bool result             = (i==4);
-        if( same )
-            strcpy( dst, last );
-        else if( same_as_black_name )
-            strcpy( dst, last_black );
-        else if( same_as_black_elo )
-            strcpy( dst, last_black_elo );
-        else if( same_as_white_name )
-            strcpy( dst, last_white );
-        else if( same_as_white_elo )
-            strcpy( dst, last_white_elo );
-        else if( result && 0==memcmp(src,"1|",2) ) 
-            strcpy( dst, "1-0" );
-        else if( result && 0==memcmp(src,"0|",2) ) 
-            strcpy( dst, "0-1" );
-        else if( result && 0==memcmp(src,"=|",2) ) 
-            strcpy( dst, "1/2-1/2" );
-        else if( result )
-            strcpy( dst, "*" );
         else
         {
-            char *p = dst;
-            while( *src != '|' && *src != '\0' && p < dst+sizeof(eco)-5 )
-                *p++ = *src++;
-            *p = '\0';
+            *p++ = piece;
+
+            // Other legal moves of the same type of piece to the same square
+            bool ambiguous=false, same_file=false, same_rank=false;
+            if( piece != 'K' )
+            {
+                thc::MOVELIST list;
+                GenMoveList( &list );
+                for( int i=0; i<list.count; i++ )
+                {
+                    thc::Move m = list.moves[i];
+                    if( m.dst==mv.dst && m.src!=mv.src && squares[m.src]==squares[mv.src] && IsLegal(m) )
+                    {
+                        ambiguous = true;
+                        if( FILE_CHAR(m.src) == FILE_CHAR(mv.src) )
+                            same_file = true;
+                        if( RANK_CHAR(m.src) == RANK_CHAR(mv.src) )
+                            same_rank = true;
+                    }
+                }
+            }
+            if( ambiguous && (!same_file || same_rank) )
+                *p++ = FILE_CHAR(mv.src);
+            if( ambiguous && same_file )
+                *p++ = RANK_CHAR(mv.src);
+            if( mv.capture != ' ' )
+                *p++ = 'x';
+            *p++ = FILE_CHAR(mv.dst);
+            *p++ = RANK_CHAR(mv.dst);
         }
-        if( i > 3 ) 
-            strcpy( last, dst );
-        else if( i == 3 )
+
+        // Check or mate ?
+        PushMove(mv);
+        if( AttackedPiece( (thc::Square)(white ? wking_square : bking_square) ) )
         {
-            strcpy( last_white,      white      );
-            strcpy( last_white_elo,  white_elo  );
-            strcpy( last_black,      black      );
-            strcpy( last_black_elo,  black_elo  );
+            bool mate = true;
+            thc::MOVELIST list;
+            GenMoveList( &list );
+            for( int i=0; mate && i<list.count; i++ )
+            {
+                if( IsLegal(list.moves[i]) )
+                    mate = false;
+            }
+            *p++ = mate ? '#' : '+';
         }
-        while( *src != '|' && *src != '\0' )
-            src++;
-        if( *src == '|' )
-            src++;
-    }
-    fprintf( ofile, "[Event \"%s\"]\n",     event );
-    fprintf( ofile, "[Site \"%s\"]\n",      site );
-    fprintf( ofile, "[Date \"%s\"]\n",      date );
-    fprintf( ofile, "[Round \"%s\"]\n",     round );
-    fprintf( ofile, "[White \"%s\"]\n",     white );
-    fprintf( ofile, "[Black \"%s\"]\n",     black );
-    fprintf( ofile, "[Result \"%s\"]\n",    result );
-    fprintf( ofile, "[WhiteElo \"%s\"]\n",  white_elo );
-    fprintf( ofile, "[BlackElo \"%s\"]\n",  black_elo );
-    fprintf( ofile, "[ECO \"%s\"]\n\n",     eco );
+        PopMove(mv);
+        *p = '\0';
+        out += buf;
+    }
+private:
+    bool IsLegal( thc::Move mv )
+    {
+        PushMove(mv);
+        bool ok = !AttackedPiece( (thc::Square)(white ? bking_square : wking_square) );
+        PopMove(mv);
+        return ok;
+    }
+    static char FILE_CHAR( thc::Square sq ) { return (char)('a' + (sq&7)); }
+    static char RANK_CHAR( thc::Square sq ) { return (char)('8' - (sq>>3)); }
+};
+
+// Append one game to pgn, in the same format as the original text .qgn decompression
+static void decompress_game( const QGN_GAME &game, std::string &pgn )
+{
+    static const struct { int field; const char *tag; } tags[] =
+    {
+        { QGN_EVENT,     "Event"    },
+        { QGN_SITE,      "Site"     },
+        { QGN_DATE,      "Date"     },
+        { QGN_ROUND,     "Round"    },
+        { QGN_WHITE,     "White"    },
+        { QGN_BLACK,     "Black"    },
+        { QGN_RESULT,    "Result"   },
+        { QGN_WHITE_ELO, "WhiteElo" },
+        { QGN_BLACK_ELO, "BlackElo" },
+        { QGN_ECO,       "ECO"      }
+    };
+    for( int i=0; i<QGN_NBR_FIELDS; i++ )
+    {
+        pgn += '[';
+        pgn += tags[i].tag;
+        pgn += " \"";
+        pgn += game.fields[tags[i].field];
+        pgn += "\"]\n";
+    }
+    pgn += '\n';
+    const std::string &result = game.fields[QGN_RESULT];
     CompressMoves press;
-    src = compressed_moves;
+    PgnRules cr;
+    const char *src = game.blob.c_str();
+    const char *end = src + game.blob.length();
     std::string moves_txt;
     int count=0;
-    while( *src )
+    while( src < end )
     {
         thc::Move mv;
-        thc::ChessRules before = press.cr;
         int nbr = press.decompress_move( src, mv );
         if( nbr == 0 )
             break;
@@ -387,13 +601,15 @@ static void decompress_game( const char *compressed_header, const char *compress
         else
             strcpy( buf, " " );
         moves_txt += buf;
-        moves_txt += mv.NaturalOut( &before );
-        count++;    
+        cr.NaturalOut( mv, moves_txt );
+        cr.PlayMove( mv );
+        count++;
     }
     if( count > 0 )
         moves_txt += " ";
-    moves_txt += result;
-    std::string justified;
+    moves_txt += result.length()>0 ? result : "*";
+
+    // Break lines at 76 columns
     const char *s = moves_txt.c_str();
     int col=0;
     while( *s )
@@ -406,7 +622,7 @@ static void decompress_game( const char *compressed_header, const char *compress
             int col_end_of_next_word = col+1;
             while( *t!=' ' && *t!='\0' )
             {
-                col_end_of_next_word++;    
+                col_end_of_next_word++;
                 t++;
             }
             if( col_end_of_next_word > 76 )
@@ -415,144 +631,354 @@ static void decompress_game( const char *compressed_header, const char *compress
                 col = 0;
             }
         }
-        justified += c;
+        pgn += c;
     }
-    fprintf( ofile, "%s\n\n",  justified.c_str() );
+    pgn += "\n\n";
 }
 
-
-static void compress_moves_to_str( int nbr_moves, thc::Move *moves, char *dst, thc::ChessPosition *positions )
+static void decompress_worker( IngestQueue<QGN_CHUNK> *blocks, IngestQueue<QGN_CHUNK> *texts )
 {
-    CompressMoves press;
-    for( int i=0; i<nbr_moves; i++ )
+    QGN_CHUNK chunk;
+    std::vector<QGN_GAME> games;
+    while( blocks->Pop(chunk) )
     {
-        thc::Move mv = *moves++;
-        int nbr = press.compress_move( mv, dst );
-        std::string s = mv.TerseOut();
-//#define VERBOSE
-#ifdef VERBOSE
-        if( nbr == 1 )
-            printf( "compress temp> %s -> %02x\n", s.c_str(), *dst&0xff );
-        else
-            printf( "compress temp> %s -> %02x,%02x\n", s.c_str(), *dst&0xff, *(dst+1)&0xff );
-#endif
-        dst += nbr;
-        if( positions[i] != press.cr )
+        if( chunk.ok )
+            chunk.ok = QgnReader::DecodeBlock( chunk.block, games );
+        if( chunk.ok )
         {
-            press.Check( false, "Compress progress check", &positions[i] );
+            for( size_t i=0; i<games.size(); i++ )
+                decompress_game( games[i], chunk.pgn );
+            chunk.nbr_games = (int)games.size();
         }
+        std::string().swap( chunk.block.data );
+        texts->Push( std::move(chunk) );
     }
-    *dst = '\0';
 }
 
-static void decompress_moves_from_str( int nbr_moves, char *src, thc::Move *moves, thc::ChessPosition *positions  )
+// Text can arrive out of order, hold it until its turn comes
+static void decompress_writer( IngestQueue<QGN_CHUNK> *texts, FILE *ofile, int *nbr_games, int *nbr_bad_blocks )
 {
-    CompressMoves press;
-    for( int i=0; i<nbr_moves; i++ )
+    std::map<int,QGN_CHUNK> pending;
+    QGN_CHUNK chunk;
+    int next_seq = 0;
+    while( texts->Pop(chunk) )
     {
-        thc::Move mv;
-        int nbr = press.decompress_move( src, mv );
-        std::string s = mv.TerseOut();
-#ifdef VERBOSE
-        if( nbr == 1 )
-            printf( "decompress temp> %02x -> %s\n", *src&0xff, s.c_str() );
-        else
-            printf( "decompress temp> %02x,%02x -> %s\n", *src&0xff, *(src+1)&0xff, s.c_str() );
-#endif
-        src += nbr;
-        *moves++ = mv;
-        if( positions[i] != press.cr )
+        pending[chunk.seq] = std::move(chunk);
+        std::map<int,QGN_CHUNK>::iterator it;
+        while( (it=pending.find(next_seq)) != pending.end() )
         {
-            press.Check( false, "Decompress progress check", &positions[i] );
+            if( !it->second.ok )
+            {
+                printf( "Block %d of the .qgn file is damaged, its games are missing\n", next_seq );
+                (*nbr_bad_blocks)++;
+            }
+            fwrite( it->second.pgn.c_str(), 1, it->second.pgn.length(), ofile );
+            *nbr_games += it->second.nbr_games;
+            pending.erase(it);
+            next_seq++;
+            if( next_seq%100 == 0 )
+                printf( "%d games\n", *nbr_games );
         }
     }
 }
 
-// Verify compression
-static void verify_compression_algorithm( int nbr_moves, thc::Move *moves )
+// Returns the number of games decompressed, or -1 if any block is damaged
+static int decompress_pipeline( QgnReader *reader, FILE *ofile )
 {
-    char buf[2000];
-    thc::Move unpacked[1000];
-    static thc::ChessPosition positions_buffer[1000];
-    thc::ChessRules cr;
-    if( sizeof(buf) < 2*nbr_moves )
+    int nbr_workers = std::thread::hardware_concurrency();
+    if( nbr_workers > 1 )
+        nbr_workers--;  // leave a core for the reader and writer
+    if( nbr_workers < 1 )
+        nbr_workers = 1;
+    printf( "Decompress %d games, %d worker threads\n", (int)reader->NbrGames(), nbr_workers );
+    IngestQueue<QGN_CHUNK> blocks( 2*nbr_workers );
+    IngestQueue<QGN_CHUNK> texts( 2*nbr_workers );
+    int nbr_games = 0;
+    int nbr_bad_blocks = 0;
+    std::thread writer( decompress_writer, &texts, ofile, &nbr_games, &nbr_bad_blocks );
+    std::vector<std::thread> workers;
+    for( int i=0; i<nbr_workers; i++ )
+        workers.push_back( std::thread(decompress_worker,&blocks,&texts) );
+    int nbr_blocks = reader->NbrBlocks();
+    for( int i=0; i<nbr_blocks; i++ )
     {
-        printf( "Buffer too small" );
-        return;
+        QGN_CHUNK chunk;
+        chunk.seq = i;
+        chunk.nbr_games = 0;
+        chunk.ok = reader->ReadBlock( i, chunk.block );
+        blocks.Push( std::move(chunk) );
     }
+    blocks.Close();
+    for( int i=0; i<nbr_workers; i++ )
+        workers[i].join();
+    texts.Close();
+    writer.join();
+    printf( "%d games\n", nbr_games );
+    return nbr_bad_blocks ? -1 : nbr_games;
+}
+
+
+/*
+    Parallel verification of the move compression
+
+    Every game is round tripped through CompressMoves::compress_move() and
+    CompressMoves::decompress_move(). After each move the position is cross
+    checked against an independent thc::ChessRules and the internal tracker
+    position is checked with CompressMoves::Check(). Games come from a .pgn
+    file (split into chunks exactly as for ingest) or from the games table of
+    the database, in which case each stored blob must also decode to legal
+    moves and recompress to exactly the same bytes. The games are shared among
+    worker threads, one per core, and each worker reports its first failure.
+ */
+#define VERIFY_BLOBS_PER_CHUNK 1000
+
+struct VERIFY_WORKER
+{
+    int  nbr_games;
+    long nbr_moves;
+    int  nbr_failures;
+    std::string first_failure;
+    std::vector<thc::ChessPosition> positions;
+    VERIFY_WORKER() { nbr_games=0; nbr_moves=0; nbr_failures=0; }
+};
+
+struct VERIFY_BLOBS
+{
+    std::vector<int> game_ids;
+    std::vector<std::string> blobs;
+};
+
+static void verify_failure( VERIFY_WORKER *worker, const std::string &game, const char *why )
+{
+    if( worker->nbr_failures++ == 0 )
+        worker->first_failure = game + ": " + why;
+}
+
+// Round trip one game, returns false (after recording the failure) if there is a problem
+static bool verify_game( VERIFY_WORKER *worker, const std::string &game, int nbr_moves, const thc::Move *moves, const std::string *blob=NULL )
+{
+    char why[200];
+    worker->nbr_games++;
+    worker->nbr_moves += nbr_moves;
+    if( (int)worker->positions.size() < nbr_moves )
+        worker->positions.resize(nbr_moves);
+    thc::ChessRules cr;
     for( int i=0; i<nbr_moves; i++ )
     {
         thc::Move mv = moves[i];
         cr.PlayMove(mv);
-        positions_buffer[i] = cr;
+        worker->positions[i] = cr;
     }
-    compress_moves_to_str( nbr_moves, moves, buf, positions_buffer );
-#ifdef VERBOSE
+
+    // Compress
+    std::vector<char> buf( 2*nbr_moves + 1 );
+    char *dst = &buf[0];
+    CompressMoves press;
     for( int i=0; i<nbr_moves; i++ )
     {
-        thc::Move mv = moves[i];
-        std::string s = mv.TerseOut();
-        if( i==0 )
-            printf( "Moves>" );
-        printf( " " );
-        printf( s.c_str() );
+        dst += press.compress_move( moves[i], dst );
+        if( worker->positions[i]!=press.cr || !press.Check(true,"Verify compress",&worker->positions[i]) )
+        {
+            sprintf( why, "compress position mismatch after move %d (%s)", i+1, const_cast<thc::Move&>(moves[i]).TerseOut().c_str() );
+            verify_failure( worker, game, why );
+            return false;
+        }
     }
-    printf( "\n" );
-    for( int i=0; ; i++ )
+    int len = (int)(dst - &buf[0]);
+    if( blob && (len!=(int)blob->length() || 0!=memcmp(&buf[0],blob->c_str(),len)) )
     {
-        char c = buf[i];
-        if( c == '\0' )
-            break;
-        if( i==0 )
-            printf( "Compressed>" );
-        printf( " " );
-        printf( "%02x", c&0xff );
-    }
-    printf( "\n" );
-#endif
-    decompress_moves_from_str( nbr_moves, buf, unpacked, positions_buffer );
-#ifdef VERBOSE
-    for( int i=0; i<nbr_moves; i++ )
-    {
-        thc::Move mv = unpacked[i];
-        std::string s = mv.TerseOut();
-        if( i==0 )
-            printf( "Unpacked Moves>" );
-        printf( " " );
-        printf( s.c_str() );
+        verify_failure( worker, game, "recompressed moves differ from the stored blob" );
+        return false;
     }
-    printf( "\n" );
-#endif
-    bool match = (0 == memcmp( moves, unpacked, nbr_moves*sizeof(thc::Move)));
-    if( match )
+
+    // Decompress
+    CompressMoves unpress;
+    const char *src = &buf[0];
+    for( int i=0; i<nbr_moves; i++ )
     {
-#ifdef VERBOSE
-        printf( "Woo hoo, %d games match\n", ++nbr_games );
-#endif
+        thc::Move mv;
+        int nbr = unpress.decompress_move( src, mv );
+        src += nbr;
+        if( nbr==0 || 0!=memcmp(&mv,&moves[i],sizeof(thc::Move)) )
+        {
+            sprintf( why, "decompress move %d is %s, expected %s", i+1, mv.TerseOut().c_str(), const_cast<thc::Move&>(moves[i]).TerseOut().c_str() );
+            verify_failure( worker, game, why );
+            return false;
+        }
+        if( worker->positions[i]!=unpress.cr || !unpress.Check(true,"Verify decompress",&worker->positions[i]) )
+        {
+            sprintf( why, "decompress position mismatch after move %d", i+1 );
+            verify_failure( worker, game, why );
+            return false;
+        }
     }
-    else
+    return true;
+}
+
+// Callback from a worker's PgnRead
+static void verify_pgn_game( void *callback_context, const char *white, const char *black, const char *event, int nbr_moves, thc::Move *moves )
+{
+    VERIFY_WORKER *worker = (VERIFY_WORKER *)callback_context;
+    std::string game = std::string(white) + " - " + black + ", " + event;
+    verify_game( worker, game, nbr_moves, moves );
+}
+
+// GenLegalMoveList() evaluates every reply as well (to find checkmates), a
+//  single move can be checked much more cheaply with the (protected) pseudo
+//  legal move generator
+class VerifyRules : public thc::ChessRules
+{
+public:
+    bool IsLegalMove( thc::Move mv )
     {
-        printf( "Boo hoo, doesn't match\n" );
-        for( int i=0; i<nbr_moves; i++ )
+        thc::MOVELIST list;
+        GenMoveList( &list );
+        for( int i=0; i<list.count; i++ )
         {
-            bool match = (0 == memcmp( &moves[i], &unpacked[i], sizeof(thc::Move)));
-            if( !match )
+            thc::Move m = list.moves[i];
+            if( m.src==mv.src && m.dst==mv.dst && m.special==mv.special )
             {
-                printf( "Fail at idx %d, %s:%s", i, moves[i].TerseOut().c_str(), unpacked[i].TerseOut().c_str() );
-                for( int k=0; k<2; k++ )
-                {
-                    unsigned char *s = (k==0?(unsigned char *)&moves[i]:(unsigned char *)&unpacked[i]);
-                    printf("\n");
-                    for( int j=0; j<4; j++ )
-                    {
-                        printf( " %02x", *s++ );
-                    }
-                }
-                printf("\n");
-                break;
+                PushMove(m);
+                bool ok = !AttackedPiece( (thc::Square)(white ? bking_square : wking_square) );
+                PopMove(m);
+                return ok;
             }
         }
+        return false;
+    }
+};
+
+// A blob from the database must decode to legal moves before it is round tripped
+static void verify_blob( VERIFY_WORKER *worker, int game_id, const std::string &blob )
+{
+    char game[40];
+    sprintf( game, "game_id %d", game_id );
+    std::vector<thc::Move> moves;
+    CompressMoves press;
+    VerifyRules cr;
+    const char *src = blob.c_str();
+    const char *end = src + blob.length();
+    while( src < end )
+    {
+        thc::Move mv;
+        int nbr = press.decompress_move( src, mv );
+        if( nbr == 0 )
+        {
+            worker->nbr_games++;
+            verify_failure( worker, game, "undecodable byte in the stored blob" );
+            return;
+        }
+        src += nbr;
+        if( !cr.IsLegalMove(mv) )
+        {
+            char why[100];
+            sprintf( why, "stored move %d (%s) is illegal", (int)moves.size()+1, mv.TerseOut().c_str() );
+            worker->nbr_games++;
+            verify_failure( worker, game, why );
+            return;
+        }
+        cr.PlayMove(mv);
+        moves.push_back(mv);
     }
+    verify_game( worker, game, (int)moves.size(), moves.empty() ? NULL : &moves[0], &blob );
 }
 
+static void verify_pgn_worker( IngestQueue<INGEST_CHUNK> *chunks, VERIFY_WORKER *worker )
+{
+    INGEST_CHUNK chunk;
+    PgnRead *pgn = new PgnRead('V',worker);
+    while( chunks->Pop(chunk) )
+    {
+        if( chunk.ptr )
+            pgn->Process( chunk.ptr, chunk.len );
+        else
+            pgn->Process( chunk.text.c_str(), chunk.text.length() );
+    }
+    delete pgn;
+}
 
+static void verify_database_worker( IngestQueue<VERIFY_BLOBS> *chunks, VERIFY_WORKER *worker )
+{
+    VERIFY_BLOBS chunk;
+    while( chunks->Pop(chunk) )
+    {
+        for( size_t i=0; i<chunk.blobs.size(); i++ )
+            verify_blob( worker, chunk.game_ids[i], chunk.blobs[i] );
+    }
+}
+
+// Callback from db_primitive_for_each_game_blob(), runs on the reader thread
+struct VERIFY_READER
+{
+    IngestQueue<VERIFY_BLOBS> *chunks;
+    VERIFY_BLOBS chunk;
+};
+
+static void verify_read_blob( void *context, int game_id, const char *blob, int blob_len )
+{
+    VERIFY_READER *reader = (VERIFY_READER *)context;
+    reader->chunk.game_ids.push_back( game_id );
+    reader->chunk.blobs.push_back( std::string(blob,blob_len) );
+    if( reader->chunk.blobs.size() >= VERIFY_BLOBS_PER_CHUNK )
+    {
+        reader->chunks->Push( std::move(reader->chunk) );
+        reader->chunk = VERIFY_BLOBS();
+    }
+}
+
+// Returns the number of failures
+static int verify_pipeline( FILE *ifile, bool database )
+{
+    int nbr_workers = std::thread::hardware_concurrency();
+    if( nbr_workers < 1 )
+        nbr_workers = 1;
+    printf( "Verify compression, %d worker threads\n", nbr_workers );
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<VERIFY_WORKER> results( nbr_workers );
+    std::vector<std::thread> workers;
+    if( database )
+    {
+        IngestQueue<VERIFY_BLOBS> chunks( 2*nbr_workers );
+        for( int i=0; i<nbr_workers; i++ )
+            workers.push_back( std::thread(verify_database_worker,&chunks,&results[i]) );
+        VERIFY_READER reader;
+        reader.chunks = &chunks;
+        db_primitive_for_each_game_blob( verify_read_blob, &reader );
+        if( reader.chunk.blobs.size() > 0 )
+            chunks.Push( std::move(reader.chunk) );
+        chunks.Close();
+        for( int i=0; i<nbr_workers; i++ )
+            workers[i].join();
+    }
+    else
+    {
+        IngestQueue<INGEST_CHUNK> chunks( 2*nbr_workers );
+        for( int i=0; i<nbr_workers; i++ )
+            workers.push_back( std::thread(verify_pgn_worker,&chunks,&results[i]) );
+        PgnSource source;
+        source.Open(ifile);
+        ingest_reader( &source, &chunks );
+        for( int i=0; i<nbr_workers; i++ )
+            workers[i].join();
+    }
+    double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+    // Summary
+    int  nbr_games=0, nbr_failures=0;
+    long nbr_moves=0;
+    for( int i=0; i<nbr_workers; i++ )
+    {
+        VERIFY_WORKER &w = results[i];
+        printf( "Worker %d: %d games, %ld moves, %d failures\n", i, w.nbr_games, w.nbr_moves, w.nbr_failures );
+        if( w.nbr_failures > 0 )
+            printf( "Worker %d: first failure %s\n", i, w.first_failure.c_str() );
+        nbr_games    += w.nbr_games;
+        nbr_moves    += w.nbr_moves;
+        nbr_failures += w.nbr_failures;
+    }
+    printf( "Verified %d games, %ld moves, %d failures in %.2f seconds", nbr_games, nbr_moves, nbr_failures, elapsed );
+    if( elapsed > 0.0 )
+        printf( " (%.0f games/s, %.0f moves/s)", nbr_games/elapsed, nbr_moves/elapsed );
+    printf( "\n%s\n", nbr_failures==0 ? "Verify compression PASSED" : "Verify compression FAILED" );
+    return nbr_failures;
+}
@@ -7,11 +7,14 @@
 #ifndef DB_MAINTENANCE_H
 #define DB_MAINTENANCE_H
 
-void db_maintenance_compress_pgn();
-void db_maintenance_decompress_pgn();
-void db_maintenance_verify_compression();
-void db_maintenance_create_or_append_to_database( const char *pgn_filename );
+// The database file is set with db_primitive_set_database_file()
+bool db_maintenance_compress_pgn( const char *pgn_filename, const char *qgn_filename );
+int  db_maintenance_decompress_pgn( const char *qgn_filename, const char *pgn_filename );
+int  db_maintenance_verify_compression_pgn( const char *pgn_filename );
+int  db_maintenance_verify_compression_database();
+int  db_maintenance_create_or_append_to_database( const char *pgn_filename );
 void db_maintenance_create_extra_indexes();
+void db_maintenance_create_position_index();
 //void db_maintenance_append_to_database();
 void db_maintenance_speed_tests();
 
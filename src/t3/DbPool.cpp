@@ -0,0 +1,121 @@
+/****************************************************************************
+ *  A pool of read-only connections to the database, so that queries on
+ *  different threads each have a connection (and statements) of their own
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "DebugPrintf.h"
+#include "DbPrimitives.h"
+#include "DbPool.h"
+
+// A reader waits this long for a writer (database maintenance) to commit,
+//  rather than failing immediately with SQLITE_BUSY
+#define BUSY_TIMEOUT_MS 2000
+
+static std::mutex pool_mutex;           // protects the following
+static std::string pool_file;
+static int pool_profile = DB_PROFILE_INTERACTIVE_READ;
+static std::vector<sqlite3 *> pool_idle;
+static std::vector<sqlite3 *> pool_busy;
+static std::vector<sqlite3 *> pool_stale;  // in use, to be closed on release
+
+// Close the connections, or for those in use mark them to be closed on
+//  release. Call with the lock held
+static void pool_reset()
+{
+    for( unsigned int i=0; i<pool_idle.size(); i++ )
+        sqlite3_close( pool_idle[i] );
+    pool_idle.clear();
+    pool_stale.insert( pool_stale.end(), pool_busy.begin(), pool_busy.end() );
+    pool_busy.clear();
+}
+
+void db_pool_open( const char *db_file )
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool_reset();
+    pool_file = db_file;
+}
+
+void db_pool_set_profile( int profile )
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if( profile != pool_profile )
+    {
+        pool_reset();
+        pool_profile = profile;
+    }
+}
+
+void db_pool_close()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    for( unsigned int i=0; i<pool_idle.size(); i++ )
+        sqlite3_close( pool_idle[i] );
+    pool_idle.clear();
+}
+
+sqlite3 *db_pool_acquire()
+{
+    std::string file;
+    int profile;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if( pool_idle.size() > 0 )
+        {
+            sqlite3 *handle = pool_idle.back();
+            pool_idle.pop_back();
+            pool_busy.push_back(handle);
+            return handle;
+        }
+        file = pool_file;
+        profile = pool_profile;
+    }
+
+    // Open a new connection outside the lock, it takes a while
+    sqlite3 *handle = NULL;
+    int retval = sqlite3_open_v2( file.c_str(), &handle, SQLITE_OPEN_READONLY, NULL );
+    if( retval )
+    {
+        cprintf( "sqlite3_open_v2(%s) FAILED %s\n", file.c_str(), handle ? sqlite3_errmsg(handle) : "" );
+        sqlite3_close( handle );
+        return NULL;
+    }
+    sqlite3_busy_timeout( handle, BUSY_TIMEOUT_MS );
+    db_primitive_profile_apply( handle, profile, true, false );
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if( file!=pool_file || profile!=pool_profile )
+        pool_stale.push_back(handle);   // db_pool_open() or db_pool_set_profile() meanwhile
+    else
+        pool_busy.push_back(handle);
+    return handle;
+}
+
+void db_pool_release( sqlite3 *handle )
+{
+    if( !handle )
+        return;
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    std::vector<sqlite3 *>::iterator it = std::find( pool_busy.begin(), pool_busy.end(), handle );
+    if( it != pool_busy.end() )
+    {
+        pool_busy.erase(it);
+        if( pool_idle.size() < DB_POOL_SIZE )
+        {
+            pool_idle.push_back(handle);
+            return;
+        }
+    }
+    else
+    {
+        it = std::find( pool_stale.begin(), pool_stale.end(), handle );
+        if( it != pool_stale.end() )
+            pool_stale.erase(it);
+    }
+    sqlite3_close( handle );
+}
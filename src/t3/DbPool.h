@@ -0,0 +1,33 @@
+/****************************************************************************
+ *  A pool of read-only connections to the database, so that queries on
+ *  different threads each have a connection (and statements) of their own
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef DB_POOL_H
+#define DB_POOL_H
+#include "sqlite3.h"
+
+// Idle connections kept open for reuse, more are opened if needed
+#define DB_POOL_SIZE 4
+
+// Set the database file. Idle connections to a previous file are closed, as
+//  are connections in use when they are released
+void db_pool_open( const char *db_file );
+
+// Set the profile of SQLite pragmas (see DB_PROFILE_XXX in DbPrimitives.h)
+//  applied to each connection, DB_PROFILE_INTERACTIVE_READ by default.
+//  Connections already open are closed, as for db_pool_open()
+void db_pool_set_profile( int profile );
+
+// Close the idle connections
+void db_pool_close();
+
+// A read-only connection for the caller's use until released, NULL if the
+//  database can't be opened. Acquire and release are thread safe, but a
+//  connection should only be used by one thread at a time
+sqlite3 *db_pool_acquire();
+void     db_pool_release( sqlite3 *handle );
+
+#endif // DB_POOL_H
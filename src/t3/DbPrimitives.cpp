@@ -6,17 +6,138 @@
  ****************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <chrono>
+#include <string>
 #include <vector>
+#include <map>
 #include <algorithm>
 #include "thc.h"
 #include "sqlite3.h"
 #include "CompressMoves.h"
+#include "ExternalSort.h"
+#include "PositionIndex.h"
 #include "DbPrimitives.h"
 static void purge_bucket(int bucket_idx);
 static void purge_buckets();
+static void flush_sorter();
+static void build_discard();
+static void finalize_statements();
+static void positions_rekey();
+static bool positions_have_offsets();
+static void add_positions( int game_id, int nbr_moves, const uint64_t *hashes, const char *blob, int blob_len );
+static void opening_tree_add_game( const char *result, int white_elo, int black_elo, int nbr_moves, const uint64_t *hashes );
+static void opening_tree_flush();
+static void opening_tree_discard();
+static void opening_tree_rebuild();
+static void players_add_game( int game_id, const char *white, const char *black );
+static void players_rebuild();
+static void details_add_game( int game_id, int year, int white_elo, int black_elo, const char *eco, const char *result );
+static void details_rebuild();
+static int  replay_hashes( const char *blob, int blob_len, std::vector<uint64_t> &hashes, int max_plies );
 #define NBR_BUCKETS 4096
 #define PURGE_QUOTA 10000
+#define DEFAULT_SORT_BUDGET (256*1024*1024)
+
+// The database the maintenance functions work on
+static std::string db_file = DB_MAINTENANCE_FILE;
+
+void db_primitive_set_database_file( const char *filename )
+{
+    db_file = filename;
+}
+
+const char *db_primitive_get_database_file()
+{
+    return db_file.c_str();
+}
+
+// The pragmas of each profile, NULL to leave SQLite's default (a negative
+//  cache_size is in KiB rather than pages)
+struct DB_PROFILE
+{
+    const char *name;
+    int page_size;              // takes effect only when the database is created
+    int cache_size;             // per connection
+    sqlite3_int64 mmap_size;    // read-only connections only, 0 = none
+    const char *journal_mode;   // only when the database is being created, an existing
+    const char *synchronous;    //  database always has a rollback journal and full syncs
+    const char *temp_store;
+};
+
+static const DB_PROFILE profiles[NBR_DB_PROFILES] =
+{
+    // name               page_size cache_size  mmap_size           journal synchronous temp_store
+    { "interactive read", 4096,     -32*1024,   256*1024*1024LL,    NULL,   NULL,       "MEMORY" },
+    { "bulk build",       4096,     -128*1024,  0,                  "OFF",  "OFF",      "MEMORY" },
+    { "low memory",       1024,     -2*1024,    0,                  NULL,   NULL,       NULL     }
+};
+
+// The profile of the database the maintenance functions work on
+static int db_profile = DB_PROFILE_INTERACTIVE_READ;
+
+void db_primitive_set_profile( int profile )
+{
+    db_profile = profile;
+}
+
+const char *db_primitive_profile_name( int profile )
+{
+    return (0<=profile && profile<NBR_DB_PROFILES) ? profiles[profile].name : "";
+}
+
+int db_primitive_profile_lookup( const char *name, int default_profile )
+{
+    std::string s;
+    for( const char *p=name; *p; p++ )
+        s += (*p=='-' || *p=='_') ? ' ' : (char)tolower((unsigned char)*p);
+    for( int i=0; i<NBR_DB_PROFILES; i++ )
+    {
+        if( s == profiles[i].name )
+            return i;
+    }
+    return default_profile;
+}
+
+void db_primitive_profile_apply( sqlite3 *handle, int profile, bool read_only, bool creating )
+{
+    if( profile<0 || profile>=NBR_DB_PROFILES )
+        profile = DB_PROFILE_INTERACTIVE_READ;
+    const DB_PROFILE &p = profiles[profile];
+    std::vector<std::string> pragmas;
+    char buf[100];
+    if( read_only )
+    {
+        // Not supported (and quietly ignored) before SQLite 3.7.17
+        sprintf( buf, "PRAGMA mmap_size=%lld", (long long)p.mmap_size );
+        pragmas.push_back(buf);
+    }
+    else
+    {
+        sprintf( buf, "PRAGMA page_size=%d", p.page_size );
+        pragmas.push_back(buf);
+
+        // Without a journal a crash part way through loses the database, so
+        //  that's only acceptable while building a new one from scratch. An
+        //  append to (or a migration of) an existing database can be rolled back
+        pragmas.push_back( std::string("PRAGMA journal_mode=") + (creating && p.journal_mode ? p.journal_mode : "DELETE") );
+        pragmas.push_back( std::string("PRAGMA synchronous=")  + (creating && p.synchronous  ? p.synchronous  : "FULL") );
+    }
+    sprintf( buf, "PRAGMA cache_size=%d", p.cache_size );
+    pragmas.push_back(buf);
+    if( p.temp_store )
+        pragmas.push_back( std::string("PRAGMA temp_store=") + p.temp_store );
+    for( unsigned int i=0; i<pragmas.size(); i++ )
+    {
+        char *errmsg = NULL;
+        int retval = sqlite3_exec( handle, pragmas[i].c_str(), 0, 0, &errmsg );
+        if( retval )
+            printf("sqlite3_exec(%s) FAILED %s\n", pragmas[i].c_str(), errmsg ? errmsg : "" );
+        sqlite3_free(errmsg);
+    }
+}
 
 static int report( const char * txt )
 {
@@ -51,7 +172,7 @@ int db_primitive_random_test_program()
     
     // try to create the database. If it doesnt exist, it would be created
     // pass a pointer to the pointer to sqlite3, in short sqlite3**
-    retval = sqlite3_open(DB_MAINTENANCE_FILE,&handle);
+    retval = sqlite3_open(db_file.c_str(),&handle);
 
     // If connection failed, handle returns NULL
     if(retval)
@@ -149,13 +270,539 @@ int db_primitive_random_test_program()
 static sqlite3 *handle;
 static int game_id;
 
+// Bulk ingest uses prepared statements, one for the games table and one for
+//  each of the positions tables. They are prepared on first use and kept until
+//  db_primitive_close(), so SQLite parses each INSERT once rather than once per row
+static sqlite3_stmt *insert_game_stmt;
+static sqlite3_stmt *insert_position_stmt[NBR_BUCKETS];
+static bool blob_offsets;       // the positions_N tables have a blob_offset column
+
+static sqlite3_stmt *get_cached_stmt( sqlite3_stmt *&stmt, const char *sql )
+{
+    if( !stmt )
+    {
+        int retval = sqlite3_prepare_v2( handle, sql, -1, &stmt, 0 );
+        if( retval )
+        {
+            printf("sqlite3_prepare_v2(%s) FAILED %s\n", sql, sqlite3_errmsg(handle) );
+            stmt = NULL;
+        }
+    }
+    return stmt;
+}
+
+static sqlite3_stmt *get_insert_game_stmt()
+{
+    return get_cached_stmt( insert_game_stmt, "INSERT INTO games VALUES(?,?,?,?,?)" );
+}
+
+static sqlite3_stmt *get_insert_position_stmt( int table_nbr )
+{
+    sqlite3_stmt *stmt = insert_position_stmt[table_nbr];
+    if( !stmt )
+    {
+        char buf[200];
+        sprintf( buf, "INSERT INTO positions_%d VALUES(?,?%s)", table_nbr, blob_offsets?",?":"" );
+        int retval = sqlite3_prepare_v2( handle, buf, -1, &stmt, 0 );
+        if( retval )
+        {
+            printf("sqlite3_prepare_v2(INSERT positions_%d) FAILED %s\n", table_nbr, sqlite3_errmsg(handle) );
+            stmt = NULL;
+        }
+        insert_position_stmt[table_nbr] = stmt;
+    }
+    return stmt;
+}
+
+/*
+    Metadata, so that appending to an existing database needs neither a
+    rescan of the games table nor a rebuild of the indexes;
+
+    meta            (key,value) pairs, schema_version, next_game_id and
+                    indexes_created
+    bucket_stats    number of rows in each positions_N table
+    game_hashes     64 bit hash of each game's players, result and moves,
+                    an append skips any game that is already present so
+                    appending the same file twice is a no-op
+    game_fingerprints
+                    near duplicate detection, see below
+    duplicate_games near duplicates kept (DUPLICATES_FLAG) and the game
+                    they duplicate
+
+    A database built before these tables existed gets them (including the
+    game hashes and fingerprints) the first time it is opened
+
+    From schema version 3 the positions_N tables hold the full 64 bit
+    position hash (which includes the side to move), in table number
+    (hash>>32)&(NBR_BUCKETS-1). Earlier versions kept only the low 32 bits
+    of a hash without the side to move, so a search could turn up false
+    matches. The positions tables of an older database are rebuilt from the
+    games table the first time it is opened
+
+    From schema version 4 there is an opening tree, see opening_tree_add_game()
+
+    From schema version 5 there are players and game_players tables, see
+    players_add_game()
+
+    From schema version 6 there is a game_details table, see details_add_game()
+
+    From schema version 7 game_fingerprints has a row for each year a
+    fingerprint has been seen in, rather than just the first game's year
+
+    The positions_N tables of a database created from this version on have
+    a blob_offset column, see add_positions(). It isn't added to an existing
+    database, ALTER TABLE on thousands of tables takes minutes
+ */
+#define SCHEMA_VERSION 7
+static bool game_id_valid;      // game_id has been established by db_primitive_count_games()
+static bool indexes_created;
+static int  bucket_rows_added[NBR_BUCKETS];
+static bool build_failed;       // position rows were lost, see db_primitive_transaction_end()
+static sqlite3_stmt *select_game_hash_stmt;
+static sqlite3_stmt *insert_game_hash_stmt;
+
+/*
+    Near duplicates; the same game from two different sources usually differs
+    in the spelling of the player names, in the other tags and sometimes even
+    in the result. The fingerprint of a game is a hash of the final position,
+    the moves and the normalised player names (surname and first initial), a
+    game with the same fingerprint and the same year (or an unknown year on
+    either side) as a game already present is a near duplicate. So the table
+    is keyed on fingerprint and year, a game from another year with the same
+    fingerprint is a new game and its own year must be recorded too
+ */
+#define FINGERPRINTS_TABLE "CREATE TABLE IF NOT EXISTS game_fingerprints (fingerprint INTEGER, game_id INTEGER, year INTEGER, PRIMARY KEY(fingerprint,year))"
+static int duplicate_mode = DUPLICATES_SKIP;
+static int nbr_exact_duplicates;
+static int nbr_near_duplicates;
+static sqlite3_stmt *select_fingerprint_stmt;
+static sqlite3_stmt *insert_fingerprint_stmt;
+static sqlite3_stmt *insert_duplicate_stmt;
+static sqlite3_stmt *update_tree_stmt;
+static sqlite3_stmt *insert_tree_stmt;
+static sqlite3_stmt *insert_player_stmt;
+static sqlite3_stmt *insert_game_player_stmt;
+static sqlite3_stmt *insert_details_stmt;
+static std::map< std::string, int > player_ids;     // the players table, read on first use
+static bool player_ids_loaded;
+
+static sqlite3_int64 meta_get( const char *key, sqlite3_int64 default_value )
+{
+    sqlite3_int64 value = default_value;
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( handle, "SELECT value FROM meta WHERE key=?", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("sqlite3_prepare_v2(SELECT meta) FAILED %s\n", sqlite3_errmsg(handle) );
+        return value;
+    }
+    sqlite3_bind_text( stmt, 1, key, -1, SQLITE_STATIC );
+    if( SQLITE_ROW == sqlite3_step(stmt) )
+        value = sqlite3_column_int64( stmt, 0 );
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static void meta_set( const char *key, sqlite3_int64 value )
+{
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( handle, "INSERT OR REPLACE INTO meta VALUES(?,?)", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("sqlite3_prepare_v2(INSERT meta) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    sqlite3_bind_text ( stmt, 1, key, -1, SQLITE_STATIC );
+    sqlite3_bind_int64( stmt, 2, value );
+    retval = sqlite3_step(stmt);
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(INSERT meta) FAILED %s\n", sqlite3_errmsg(handle) );
+    sqlite3_finalize(stmt);
+}
+
+// FNV-1a, over the (sanitised) fields exactly as they are stored
+static uint64_t fnv1a( uint64_t hash, const void *data, size_t len )
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for( size_t i=0; i<len; i++ )
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t game_hash_calculate( const char *white, const char *black, const char *result, const char *blob, int blob_len )
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a( hash, white,  strlen(white)+1 );
+    hash = fnv1a( hash, black,  strlen(black)+1 );
+    hash = fnv1a( hash, result, strlen(result)+1 );
+    hash = fnv1a( hash, blob,   blob_len );
+    return hash;
+}
+
+static bool game_hash_exists( uint64_t game_hash )
+{
+    sqlite3_stmt *stmt = get_cached_stmt( select_game_hash_stmt, "SELECT game_id FROM game_hashes WHERE game_hash=?" );
+    if( !stmt )
+        return false;
+    sqlite3_bind_int64( stmt, 1, (sqlite3_int64)game_hash );
+    bool exists = (SQLITE_ROW == sqlite3_step(stmt));
+    sqlite3_reset(stmt);
+    return exists;
+}
+
+static void game_hash_insert( uint64_t game_hash, int id )
+{
+    sqlite3_stmt *stmt = get_cached_stmt( insert_game_hash_stmt, "INSERT OR IGNORE INTO game_hashes VALUES(?,?)" );
+    if( !stmt )
+        return;
+    sqlite3_bind_int64( stmt, 1, (sqlite3_int64)game_hash );
+    sqlite3_bind_int  ( stmt, 2, id );
+    int retval = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(INSERT game_hashes) FAILED %s\n", sqlite3_errmsg(handle) );
+}
+
+// "Carlsen, Magnus", "Carlsen,M." and "Magnus Carlsen" all become "carlsen m"
+static std::string normalise_name( const char *name )
+{
+    std::vector<std::string> words;
+    std::string word;
+    int comma_word = -1;    // number of words before a comma
+    for( const char *s=name; ; s++ )
+    {
+        if( *s && (isalnum((unsigned char)*s) || *s=='_') )
+            word += (char)tolower((unsigned char)*s);
+        else
+        {
+            if( word.length() > 0 )
+                words.push_back(word);
+            word.clear();
+            if( *s==',' && comma_word<0 )
+                comma_word = (int)words.size();
+            if( !*s )
+                break;
+        }
+    }
+    std::string surname, initial;
+    if( comma_word > 0 )
+    {
+        for( int i=0; i<comma_word; i++ )
+            surname += words[i];
+        if( comma_word < (int)words.size() )
+            initial = words[comma_word].substr(0,1);
+    }
+    else if( words.size() > 0 )
+    {
+        surname = words.back();
+        if( words.size() > 1 )
+            initial = words[0].substr(0,1);
+    }
+    return surname + ' ' + initial;
+}
+
+// Year from a PGN date "yyyy.mm.dd", 0 if unknown
+static int date_year( const char *date )
+{
+    int year = 0;
+    for( int i=0; i<4; i++ )
+    {
+        if( !isdigit((unsigned char)date[i]) )
+            return 0;
+        year = year*10 + (date[i]-'0');
+    }
+    return year;
+}
+
+// Replay the moves to get the hash of the final position
+static uint64_t final_position_hash( const char *blob, int blob_len )
+{
+    CompressMoves press;
+    uint64_t hash = press.cr.Hash64Calculate();
+    for( int nbr=0; nbr<blob_len; )
+    {
+        thc::ChessPosition cr = press.cr;
+        thc::Move mv;
+        int nbr_used = press.decompress_move( blob, mv );
+        if( nbr_used == 0 )
+            break;
+        blob += nbr_used;
+        nbr += nbr_used;
+        hash = cr.Hash64Update( hash, mv );
+    }
+    return hash;
+}
+
+static uint64_t fingerprint_calculate( uint64_t final_hash, const char *blob, int blob_len, const char *white, const char *black )
+{
+    std::string w = normalise_name(white);
+    std::string b = normalise_name(black);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a( hash, &final_hash, sizeof(final_hash) );
+    hash = fnv1a( hash, blob, blob_len );
+    hash = fnv1a( hash, w.c_str(), w.length()+1 );
+    hash = fnv1a( hash, b.c_str(), b.length()+1 );
+    return hash;
+}
+
+// Returns true (and the id of the original game) if the fingerprint shows
+//  a near duplicate
+static bool fingerprint_lookup( uint64_t fingerprint, int year, int &original_game_id )
+{
+    sqlite3_stmt *stmt = get_cached_stmt( select_fingerprint_stmt, "SELECT game_id FROM game_fingerprints WHERE fingerprint=?1 AND (year=?2 OR year=0 OR ?2=0) LIMIT 1" );
+    if( !stmt )
+        return false;
+    bool found = false;
+    sqlite3_bind_int64( stmt, 1, (sqlite3_int64)fingerprint );
+    sqlite3_bind_int  ( stmt, 2, year );
+    if( SQLITE_ROW == sqlite3_step(stmt) )
+    {
+        found = true;
+        original_game_id = sqlite3_column_int( stmt, 0 );
+    }
+    sqlite3_reset(stmt);
+    return found;
+}
+
+// Only the first game with a given fingerprint and year is recorded
+static void fingerprint_insert( uint64_t fingerprint, int id, int year )
+{
+    sqlite3_stmt *stmt = get_cached_stmt( insert_fingerprint_stmt, "INSERT OR IGNORE INTO game_fingerprints VALUES(?,?,?)" );
+    if( !stmt )
+        return;
+    sqlite3_bind_int64( stmt, 1, (sqlite3_int64)fingerprint );
+    sqlite3_bind_int  ( stmt, 2, id );
+    sqlite3_bind_int  ( stmt, 3, year );
+    int retval = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(INSERT game_fingerprints) FAILED %s\n", sqlite3_errmsg(handle) );
+}
+
+static void duplicate_insert( int id, int original_game_id )
+{
+    sqlite3_stmt *stmt = get_cached_stmt( insert_duplicate_stmt, "INSERT OR REPLACE INTO duplicate_games VALUES(?,?)" );
+    if( !stmt )
+        return;
+    sqlite3_bind_int( stmt, 1, id );
+    sqlite3_bind_int( stmt, 2, original_game_id );
+    int retval = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(INSERT duplicate_games) FAILED %s\n", sqlite3_errmsg(handle) );
+}
+
+void db_primitive_set_duplicate_mode( int mode )
+{
+    duplicate_mode = mode;
+}
+
+void db_primitive_report_duplicates()
+{
+    printf( "%d exact duplicates skipped, %d near duplicates %s\n", nbr_exact_duplicates, nbr_near_duplicates,
+            duplicate_mode==DUPLICATES_SKIP ? "skipped" : "flagged in table duplicate_games" );
+}
+
+// First open of a database without up to date metadata (new, or built by an
+//  earlier version). Everything derived from the games and positions tables is
+//  (re)calculated
+static void meta_setup( sqlite3_int64 old_version )
+{
+    report( "Database metadata setup begin" );
+    db_primitive_transaction_begin();
+    if( old_version < 3 )
+    {
+        positions_rekey();
+        sqlite3_exec( handle, "DELETE FROM game_fingerprints",0,0,0);   // they include a position hash, recalculated below
+    }
+    if( old_version < 4 )
+        opening_tree_rebuild();
+    if( old_version < 5 )
+        players_rebuild();
+    if( old_version < 6 )
+        details_rebuild();
+    if( old_version < 7 )
+    {
+        // Rekeyed on (fingerprint,year), recalculated below
+        sqlite3_exec( handle, "DROP TABLE IF EXISTS game_fingerprints",0,0,0);
+        sqlite3_exec( handle, FINGERPRINTS_TABLE,0,0,0);
+    }
+    sqlite3_stmt *stmt;
+    sqlite3_int64 next_game_id = 0;
+    int retval = sqlite3_prepare_v2( handle, "SELECT COUNT(*) FROM games", -1, &stmt, 0 );
+    if( retval == 0 )
+    {
+        if( SQLITE_ROW == sqlite3_step(stmt) )
+            next_game_id = sqlite3_column_int64( stmt, 0 );
+        sqlite3_finalize(stmt);
+    }
+    for( int i=0; i<NBR_BUCKETS; i++ )
+    {
+        char buf[200];
+        sprintf( buf, "INSERT OR REPLACE INTO bucket_stats SELECT %d, COUNT(*) FROM positions_%d", i, i );
+        retval = sqlite3_exec(handle,buf,0,0,0);
+        if( retval )
+            printf("sqlite3_exec(INSERT bucket_stats %d) FAILED %s\n", i, sqlite3_errmsg(handle) );
+    }
+    int nbr_games = 0;
+    retval = sqlite3_prepare_v2( handle, "SELECT games.game_id, white, black, games.result, moves, game_details.year FROM games "
+                                         "LEFT JOIN game_details ON game_details.game_id = games.game_id", -1, &stmt, 0 );
+    if( retval )
+        printf("sqlite3_prepare_v2(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+    else
+    {
+        while( SQLITE_ROW == sqlite3_step(stmt) )
+        {
+            const char *white  = (const char *)sqlite3_column_text( stmt, 1 );
+            const char *black  = (const char *)sqlite3_column_text( stmt, 2 );
+            const char *result = (const char *)sqlite3_column_text( stmt, 3 );
+            const char *blob   = (const char *)sqlite3_column_blob( stmt, 4 );
+            int len = sqlite3_column_bytes( stmt, 4 );
+            if( !white )
+                white = "";
+            if( !black )
+                black = "";
+            int id = sqlite3_column_int( stmt, 0 );
+            uint64_t game_hash = game_hash_calculate( white, black, result?result:"", blob, len );
+            game_hash_insert( game_hash, id );
+            if( len > 0 )
+            {
+                uint64_t fingerprint = fingerprint_calculate( final_position_hash(blob,len), blob, len, white, black );
+                fingerprint_insert( fingerprint, id, sqlite3_column_int(stmt,5) );   // 0 if the year isn't known
+            }
+            if( (++nbr_games % 100000) == 0 )
+                printf( "%d games hashed\n", nbr_games );
+        }
+        sqlite3_finalize(stmt);
+    }
+    bool have_indexes = false;
+    retval = sqlite3_prepare_v2( handle, "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND name='idx_games'", -1, &stmt, 0 );
+    if( retval == 0 )
+    {
+        if( SQLITE_ROW == sqlite3_step(stmt) )
+            have_indexes = (sqlite3_column_int(stmt,0) > 0);
+        sqlite3_finalize(stmt);
+    }
+    meta_set( "next_game_id", next_game_id );
+    meta_set( "indexes_created", have_indexes?1:0 );
+    meta_set( "schema_version", SCHEMA_VERSION );
+    db_primitive_transaction_end();
+    report( "Database metadata setup end" );
+}
+
+static void meta_open()
+{
+    const char *creates[] =
+    {
+        "CREATE TABLE IF NOT EXISTS meta (key TEXT PRIMARY KEY, value INTEGER)",
+        "CREATE TABLE IF NOT EXISTS bucket_stats (table_nbr INTEGER PRIMARY KEY, nbr_rows INTEGER)",
+        "CREATE TABLE IF NOT EXISTS game_hashes (game_hash INTEGER PRIMARY KEY, game_id INTEGER)",
+        FINGERPRINTS_TABLE,
+        "CREATE TABLE IF NOT EXISTS duplicate_games (game_id INTEGER PRIMARY KEY, original_game_id INTEGER)",
+        "CREATE TABLE IF NOT EXISTS opening_tree (position_hash INTEGER, next_hash INTEGER, nbr_games INTEGER, nbr_white_wins INTEGER, nbr_black_wins INTEGER, nbr_draws INTEGER, elo_total INTEGER, nbr_elo INTEGER, PRIMARY KEY(position_hash,next_hash))",
+        "CREATE TABLE IF NOT EXISTS players (player_id INTEGER PRIMARY KEY, name TEXT UNIQUE)",
+        "CREATE TABLE IF NOT EXISTS game_players (player_id INTEGER, game_id INTEGER, colour INTEGER)",
+        "CREATE INDEX IF NOT EXISTS idx_game_players ON game_players(player_id,game_id,colour)",
+        "CREATE TABLE IF NOT EXISTS game_details (game_id INTEGER PRIMARY KEY, year INTEGER, white_elo INTEGER, black_elo INTEGER, eco TEXT, result TEXT)",
+        "CREATE INDEX IF NOT EXISTS idx_details_year ON game_details(year)",
+        "CREATE INDEX IF NOT EXISTS idx_details_white_elo ON game_details(white_elo)",
+        "CREATE INDEX IF NOT EXISTS idx_details_black_elo ON game_details(black_elo)",
+        "CREATE INDEX IF NOT EXISTS idx_details_eco ON game_details(eco)",
+        "CREATE INDEX IF NOT EXISTS idx_details_result ON game_details(result)"
+    };
+    for( unsigned int i=0; i<sizeof(creates)/sizeof(creates[0]); i++ )
+    {
+        int retval = sqlite3_exec(handle,creates[i],0,0,0);
+        if( retval )
+        {
+            printf("sqlite3_exec(%s) FAILED %s\n", creates[i], sqlite3_errmsg(handle) );
+            return;
+        }
+    }
+    sqlite3_int64 version = meta_get("schema_version",0);
+    if( version < SCHEMA_VERSION )
+        meta_setup( version );
+    indexes_created = (meta_get("indexes_created",0) != 0);
+}
+
+// Record the next game id and the rows added to each positions_N table, as
+//  part of the current transaction (if any)
+static void meta_flush()
+{
+    if( game_id_valid )
+        meta_set( "next_game_id", game_id );
+    sqlite3_stmt *stmt = NULL;
+    for( int i=0; i<NBR_BUCKETS; i++ )
+    {
+        if( bucket_rows_added[i] == 0 )
+            continue;
+        if( !stmt )
+        {
+            int retval = sqlite3_prepare_v2( handle, "UPDATE bucket_stats SET nbr_rows=nbr_rows+? WHERE table_nbr=?", -1, &stmt, 0 );
+            if( retval )
+            {
+                printf("sqlite3_prepare_v2(UPDATE bucket_stats) FAILED %s\n", sqlite3_errmsg(handle) );
+                return;
+            }
+        }
+        sqlite3_bind_int( stmt, 1, bucket_rows_added[i] );
+        sqlite3_bind_int( stmt, 2, i );
+        int retval = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if( retval != SQLITE_DONE )
+            printf("sqlite3_step(UPDATE bucket_stats) FAILED %s\n", sqlite3_errmsg(handle) );
+        bucket_rows_added[i] = 0;
+    }
+    if( stmt )
+        sqlite3_finalize(stmt);
+}
+
+static void finalize_statements()
+{
+    sqlite3_stmt **stmts[] = { &insert_game_stmt, &select_game_hash_stmt, &insert_game_hash_stmt,
+                               &select_fingerprint_stmt, &insert_fingerprint_stmt, &insert_duplicate_stmt,
+                               &update_tree_stmt, &insert_tree_stmt, &insert_player_stmt, &insert_game_player_stmt,
+                               &insert_details_stmt };
+    for( unsigned int i=0; i<sizeof(stmts)/sizeof(stmts[0]); i++ )
+    {
+        if( *stmts[i] )
+        {
+            sqlite3_finalize(*stmts[i]);
+            *stmts[i] = NULL;
+        }
+    }
+    for( int i=0; i<NBR_BUCKETS; i++ )
+    {
+        if( insert_position_stmt[i] )
+        {
+            sqlite3_finalize(insert_position_stmt[i]);
+            insert_position_stmt[i] = NULL;
+        }
+    }
+}
+
+// The database file doesn't exist yet (or is empty), so opening it creates it
+static bool database_file_is_new()
+{
+    FILE *f = fopen( db_file.c_str(), "rb" );
+    if( !f )
+        return true;
+    bool is_new = (fgetc(f) == EOF);
+    fclose(f);
+    return is_new;
+}
+
 void db_primitive_open()
 {
     printf( "db_primitive_open()\n" );
 
     // Try to create the database. If it doesnt exist, it would be created
     //  pass a pointer to the pointer to sqlite3, in short sqlite3**
-    int retval = sqlite3_open(DB_MAINTENANCE_FILE,&handle);
+    bool creating = database_file_is_new();
+    int retval = sqlite3_open(db_file.c_str(),&handle);
     
     // If connection failed, handle returns NULL
     if(retval)
@@ -164,6 +811,7 @@ void db_primitive_open()
         return;
     }
     printf("Connection successful\n");
+    db_primitive_profile_apply( handle, db_profile, false, creating );
     
     // Create tables if not existing
     report( "Create games table");
@@ -188,7 +836,8 @@ void db_primitive_open_multi()
     
     // Try to create the database. If it doesnt exist, it would be created
     //  pass a pointer to the pointer to sqlite3, in short sqlite3**
-    int retval = sqlite3_open(DB_MAINTENANCE_FILE,&handle);
+    bool creating = database_file_is_new();
+    int retval = sqlite3_open(db_file.c_str(),&handle);
     
     // If connection failed, handle returns NULL
     if(retval)
@@ -197,6 +846,7 @@ void db_primitive_open_multi()
         return;
     }
     printf("Connection successful\n");
+    db_primitive_profile_apply( handle, db_profile, false, creating );
     
     // Create tables if not existing
     report( "Create games table");
@@ -210,7 +860,7 @@ void db_primitive_open_multi()
     for( int i=0; i<NBR_BUCKETS; i++ )
     {
         char buf[200];
-        sprintf( buf, "CREATE TABLE IF NOT EXISTS positions_%d (game_id INTEGER, position_hash INTEGER)", i );
+        sprintf( buf, "CREATE TABLE IF NOT EXISTS positions_%d (game_id INTEGER, position_hash INTEGER, blob_offset INTEGER)", i );
         retval = sqlite3_exec(handle,buf,0,0,0);
         if( retval )
         {
@@ -219,6 +869,8 @@ void db_primitive_open_multi()
         }
     }
     report( "Create positions tables end");
+    blob_offsets = positions_have_offsets();
+    meta_open();
 }
 
 void db_primitive_delete_previous_data()
@@ -249,15 +901,43 @@ void db_primitive_transaction_begin()
 }
 
 
-void db_primitive_transaction_end()
+// Returns false if the transaction was rolled back rather than committed
+bool db_primitive_transaction_end()
 {
     char *errmsg;
     char buf[80];
-    purge_buckets();
+
+    // The position rows go in with the games (and the game hashes that make
+    //  a later append skip them), so an interrupted append can't leave
+    //  committed games that no position search finds
+    if( !build_failed )
+    {
+        purge_buckets();
+        flush_sorter();
+    }
+
+    // Nor can a failure to write some of the position rows leave committed
+    //  games without them. Once it happens the build stops, no more games
+    //  are inserted
+    if( build_failed )
+    {
+        build_discard();
+        if( sqlite3_get_autocommit(handle) )
+            return false;   // already rolled back
+        sprintf( buf, "ROLLBACK TRANSACTION" );
+        int retval = sqlite3_exec( handle, buf,0,0,&errmsg);
+        if( retval )
+            printf("sqlite3_exec(ROLLBACK TRANSACTION) FAILED %s\n", errmsg );
+        printf( "Position rows lost, games since the last commit rolled back\n" );
+        return false;
+    }
+    opening_tree_flush();
+    meta_flush();
     sprintf( buf, "COMMIT TRANSACTION" );
     int retval = sqlite3_exec( handle, buf,0,0,&errmsg);
     if( retval )
         printf("sqlite3_exec(COMMIT TRANSACTION) FAILED %s\n", errmsg );
+    return retval == 0;
 }
 
 
@@ -286,13 +966,26 @@ void db_primitive_create_indexes()
 
 void db_primitive_create_indexes_multi()
 {
+    if( build_failed )
+        return;
     purge_buckets();
+    flush_sorter();
+
+    // Once created the indexes are kept up to date by each append
+    if( indexes_created )
+    {
+        report( "Indexes already created" );
+        return;
+    }
+    // With game_id as well as position_hash, the games that reach a position
+    //  come out of the index in game_id order, so the game list's page queries
+    //  (see Database.cpp) read one page of them rather than sorting them all
     for( int i=0; i<NBR_BUCKETS; i++ )
     {
         char buf[200];
         sprintf( buf, "Create positions_%d index", i );
         report( buf );
-        sprintf( buf, "CREATE INDEX IF NOT EXISTS idx%d ON positions_%d(position_hash)",i,i);
+        sprintf( buf, "CREATE INDEX IF NOT EXISTS idx%d ON positions_%d(position_hash,game_id)",i,i);
         int retval = sqlite3_exec(handle,buf,0,0,0);
         if( retval )
         {
@@ -306,7 +999,26 @@ void db_primitive_create_indexes_multi()
     if( retval )
     {
         printf("sqlite3_exec(CREATE INDEX games) FAILED\n");
+        return;
+    }
+    indexes_created = true;
+    meta_set( "indexes_created", 1 );
+}
+
+// The number of columns of positions_N's index idxN, 0 if it has none
+static int index_nbr_columns( int table_nbr )
+{
+    char buf[100];
+    sprintf( buf, "PRAGMA index_info(idx%d)", table_nbr );
+    sqlite3_stmt *stmt;
+    int nbr = 0;
+    if( 0 == sqlite3_prepare_v2( handle, buf, -1, &stmt, 0 ) )
+    {
+        while( SQLITE_ROW == sqlite3_step(stmt) )
+            nbr++;
+        sqlite3_finalize(stmt);
     }
+    return nbr;
 }
 
 void db_primitive_create_extra_indexes()
@@ -323,6 +1035,11 @@ void db_primitive_create_extra_indexes()
     for( int i=0; i<NBR_BUCKETS; i++ )
     {
         char buf[200];
+
+        // Databases built since the positions indexes included game_id already
+        //  have this index
+        if( index_nbr_columns(i) == 2 )
+            continue;
         sprintf( buf, "DROP INDEX idx%d", i );
         report( buf );
         retval = sqlite3_exec(handle,buf,0,0,0);
@@ -339,19 +1056,234 @@ void db_primitive_create_extra_indexes()
         report( buf );
         if( retval )
         {
-            printf( "sqlite3_exec FAILED 3\n" );
-            return;
+            printf( "sqlite3_exec FAILED 3\n" );
+            return;
+        }
+    }
+}
+
+// Compare the old sqlite3_exec() per row ingest method with the cached prepared
+//  statement method, on a throw away in memory database
+static void ingest_speed_test()
+{
+    const int nbr_rows = 200000;
+    sqlite3 *mem;
+    int retval = sqlite3_open(":memory:",&mem);
+    if( retval )
+    {
+        printf("IN MEMORY DATABASE CONNECTION FAILED\n");
+        return;
+    }
+    sqlite3_exec(mem,"CREATE TABLE positions_0 (game_id INTEGER, position_hash INTEGER)",0,0,0);
+    sqlite3_exec(mem,"CREATE TABLE positions_1 (game_id INTEGER, position_hash INTEGER)",0,0,0);
+    double elapsed[2];
+    for( int method=0; method<2; method++ )
+    {
+        char buf[200];
+        sprintf( buf, "Ingest test, %s; begin", method==0?"sqlite3_exec()":"prepared statement" );
+        report( buf );
+        clock_t start = clock();
+        sqlite3_exec(mem,"BEGIN TRANSACTION",0,0,0);
+        sqlite3_stmt *stmt = NULL;
+        if( method == 1 )
+            sqlite3_prepare_v2( mem, "INSERT INTO positions_1 VALUES(?,?)", -1, &stmt, 0 );
+        for( int i=0; i<nbr_rows; i++ )
+        {
+            int hash = (int)(i*2654435761U);
+            if( method == 0 )
+            {
+                sprintf( buf, "INSERT INTO positions_0 VALUES(%d,%d)", i/80, hash );
+                sqlite3_exec( mem, buf, 0, 0, 0 );
+            }
+            else if( stmt )
+            {
+                sqlite3_bind_int( stmt, 1, i/80 );
+                sqlite3_bind_int( stmt, 2, hash );
+                sqlite3_step(stmt);
+                sqlite3_reset(stmt);
+            }
+        }
+        if( stmt )
+            sqlite3_finalize(stmt);
+        sqlite3_exec(mem,"COMMIT TRANSACTION",0,0,0);
+        elapsed[method] = (clock()-start) * 1000.0 / CLOCKS_PER_SEC;
+        sprintf( buf, "Ingest test, %s; end", method==0?"sqlite3_exec()":"prepared statement" );
+        report( buf );
+    }
+    printf( "Ingest %d position rows: sqlite3_exec() %.0f ms, prepared statement %.0f ms (%.1fx)\n",
+            nbr_rows, elapsed[0], elapsed[1], elapsed[1]>0.0 ? elapsed[0]/elapsed[1] : 0.0 );
+    sqlite3_close(mem);
+}
+
+static double elapsed_ms( std::chrono::steady_clock::time_point start )
+{
+    return std::chrono::duration<double,std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+// Compare the profiles, a bulk ingest into an indexed table (ten transactions,
+//  like appending ten .pgn files) in a scratch file next to the database, then
+//  position lookups on the database itself. The first lookup pass starts with
+//  an empty page cache (the operating system's cache will still be warm), the
+//  second pass reuses it
+static void profile_speed_test()
+{
+    const int nbr_rows = 1000000;
+    const int nbr_transactions = 10;
+    const int nbr_lookups = 2000;
+    std::string scratch = db_file + ".profile_test";
+    double ingest_ms[NBR_DB_PROFILES];
+    double lookup_ms[NBR_DB_PROFILES][2];
+    sqlite3_int64 ingest_mem[NBR_DB_PROFILES];
+    sqlite3_int64 lookup_mem[NBR_DB_PROFILES];
+    for( int profile=0; profile<NBR_DB_PROFILES; profile++ )
+    {
+        char buf[200];
+        sprintf( buf, "Profile test, %s ingest; begin", db_primitive_profile_name(profile) );
+        report( buf );
+        remove( scratch.c_str() );
+        sqlite3 *db;
+        int retval = sqlite3_open( scratch.c_str(), &db );
+        if( retval )
+        {
+            printf("sqlite3_open(%s) FAILED\n", scratch.c_str() );
+            sqlite3_close(db);
+            return;
+        }
+        sqlite3_memory_highwater(1);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        db_primitive_profile_apply( db, profile, false, true );
+        sqlite3_exec(db,"CREATE TABLE positions_0 (game_id INTEGER, position_hash INTEGER, blob_offset INTEGER)",0,0,0);
+        sqlite3_exec(db,"CREATE INDEX idx0 ON positions_0(position_hash)",0,0,0);
+        sqlite3_stmt *stmt = NULL;
+        sqlite3_prepare_v2( db, "INSERT INTO positions_0 VALUES(?,?,?)", -1, &stmt, 0 );
+        for( int i=0; stmt && i<nbr_rows; i++ )
+        {
+            if( i % (nbr_rows/nbr_transactions) == 0 )
+            {
+                if( i > 0 )
+                    sqlite3_exec(db,"COMMIT TRANSACTION",0,0,0);
+                sqlite3_exec(db,"BEGIN TRANSACTION",0,0,0);
+            }
+            sqlite3_bind_int( stmt, 1, i/80 );
+            sqlite3_bind_int64( stmt, 2, (sqlite3_int64)(i*0x9e3779b97f4a7c15ULL) );
+            sqlite3_bind_int( stmt, 3, i%80 );
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+        if( stmt )
+            sqlite3_finalize(stmt);
+        sqlite3_exec(db,"COMMIT TRANSACTION",0,0,0);
+        sqlite3_close(db);
+        ingest_ms[profile]  = elapsed_ms(start);
+        ingest_mem[profile] = sqlite3_memory_highwater(1);
+        sprintf( buf, "Profile test, %s ingest; end", db_primitive_profile_name(profile) );
+        report( buf );
+    }
+    remove( scratch.c_str() );
+
+    // Some positions that are in the database, spread over the tables
+    std::vector< std::pair<int,sqlite3_int64> > lookups;
+    sqlite3 *db;
+    int retval = sqlite3_open_v2( db_file.c_str(), &db, SQLITE_OPEN_READONLY, NULL );
+    if( retval )
+        printf("sqlite3_open_v2(%s) FAILED\n", db_file.c_str() );
+    for( int i=0; retval==0 && i<nbr_lookups; i++ )
+    {
+        char buf[200];
+        int table_nbr = (i*97) % NBR_BUCKETS;
+        sprintf( buf, "SELECT position_hash FROM positions_%d LIMIT 1 OFFSET %d", table_nbr, i%5 );
+        sqlite3_stmt *stmt;
+        if( SQLITE_OK == sqlite3_prepare_v2( db, buf, -1, &stmt, 0 ) )
+        {
+            if( sqlite3_step(stmt) == SQLITE_ROW )
+                lookups.push_back( std::make_pair( table_nbr, sqlite3_column_int64(stmt,0) ) );
+            sqlite3_finalize(stmt);
+        }
+    }
+    sqlite3_close(db);
+    for( int profile=0; profile<NBR_DB_PROFILES; profile++ )
+    {
+        lookup_ms[profile][0] = lookup_ms[profile][1] = 0.0;
+        lookup_mem[profile] = 0;
+        if( lookups.size() == 0 )
+            continue;
+        char buf[200];
+        sprintf( buf, "Profile test, %s lookups; begin", db_primitive_profile_name(profile) );
+        report( buf );
+        retval = sqlite3_open_v2( db_file.c_str(), &db, SQLITE_OPEN_READONLY, NULL );
+        if( retval )
+        {
+            sqlite3_close(db);
+            continue;
+        }
+        db_primitive_profile_apply( db, profile, true, false );
+        sqlite3_memory_highwater(1);
+        for( int pass=0; pass<2; pass++ )
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for( unsigned int i=0; i<lookups.size(); i++ )
+            {
+                int table_nbr = lookups[i].first;
+                sprintf( buf, "SELECT COUNT(*) FROM games, positions_%d WHERE positions_%d.position_hash=? "
+                              "AND games.game_id = positions_%d.game_id", table_nbr, table_nbr, table_nbr );
+                sqlite3_stmt *stmt;
+                if( SQLITE_OK == sqlite3_prepare_v2( db, buf, -1, &stmt, 0 ) )
+                {
+                    sqlite3_bind_int64( stmt, 1, lookups[i].second );
+                    sqlite3_step(stmt);
+                    sqlite3_finalize(stmt);
+                }
+            }
+            lookup_ms[profile][pass] = elapsed_ms(start);
+        }
+        lookup_mem[profile] = sqlite3_memory_highwater(1);
+        sqlite3_close(db);
+        sprintf( buf, "Profile test, %s lookups; end", db_primitive_profile_name(profile) );
+        report( buf );
+    }
+
+    printf( "Ingest %d position rows in %d transactions, and %d position lookups (ms, peak SQLite memory KB)\n",
+            nbr_rows, nbr_transactions, (int)lookups.size() );
+    printf( "%-18s%10s%10s%10s%10s%10s\n", "Profile", "Ingest", "Memory", "Lookup 1", "Lookup 2", "Memory" );
+    for( int profile=0; profile<NBR_DB_PROFILES; profile++ )
+    {
+        printf( "%-18s%10.0f%10lld%10.0f%10.0f%10lld\n", db_primitive_profile_name(profile),
+                ingest_ms[profile], (long long)(ingest_mem[profile]/1024),
+                lookup_ms[profile][0], lookup_ms[profile][1], (long long)(lookup_mem[profile]/1024) );
+    }
+}
+
+// The positions_N table and position_hash of the position after a line of
+//  moves, in a database with 64 bit keys
+static void position_key_after( const char *line, int &table_nbr, sqlite3_int64 &key )
+{
+    thc::ChessRules cr;
+    char buf[200];
+    strcpy( buf, line );
+    for( char *s=strtok(buf," "); s; s=strtok(NULL," ") )
+    {
+        thc::Move mv;
+        if( !mv.NaturalIn(&cr,s) )
+        {
+            printf( "Bad move %s in %s\n", s, line );
+            break;
         }
+        cr.PlayMove(mv);
     }
+    uint64_t hash = cr.Hash64Calculate();
+    table_nbr = ((int)(hash>>32))&(NBR_BUCKETS-1);
+    key = (sqlite3_int64)hash;
 }
 
 void db_primitive_speed_tests()
 {
     printf( "db_primitive_speed_tests()\n" );
+    ingest_speed_test();
+    profile_speed_test();
     
     // Try to create the database. If it doesnt exist, it would be created
     //  pass a pointer to the pointer to sqlite3, in short sqlite3**
-    int retval = sqlite3_open(DB_MAINTENANCE_FILE,&handle);
+    int retval = sqlite3_open(db_file.c_str(),&handle);
     
     // If connection failed, handle returns NULL
     if(retval)
@@ -361,29 +1293,42 @@ void db_primitive_speed_tests()
     }
     printf("Connection successful\n");
     
-    const char *magnus = "SELECT COUNT(*) from games, positions_2569 WHERE games.white = 'Carlsen, Magnus' "
-                         "AND positions_2569.position_hash=44349918 AND games.game_id = positions_2569.game_id";
+    // The Magnus and Players tests count the same games, Carlsen's as White
+    //  in the Najdorf, one by the games table the other by the players tables
+    int table_nbr;
+    sqlite3_int64 key;
+    char magnus[1000], sicilian[1000], players[1000];
+    position_key_after( "e4 c5 Nf3 d6 d4 cxd4 Nxd4 Nf6 Nc3 a6", table_nbr, key );
+    sprintf( magnus, "SELECT COUNT(*) from games, positions_%d WHERE games.white = 'Carlsen, Magnus' "
+                     "AND positions_%d.position_hash=%lld AND games.game_id = positions_%d.game_id",
+                     table_nbr, table_nbr, (long long)key, table_nbr );
+    sprintf( players, "SELECT COUNT(*) from game_players, positions_%d WHERE game_players.player_id = "
+                      "(SELECT player_id FROM players WHERE name='Carlsen, Magnus') AND game_players.colour=0 "
+                      "AND positions_%d.position_hash=%lld AND game_players.game_id = positions_%d.game_id",
+                      table_nbr, table_nbr, (long long)key, table_nbr );
+    position_key_after( "e4 c5", table_nbr, key );
+    sprintf( sicilian, "SELECT COUNT(*) from games, positions_%d WHERE positions_%d.position_hash=%lld "
+                       "AND games.game_id = positions_%d.game_id", table_nbr, table_nbr, (long long)key, table_nbr );
     const char *stamp =  "SELECT COUNT(*) from games, positions_3386 WHERE positions_3386.position_hash=2007903353 "
-                         "AND games.game_id = positions_3386.game_id";
-    const char *sicilian="SELECT COUNT(*) from games, positions_391 WHERE positions_391.position_hash=1592470315 "
-                         "AND games.game_id = positions_391.game_id";
+                         "AND games.game_id = positions_3386.game_id";   // a 32 bit key, from an old database
 
     char buf[1000];
     sqlite3_stmt *stmt;    // A prepared statement for fetching tables
-    printf( "Database is %s\n", DB_MAINTENANCE_FILE );
-    int results[5][3];
+    printf( "Database is %s\n", db_file.c_str() );
+    int results[5][4];
     time_t start_time;
     time ( &start_time );
-    for( int i=0; i<5*3; i++ )
+    for( int i=0; i<5*4; i++ )
     {
         const char *query, *txt;
-        switch(i%3)
+        switch(i%4)
         {
             case 0: query = magnus;     txt="Magnus"; break;
             case 1: query = stamp;      txt="Stamp"; break;
             case 2: query = sicilian;   txt="Sicilian"; break;
+            case 3: query = players;    txt="Players"; break;
         }
-        sprintf( buf, "Test %d, %s; begin", i/3+1, txt );
+        sprintf( buf, "Test %d, %s; begin", i/4+1, txt );
         report( buf );
         retval = sqlite3_prepare_v2( handle, query, -1, &stmt, 0 );
         if( retval )
@@ -398,13 +1343,13 @@ void db_primitive_speed_tests()
             const char *val = (const char*)sqlite3_column_text(stmt,0);
             printf("Game count=%d\n", atoi(val) );
         }
-        sprintf( buf, "Test %d, %s; end", i/3+1, txt );
+        sprintf( buf, "Test %d, %s; end", i/4+1, txt );
         int expired = report( buf );
-        results[i/3][i%3] = expired;
+        results[i/4][i%4] = expired;
         sqlite3_finalize(stmt);
     }
     
-    for( int i=0; i<5*3; i++ )
+    for( int i=0; i<5*4; i++ )
     {
         int expired = results[i%5][i/5];
         if( i%5 == 0 )
@@ -415,6 +1360,7 @@ void db_primitive_speed_tests()
                 case 0: txt="Magnus:";   break;
                 case 1: txt="Stamp:";    break;
                 case 2: txt="Sicilian:"; break;
+                case 3: txt="Players:";  break;
             }
             printf( "%-10s", txt );
         }
@@ -438,7 +1384,20 @@ void db_primitive_speed_tests()
 
 void db_primitive_close()
 {
-    purge_buckets();
+    if( build_failed )
+        build_discard();
+    else
+    {
+        purge_buckets();
+        flush_sorter();
+        opening_tree_flush();
+        meta_flush();
+    }
+    build_failed = false;
+    finalize_statements();
+    game_id_valid = false;
+    player_ids.clear();
+    player_ids_loaded = false;
 
     // Close the handle to free memory
     sqlite3_close(handle);
@@ -554,7 +1513,7 @@ void db_primitive_show_games( bool connect )
     {
         // Try to create the database. If it doesnt exist, it would be created
         //  pass a pointer to the pointer to sqlite3, in short sqlite3**
-        retval = sqlite3_open(DB_MAINTENANCE_FILE,&handle);
+        retval = sqlite3_open(db_file.c_str(),&handle);
         
         // If connection failed, handle returns NULL
         if(retval)
@@ -651,6 +1610,18 @@ void db_primitive_show_games( bool connect )
 int db_primitive_count_games()
 {
     int game_count=0;
+
+    // The metadata makes counting unnecessary
+    nbr_exact_duplicates = 0;
+    nbr_near_duplicates = 0;
+    sqlite3_int64 next_game_id = meta_get( "next_game_id", -1 );
+    if( next_game_id >= 0 )
+    {
+        game_id = (int)next_game_id;
+        game_id_valid = true;
+        printf( "Next game id = %d\n", game_id );
+        return game_id;
+    }
     
     // select matching rows from the table
     char buf[100];
@@ -704,6 +1675,7 @@ int db_primitive_count_games()
     }
     printf("Get games count end\n");
     game_id = game_count;
+    game_id_valid = true;
     return game_count;
 }
 
@@ -784,7 +1756,168 @@ void db_primitive_insert_game( const char *white, const char *black, const char
     game_id++;
 }
 
-std::vector<std::pair<int,int>> buckets[NBR_BUCKETS];
+// Bulk builds put the position rows through an external sort by default, so
+//  each transaction's rows are loaded into each positions_N table in fully
+//  sorted order (rather than in partially sorted bucket sized pieces) with
+//  memory use bounded by sort_budget.
+//  A budget of zero selects the original in memory buckets
+static size_t sort_budget = DEFAULT_SORT_BUDGET;
+static ExternalSort *sorter;
+
+void db_primitive_set_sort_budget( size_t budget )
+{
+    flush_sorter();
+    delete sorter;
+    sorter = NULL;
+    sort_budget = budget;
+}
+
+// The sort key puts the table number (bits 32-43 of the hash) in the top 12
+//  bits, then the rest of the hash arranged (top 20 bits with the sign bit
+//  flipped, then the low 32 bits) so that within a table (unsigned) key order
+//  matches SQLite's (signed) integer order
+static inline uint64_t sort_key( uint64_t hash )
+{
+    uint64_t table_nbr = (hash>>32) & (NBR_BUCKETS-1);
+    uint64_t hi = (hash>>44) ^ 0x80000;
+    return (table_nbr<<52) | (hi<<32) | (hash&0xffffffff);
+}
+
+static inline uint64_t sort_key_to_hash( uint64_t key )
+{
+    uint64_t table_nbr = key>>52;
+    uint64_t hi = ((key>>32)&0xfffff) ^ 0x80000;
+    return (hi<<44) | (table_nbr<<32) | (key&0xffffffff);
+}
+
+static void flush_sorter()
+{
+    if( !sorter || sorter->Count()==0 )
+        return;
+    char buf[200];
+    sprintf( buf, "Sorted load of %lu positions begin", (unsigned long)sorter->Count() );
+    report( buf );
+    bool own_transaction = (sqlite3_get_autocommit(handle) != 0) && !build_failed;
+    if( own_transaction )
+        db_primitive_transaction_begin();
+    int nbr_runs = 0;
+    int current_table = -1;
+    bool ok = !build_failed;
+    sqlite3_stmt *stmt = NULL;
+    SORT_RECORD rec;
+    while( sorter->Next(rec) )
+    {
+        nbr_runs = sorter->NbrRuns();
+        int table_nbr = (int)(rec.key>>52);
+        sqlite3_int64 hash = (sqlite3_int64)sort_key_to_hash(rec.key);
+        if( table_nbr != current_table )
+        {
+            current_table = table_nbr;
+            stmt = get_insert_position_stmt( table_nbr );
+        }
+        if( !stmt || !ok )
+            continue;   // keep draining, so the sorter is reset
+        sqlite3_bind_int  ( stmt, 1, rec.game_id );
+        sqlite3_bind_int64( stmt, 2, hash );
+        if( blob_offsets )
+            sqlite3_bind_int( stmt, 3, rec.blob_offset );
+        int retval = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if( retval != SQLITE_DONE )
+        {
+            printf("sqlite3_step(INSERT positions_%d) FAILED %s\n", table_nbr, sqlite3_errmsg(handle) );
+            ok = false;
+        }
+        else
+            bucket_rows_added[table_nbr]++;
+    }
+    if( !build_failed && (!ok || !sorter->Ok()) )
+    {
+        printf( "Sorted load of positions FAILED, position rows lost\n" );
+        build_failed = true;
+    }
+    if( own_transaction )
+        db_primitive_transaction_end();
+    sprintf( buf, "Sorted load of positions end, %d runs merged", nbr_runs );
+    report( buf );
+}
+
+// Call back with the compressed moves of every game in the games table
+void db_primitive_for_each_game_blob( void (*callback)( void *context, int game_id, const char *blob, int blob_len ), void *context )
+{
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( handle, "SELECT game_id, moves FROM games", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("sqlite3_prepare_v2(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        int game_id = sqlite3_column_int( stmt, 0 );
+        const char *blob = (const char *)sqlite3_column_blob( stmt, 1 );
+        int len = sqlite3_column_bytes( stmt, 1 );
+        callback( context, game_id, blob, len );
+    }
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+    sqlite3_finalize(stmt);
+}
+
+// Build the binary position index file that sits alongside the database, by
+//  replaying every game in the games table
+void db_primitive_build_position_index()
+{
+    std::string filename = db_file + POSITION_INDEX_SUFFIX;
+    report( "Build position index begin" );
+    PositionIndexBuilder builder( filename.c_str(), sort_budget>0 ? sort_budget : DEFAULT_SORT_BUDGET );
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( handle, "SELECT game_id, moves FROM games", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("sqlite3_prepare_v2(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    int nbr_games = 0;
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        int game_id = sqlite3_column_int( stmt, 0 );
+        const char *blob = (const char *)sqlite3_column_blob( stmt, 1 );
+        int len = sqlite3_column_bytes( stmt, 1 );
+        builder.AddGame( game_id, blob, len );
+        if( (++nbr_games % 100000) == 0 )
+            printf( "%d games\n", nbr_games );
+    }
+    sqlite3_finalize(stmt);
+    if( retval != SQLITE_DONE )
+    {
+        printf("sqlite3_step(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    sqlite3_int64 max_rowid = 0;
+    retval = sqlite3_prepare_v2( handle, "SELECT MAX(rowid) FROM games", -1, &stmt, 0 );
+    if( retval == 0 )
+    {
+        if( SQLITE_ROW == sqlite3_step(stmt) )
+            max_rowid = sqlite3_column_int64( stmt, 0 );
+        sqlite3_finalize(stmt);
+    }
+    report( "Build position index, sorted write begin" );
+    builder.Finish( max_rowid );
+    report( "Build position index end" );
+}
+
+// A positions_N row
+struct POSITION_ROW
+{
+    int64_t hash;
+    int game_id;
+    int blob_offset;
+    bool operator < ( const POSITION_ROW &rhs ) const
+        { return hash<rhs.hash || (hash==rhs.hash && game_id<rhs.game_id); }
+};
+
+std::vector<POSITION_ROW> buckets[NBR_BUCKETS];
 static void purge_buckets()
 {
     for( int i=0; i<NBR_BUCKETS; i++ )
@@ -793,11 +1926,20 @@ static void purge_buckets()
     }
 }
 
+// Drop everything waiting to be written, after position rows have been lost
+static void build_discard()
+{
+    for( int i=0; i<NBR_BUCKETS; i++ )
+        buckets[i].clear();
+    flush_sorter();     // just drains it, once build_failed is set
+    opening_tree_discard();
+    memset( bucket_rows_added, 0, sizeof(bucket_rows_added) );
+    game_id_valid = false;
+}
+
 static void purge_bucket( int bucket_idx )
 {
-    char *errmsg;
-    char insert_buf[2000];
-    std::vector<std::pair<int,int>> *bucket = &buckets[bucket_idx];
+    std::vector<POSITION_ROW> *bucket = &buckets[bucket_idx];
     int count = bucket->size();
     if( count > 0 )
     {
@@ -805,30 +1947,66 @@ static void purge_bucket( int bucket_idx )
         char buf[100];
         sprintf( buf, "purge bucket %d, %d items", bucket_idx, count );
         report( buf );
+        sqlite3_stmt *stmt = get_insert_position_stmt( bucket_idx );
+        if( !stmt )
+            return;
         for( int j=0; j<count; j++ )
         {
-            std::pair<int,int> duo = (*bucket)[j];
-            sprintf( insert_buf, "INSERT INTO positions_%d VALUES(%d,%d)", bucket_idx, duo.second, duo.first );
-            int retval = sqlite3_exec( handle, insert_buf,0,0,&errmsg);
-            if( retval )
+            const POSITION_ROW &row = (*bucket)[j];
+            sqlite3_bind_int  ( stmt, 1, row.game_id );
+            sqlite3_bind_int64( stmt, 2, row.hash );
+            if( blob_offsets )
+                sqlite3_bind_int( stmt, 3, row.blob_offset );
+            int retval = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if( retval != SQLITE_DONE )
             {
-                printf("sqlite3_exec(INSERT 3) FAILED %s\n", errmsg );
+                printf("sqlite3_step(INSERT positions_%d) FAILED %s\n", bucket_idx, sqlite3_errmsg(handle) );
+                build_failed = true;
                 return;
             }
+            bucket_rows_added[bucket_idx]++;
         }
         bucket->clear();
     }
 }
 
-void db_primitive_insert_game_multi( const char *white, const char *black, const char *event, const char *site, const char *result, int nbr_moves, thc::Move *moves, uint64_t *hashes  )
+bool db_primitive_insert_game_multi( const char *white, const char *black, const char *event, const char *site, const char *date, const char *result, int white_elo, int black_elo, const char *eco, int nbr_moves, thc::Move *moves, uint64_t *hashes  )
+{
+    char blob_buf[2000];    // up to 2 bytes per move
+    int blob_len = db_primitive_compress_moves( nbr_moves, moves, blob_buf, sizeof(blob_buf) );
+    return db_primitive_insert_game_compressed( white, black, date, result, white_elo, black_elo, eco, blob_buf, blob_len, nbr_moves, hashes );
+}
+
+// Compress moves into a blob, return the length of the blob. Uses no database
+//  state so it can be called concurrently from the ingest pipeline's worker threads
+int db_primitive_compress_moves( int nbr_moves, thc::Move *moves, char *blob_buf, int blob_buf_len )
+{
+    CompressMoves press;
+    char *put = blob_buf;
+    for( int i=0; i<nbr_moves && put<blob_buf+blob_buf_len-2; i++ )
+    {
+        thc::Move mv = moves[i];
+        int nbr = press.compress_move( mv, put );
+        if( nbr == 0 )
+            break;
+        put += nbr;
+    }
+    return put-blob_buf;
+}
+
+// Insert a game whose moves have already been compressed, returns false if
+//  the game was skipped because it (or a near duplicate) is already in the database
+bool db_primitive_insert_game_compressed( const char *white, const char *black, const char *date, const char *result, int white_elo, int black_elo, const char *eco, const char *blob_buf, int blob_len, int nbr_moves, const uint64_t *hashes  )
 {
-    //printf( "db_primitive_gameover(%s,%s)\n", white, black );
-    //uint32_t *move_ptr = (uint32_t *)moves;
-    char *errmsg;
-    char insert_buf[2000];
-    char blob_buf[1000];    // about 500 moves each
     char white_buf[200];
     char black_buf[200];
+    if( build_failed )
+        return false;
+
+    // Names are still sanitised as they always have been, so that games added
+    //  now sort and match (games.white ordering, FindRow(), the player name
+    //  searches and the fingerprints) the same way as rows already present
     strcpy( white_buf, white );
     char *s=white_buf;
     while( *s )
@@ -849,56 +2027,487 @@ void db_primitive_insert_game_multi( const char *white, const char *black, const
             *s = '_';
         s++;
     }
-    CompressMoves press;
-    char *put = blob_buf;
-    for( int i=0; i<nbr_moves && put<blob_buf+sizeof(blob_buf)-10; i++ )
+
+    // An exact duplicate of a game already present is skipped
+    uint64_t game_hash = game_hash_calculate( white_buf, black_buf, result, blob_buf, blob_len );
+    if( game_hash_exists(game_hash) )
     {
-        char buf[2];
-        thc::Move mv = moves[i];
-        int nbr = press.compress_move( mv, buf );
-        /* std::string s = mv.TerseOut();
-         if( nbr == 1 )
-         printf( "compress temp> %s -> %02x\n", s.c_str(), buf[0]&0xff );
-         else if( nbr == 2 )
-         printf( "compress temp> %s -> %02x,%02x\n", s.c_str(), buf[0]&0xff, buf[1]&0xff );
-         else
-         printf( "nbr == 0 ?\n"); */
-        if( nbr == 0 )
-            break;
-        for( int j=0; j<nbr && j<2; j++ )
+        nbr_exact_duplicates++;
+        return false;
+    }
+    if( nbr_moves > 0 )
+    {
+        int year = date_year(date);
+        uint64_t fingerprint = fingerprint_calculate( hashes[nbr_moves-1], blob_buf, blob_len, white_buf, black_buf );
+        int original_game_id;
+        if( !fingerprint_lookup(fingerprint,year,original_game_id) )
+            fingerprint_insert( fingerprint, game_id, year );
+        else
         {
-            char c = buf[j];
-            char hi = (c>>4)&0x0f;
-            *put++ = (hi>=10 ? hi-10+'A' : hi+'0');
-            char lo = c&0x0f;
-            *put++ = (lo>=10 ? lo-10+'A' : lo+'0');
+            nbr_near_duplicates++;
+            if( duplicate_mode == DUPLICATES_SKIP )
+                return false;
+            duplicate_insert( game_id, original_game_id );
         }
-        //printf( "%s %s\n", (i<nbr_moves?"true":"false"), (put<blob_buf+sizeof(blob_buf-10) ? "true" ? "false") );
     }
-    *put = '\0';
-    //printf( "%d %s\n", nbr_moves, blob_buf );
-    sprintf( insert_buf, "INSERT INTO games VALUES(%d,'%s','%s','%s',X'%s')", game_id, white_buf, black_buf, result, blob_buf );
-    //printf( "%s\n", insert_buf );
-    int retval = sqlite3_exec( handle, insert_buf,0,0,&errmsg);
-    if( retval )
+    game_hash_insert( game_hash, game_id );
+
+    // The moves go in as a real BLOB, rather than as a hex X'...' literal
+    sqlite3_stmt *stmt = get_insert_game_stmt();
+    if( stmt )
     {
-        printf("sqlite3_exec(INSERT 1) FAILED %s\n", errmsg );
+        sqlite3_bind_int ( stmt, 1, game_id );
+        sqlite3_bind_text( stmt, 2, white_buf, -1, SQLITE_STATIC );
+        sqlite3_bind_text( stmt, 3, black_buf, -1, SQLITE_STATIC );
+        sqlite3_bind_text( stmt, 4, result,    -1, SQLITE_STATIC );
+        sqlite3_bind_blob( stmt, 5, blob_buf, blob_len, SQLITE_STATIC );
+        int retval = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if( retval != SQLITE_DONE )
+            printf("sqlite3_step(INSERT games) FAILED %s\n", sqlite3_errmsg(handle) );
+    }
+    add_positions( game_id, nbr_moves, hashes, blob_buf, blob_len );
+    opening_tree_add_game( result, white_elo, black_elo, nbr_moves, hashes );
+    players_add_game( game_id, white_buf, black_buf );
+    details_add_game( game_id, date_year(date), white_elo, black_elo, eco, result );
+    game_id++;
+    return true;
+}
+
+// Add a game's positions to the positions_N tables, through the external sort
+//  or the in memory buckets. Each row has the position's offset in the game's
+//  blob (the length of the blob up to and including the move that reaches it),
+//  so Database can find the path to a position without replaying the game.
+//  Nearly every move compresses to one byte so the offset is usually the ply
+static void add_positions( int game_id, int nbr_moves, const uint64_t *hashes, const char *blob, int blob_len )
+{
+    std::vector<int> offsets;
+    if( blob_offsets && blob_len!=nbr_moves )
+    {
+        CompressMoves press;
+        int nbr = 0;
+        for( int i=0; i<nbr_moves; i++ )
+        {
+            thc::Move mv;
+            int nbr_used = nbr<blob_len ? press.decompress_move( blob+nbr, mv ) : 0;
+            nbr += nbr_used>0 ? nbr_used : 1;
+            offsets.push_back( nbr );
+        }
+    }
+    if( sort_budget > 0 )
+    {
+        if( !sorter )
+            sorter = new ExternalSort( sort_budget, db_file.c_str() );
+        for( int i=0; i<nbr_moves; i++ )
+            sorter->Add( sort_key(hashes[i]), game_id, offsets.size() ? offsets[i] : i+1 );
+        return;
     }
     for( int i=0; i<nbr_moves; i++ )
     {
-        uint64_t hash64 = *hashes++;
-        int hash32 = (int)(hash64);
+        uint64_t hash64 = hashes[i];
         int table_nbr = ((int)(hash64>>32))&(NBR_BUCKETS-1);
-        std::vector<std::pair<int,int>> *bucket = &buckets[table_nbr];
-        std::pair<int,int> duo(hash32,game_id);
-        bucket->push_back(duo);
+        std::vector<POSITION_ROW> *bucket = &buckets[table_nbr];
+        POSITION_ROW row;
+        row.hash = (int64_t)hash64;
+        row.game_id = game_id;
+        row.blob_offset = offsets.size() ? offsets[i] : i+1;
+        bucket->push_back(row);
         int count = bucket->size();
         if( count >= PURGE_QUOTA )
             purge_bucket(table_nbr);
     }
-    game_id++;
 }
 
+// True unless the positions_N tables were created before the blob_offset
+//  column was added
+static bool positions_have_offsets()
+{
+    sqlite3_stmt *stmt;
+    bool present = false;
+    int retval = sqlite3_prepare_v2( handle, "PRAGMA table_info(positions_0)", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("sqlite3_prepare_v2(PRAGMA table_info) FAILED %s\n", sqlite3_errmsg(handle) );
+        return false;
+    }
+    while( SQLITE_ROW == sqlite3_step(stmt) )
+    {
+        const char *name = (const char *)sqlite3_column_text( stmt, 1 );
+        if( name && 0==strcmp(name,"blob_offset") )
+            present = true;
+    }
+    sqlite3_finalize(stmt);
+    return present;
+}
+
+// The positions rows of a database from before schema version 3 are replaced
+//  by replaying every game
+static void positions_rekey()
+{
+    report( "Rebuild positions tables with 64 bit keys begin" );
+    for( int i=0; i<NBR_BUCKETS; i++ )
+    {
+        char buf[100];
+        sprintf( buf, "DELETE FROM positions_%d", i );
+        int retval = sqlite3_exec(handle,buf,0,0,0);
+        if( retval )
+        {
+            printf("sqlite3_exec(DELETE positions_%d) FAILED %s\n", i, sqlite3_errmsg(handle) );
+            return;
+        }
+    }
+    sqlite3_stmt *stmt;
+    int retval = sqlite3_prepare_v2( handle, "SELECT game_id, moves FROM games", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("sqlite3_prepare_v2(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    std::vector<uint64_t> hashes;
+    int nbr_games = 0;
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        int id = sqlite3_column_int( stmt, 0 );
+        const char *blob = (const char *)sqlite3_column_blob( stmt, 1 );
+        int len = sqlite3_column_bytes( stmt, 1 );
+        replay_hashes( blob, len, hashes, len );
+        if( hashes.size() > 0 )
+            add_positions( id, (int)hashes.size(), &hashes[0], blob, len );
+        if( (++nbr_games % 100000) == 0 )
+            printf( "%d games replayed\n", nbr_games );
+    }
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+    sqlite3_finalize(stmt);
+    purge_buckets();
+    flush_sorter();
+    memset( bucket_rows_added, 0, sizeof(bucket_rows_added) );   // the caller counts the rows
+    report( "Rebuild positions tables with 64 bit keys end" );
+}
+
+// The position hashes after each move (up to max_plies of them), returns the
+//  number of moves
+static int replay_hashes( const char *blob, int blob_len, std::vector<uint64_t> &hashes, int max_plies )
+{
+    hashes.clear();
+    CompressMoves press;
+    uint64_t hash = press.cr.Hash64Calculate();
+    for( int nbr=0; nbr<blob_len && (int)hashes.size()<max_plies; )
+    {
+        thc::ChessPosition cr = press.cr;
+        thc::Move mv;
+        int nbr_used = press.decompress_move( blob, mv );
+        if( nbr_used == 0 )
+            break;
+        blob += nbr_used;
+        nbr += nbr_used;
+        hash = cr.Hash64Update( hash, mv );
+        hashes.push_back( hash );
+    }
+    return (int)hashes.size();
+}
+
+/*
+    Opening tree; a row of table opening_tree for each position reached in the
+    first OPENING_TREE_PLIES plies of any game and each continuation played
+    from it, with the number of games, the results and the total Elo of the
+    players who made the move. A continuation is identified by the hash of the
+    position it leads to (so no moves are needed, only the hashes calculated
+    for the positions tables anyway), Database maps them back to moves. A game
+    counts once per position, from the first time it reaches it.
+
+    Rows are accumulated in memory and added to the table (as new rows, or
+    added to existing ones, so an append updates the tree incrementally) at
+    the end of each transaction, or sooner if memory use grows too high.
+ */
+#define OPENING_TREE_QUOTA 1000000  // max pending rows
+
+struct OPENING_TREE_COUNTS
+{
+    int nbr_games;
+    int nbr_white_wins;
+    int nbr_black_wins;
+    int nbr_draws;
+    int nbr_elo;
+    int64_t elo_total;
+};
+
+static std::map< std::pair<uint64_t,uint64_t>, OPENING_TREE_COUNTS > opening_tree_pending;
+
+static void opening_tree_add_game( const char *result, int white_elo, int black_elo, int nbr_moves, const uint64_t *hashes )
+{
+    static uint64_t start_hash;
+    if( start_hash == 0 )
+    {
+        thc::ChessRules cr;
+        start_hash = cr.Hash64Calculate();
+    }
+    int white_wins = (0==strcmp(result,"1-0"));
+    int black_wins = (0==strcmp(result,"0-1"));
+    int draws      = (0==strcmp(result,"1/2-1/2"));
+    int nbr_plies  = nbr_moves<OPENING_TREE_PLIES ? nbr_moves : OPENING_TREE_PLIES;
+    for( int i=0; i<nbr_plies; i++ )
+    {
+        uint64_t position_hash = (i==0 ? start_hash : hashes[i-1]);
+        bool repeat = (i>0 && position_hash==start_hash);
+        for( int j=0; !repeat && j<i-1; j++ )
+            repeat = (hashes[j]==position_hash);
+        if( repeat )
+            continue;
+        OPENING_TREE_COUNTS &counts = opening_tree_pending[ std::make_pair(position_hash,hashes[i]) ];
+        counts.nbr_games++;
+        counts.nbr_white_wins += white_wins;
+        counts.nbr_black_wins += black_wins;
+        counts.nbr_draws      += draws;
+        int elo = (i%2==0 ? white_elo : black_elo);
+        if( elo > 0 )
+        {
+            counts.nbr_elo++;
+            counts.elo_total += elo;
+        }
+    }
+    if( opening_tree_pending.size() >= OPENING_TREE_QUOTA )
+        opening_tree_flush();
+}
+
+static void opening_tree_flush()
+{
+    if( opening_tree_pending.size() == 0 )
+        return;
+    char buf[200];
+    sprintf( buf, "Opening tree, add %lu rows begin", (unsigned long)opening_tree_pending.size() );
+    report( buf );
+    bool own_transaction = (sqlite3_get_autocommit(handle) != 0);
+    if( own_transaction )
+        sqlite3_exec( handle, "BEGIN TRANSACTION",0,0,0);
+    sqlite3_stmt *update_stmt = get_cached_stmt( update_tree_stmt, "UPDATE opening_tree SET nbr_games=nbr_games+?, nbr_white_wins=nbr_white_wins+?, nbr_black_wins=nbr_black_wins+?, "
+                                                                    "nbr_draws=nbr_draws+?, elo_total=elo_total+?, nbr_elo=nbr_elo+? WHERE position_hash=? AND next_hash=?" );
+    sqlite3_stmt *insert_stmt = get_cached_stmt( insert_tree_stmt, "INSERT INTO opening_tree VALUES(?,?,?,?,?,?,?,?)" );
+    std::map< std::pair<uint64_t,uint64_t>, OPENING_TREE_COUNTS >::iterator it;
+    for( it=opening_tree_pending.begin(); update_stmt && insert_stmt && it!=opening_tree_pending.end(); it++ )
+    {
+        OPENING_TREE_COUNTS &counts = it->second;
+        sqlite3_bind_int  ( update_stmt, 1, counts.nbr_games );
+        sqlite3_bind_int  ( update_stmt, 2, counts.nbr_white_wins );
+        sqlite3_bind_int  ( update_stmt, 3, counts.nbr_black_wins );
+        sqlite3_bind_int  ( update_stmt, 4, counts.nbr_draws );
+        sqlite3_bind_int64( update_stmt, 5, counts.elo_total );
+        sqlite3_bind_int  ( update_stmt, 6, counts.nbr_elo );
+        sqlite3_bind_int64( update_stmt, 7, (sqlite3_int64)it->first.first );
+        sqlite3_bind_int64( update_stmt, 8, (sqlite3_int64)it->first.second );
+        int retval = sqlite3_step(update_stmt);
+        sqlite3_reset(update_stmt);
+        if( retval != SQLITE_DONE )
+        {
+            printf("sqlite3_step(UPDATE opening_tree) FAILED %s\n", sqlite3_errmsg(handle) );
+            break;
+        }
+        if( sqlite3_changes(handle) > 0 )
+            continue;
+        sqlite3_bind_int64( insert_stmt, 1, (sqlite3_int64)it->first.first );
+        sqlite3_bind_int64( insert_stmt, 2, (sqlite3_int64)it->first.second );
+        sqlite3_bind_int  ( insert_stmt, 3, counts.nbr_games );
+        sqlite3_bind_int  ( insert_stmt, 4, counts.nbr_white_wins );
+        sqlite3_bind_int  ( insert_stmt, 5, counts.nbr_black_wins );
+        sqlite3_bind_int  ( insert_stmt, 6, counts.nbr_draws );
+        sqlite3_bind_int64( insert_stmt, 7, counts.elo_total );
+        sqlite3_bind_int  ( insert_stmt, 8, counts.nbr_elo );
+        retval = sqlite3_step(insert_stmt);
+        sqlite3_reset(insert_stmt);
+        if( retval != SQLITE_DONE )
+        {
+            printf("sqlite3_step(INSERT opening_tree) FAILED %s\n", sqlite3_errmsg(handle) );
+            break;
+        }
+    }
+    opening_tree_pending.clear();
+    if( own_transaction )
+        sqlite3_exec( handle, "COMMIT TRANSACTION",0,0,0);
+    report( "Opening tree, add rows end" );
+}
+
+static void opening_tree_discard()
+{
+    opening_tree_pending.clear();
+}
+
+// The opening tree of a database from before schema version 4 is built by
+//  replaying every game, the players' Elos aren't in the games table
+static void opening_tree_rebuild()
+{
+    report( "Build opening tree begin" );
+    opening_tree_pending.clear();
+    int retval = sqlite3_exec( handle, "DELETE FROM opening_tree",0,0,0);
+    if( retval )
+    {
+        printf("sqlite3_exec(DELETE opening_tree) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    sqlite3_stmt *stmt;
+    retval = sqlite3_prepare_v2( handle, "SELECT result, moves FROM games", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("sqlite3_prepare_v2(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    std::vector<uint64_t> hashes;
+    int nbr_games = 0;
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        const char *result = (const char *)sqlite3_column_text( stmt, 0 );
+        const char *blob = (const char *)sqlite3_column_blob( stmt, 1 );
+        int len = sqlite3_column_bytes( stmt, 1 );
+        int nbr_moves = replay_hashes( blob, len, hashes, OPENING_TREE_PLIES );
+        if( nbr_moves > 0 )
+            opening_tree_add_game( result?result:"", 0, 0, nbr_moves, &hashes[0] );
+        if( (++nbr_games % 100000) == 0 )
+            printf( "%d games replayed\n", nbr_games );
+    }
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+    sqlite3_finalize(stmt);
+    opening_tree_flush();
+    report( "Build opening tree end" );
+}
+
+/*
+    Players; table players gives each distinct name (as it appears in table
+    games) an integer id and table game_players has a (player_id, game_id,
+    colour) row for each player of each game, colour 0 for white and 1 for
+    black. The index on game_players lists the games of any player in game_id
+    order, so Database can intersect them with the games that reach a
+    position instead of comparing names row by row.
+ */
+
+static int player_id_get( const char *name )
+{
+    if( !player_ids_loaded )
+    {
+        player_ids_loaded = true;
+        sqlite3_stmt *stmt;
+        int retval = sqlite3_prepare_v2( handle, "SELECT player_id, name FROM players", -1, &stmt, 0 );
+        if( retval )
+        {
+            printf("sqlite3_prepare_v2(SELECT players) FAILED %s\n", sqlite3_errmsg(handle) );
+            return -1;
+        }
+        while( SQLITE_ROW == sqlite3_step(stmt) )
+        {
+            const char *val = (const char *)sqlite3_column_text( stmt, 1 );
+            player_ids[ val?val:"" ] = sqlite3_column_int( stmt, 0 );
+        }
+        sqlite3_finalize(stmt);
+    }
+    std::map< std::string, int >::iterator it = player_ids.find( name );
+    if( it != player_ids.end() )
+        return it->second;
+    int id = player_ids.size() + 1;
+    sqlite3_stmt *stmt = get_cached_stmt( insert_player_stmt, "INSERT INTO players VALUES(?,?)" );
+    if( !stmt )
+        return -1;
+    sqlite3_bind_int ( stmt, 1, id );
+    sqlite3_bind_text( stmt, 2, name, -1, SQLITE_STATIC );
+    int retval = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if( retval != SQLITE_DONE )
+    {
+        printf("sqlite3_step(INSERT players) FAILED %s\n", sqlite3_errmsg(handle) );
+        return -1;
+    }
+    player_ids[name] = id;
+    return id;
+}
+
+static void players_add_game( int game_id, const char *white, const char *black )
+{
+    sqlite3_stmt *stmt = get_cached_stmt( insert_game_player_stmt, "INSERT INTO game_players VALUES(?,?,?)" );
+    if( !stmt )
+        return;
+    for( int colour=0; colour<2; colour++ )
+    {
+        int player_id = player_id_get( colour==0 ? white : black );
+        if( player_id < 0 )
+            return;
+        sqlite3_bind_int( stmt, 1, player_id );
+        sqlite3_bind_int( stmt, 2, game_id );
+        sqlite3_bind_int( stmt, 3, colour );
+        int retval = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if( retval != SQLITE_DONE )
+        {
+            printf("sqlite3_step(INSERT game_players) FAILED %s\n", sqlite3_errmsg(handle) );
+            return;
+        }
+    }
+}
 
+// The players tables of a database from before schema version 5 are built
+//  from the games table
+static void players_rebuild()
+{
+    report( "Build players tables begin" );
+    player_ids.clear();
+    player_ids_loaded = false;
+    int retval = sqlite3_exec( handle, "DELETE FROM game_players",0,0,0);
+    if( retval == 0 )
+        retval = sqlite3_exec( handle, "DELETE FROM players",0,0,0);
+    if( retval )
+    {
+        printf("sqlite3_exec(DELETE players) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    sqlite3_stmt *stmt;
+    retval = sqlite3_prepare_v2( handle, "SELECT game_id, white, black FROM games", -1, &stmt, 0 );
+    if( retval )
+    {
+        printf("sqlite3_prepare_v2(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+        return;
+    }
+    int nbr_games = 0;
+    while( SQLITE_ROW == (retval=sqlite3_step(stmt)) )
+    {
+        const char *white = (const char *)sqlite3_column_text( stmt, 1 );
+        const char *black = (const char *)sqlite3_column_text( stmt, 2 );
+        players_add_game( sqlite3_column_int(stmt,0), white?white:"", black?black:"" );
+        if( (++nbr_games % 100000) == 0 )
+            printf( "%d games, %lu players\n", nbr_games, (unsigned long)player_ids.size() );
+    }
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(SELECT games) FAILED %s\n", sqlite3_errmsg(handle) );
+    sqlite3_finalize(stmt);
+    report( "Build players tables end" );
+}
 
+/*
+    Game details; table game_details has the year, Elos, ECO code and result
+    of each game (0 or an empty string if not known), for searches on them.
+    Each column is indexed, and since the game_id is the rowid the games with
+    a given value of any of them come out of the index in game_id order.
+ */
+static void details_add_game( int game_id, int year, int white_elo, int black_elo, const char *eco, const char *result )
+{
+    sqlite3_stmt *stmt = get_cached_stmt( insert_details_stmt, "INSERT OR REPLACE INTO game_details VALUES(?,?,?,?,?,?)" );
+    if( !stmt )
+        return;
+    sqlite3_bind_int ( stmt, 1, game_id );
+    sqlite3_bind_int ( stmt, 2, year );
+    sqlite3_bind_int ( stmt, 3, white_elo );
+    sqlite3_bind_int ( stmt, 4, black_elo );
+    sqlite3_bind_text( stmt, 5, eco,    -1, SQLITE_STATIC );
+    sqlite3_bind_text( stmt, 6, result, -1, SQLITE_STATIC );
+    int retval = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if( retval != SQLITE_DONE )
+        printf("sqlite3_step(INSERT game_details) FAILED %s\n", sqlite3_errmsg(handle) );
+}
 
+// A database from before schema version 6 only has the results, the other
+//  details were never stored
+static void details_rebuild()
+{
+    report( "Build game details table begin" );
+    int retval = sqlite3_exec( handle, "INSERT OR REPLACE INTO game_details SELECT game_id, 0, 0, 0, '', result FROM games",0,0,0);
+    if( retval )
+        printf("sqlite3_exec(INSERT game_details) FAILED %s\n", sqlite3_errmsg(handle) );
+    report( "Build game details table end" );
+}
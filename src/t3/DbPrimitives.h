@@ -8,12 +8,16 @@
 #define DB_PRIMITIVES_H
 #include "thc.h"
 #include <stdint.h>
+#include <stddef.h>
+struct sqlite3;
 
 //#define DB_FILE  "/Users/billforster/Documents/chessdb_small_blob.sqlite3"
 //#define DB_FILE  "/Users/billforster/Documents/ChessDatabases/chessdb_giant_part1_multi_4096.sqlite3"
 
 // recipe3.sqlite3 is a solid db
 
+// Defaults only, the files are configurable (see DatabaseConfig in Repository.h
+//  and db_primitive_set_database_file() below)
 #ifdef THC_MAC
 #define DB_FILE             "/Users/billforster/Documents/ChessDatabases/rebuild.sqlite3"
 #define DB_MAINTENANCE_FILE "/Users/billforster/Documents/ChessDatabases/rebuild.sqlite3"
@@ -22,20 +26,59 @@
 #define DB_MAINTENANCE_FILE "/Users/Bill/Documents/T3Database/rebuild.sqlite3"
 #endif
 
-
+// The database the db_primitive_xxx() functions work on, DB_MAINTENANCE_FILE by default
+void db_primitive_set_database_file( const char *filename );
+const char *db_primitive_get_database_file();
 
 void db_primitive_open();
 void db_primitive_open_multi();
 void db_primitive_delete_previous_data();
 void db_primitive_transaction_begin();
-void db_primitive_transaction_end();
+bool db_primitive_transaction_end();   // false if rolled back, position rows were lost
 void db_primitive_create_indexes();
 void db_primitive_create_indexes_multi();
 void db_primitive_create_extra_indexes();
 void db_primitive_close();
 int  db_primitive_count_games();
 void db_primitive_insert_game( const char *white, const char *black, const char *event, const char *site, const char *result, int nbr_moves, thc::Move *moves, uint32_t *hashes  );
-void db_primitive_insert_game_multi( const char *white, const char *black, const char *event, const char *site, const char *result, int nbr_moves, thc::Move *moves, uint64_t *hashes  );
+bool db_primitive_insert_game_multi( const char *white, const char *black, const char *event, const char *site, const char *date, const char *result, int white_elo, int black_elo, const char *eco, int nbr_moves, thc::Move *moves, uint64_t *hashes  );
+bool db_primitive_insert_game_compressed( const char *white, const char *black, const char *date, const char *result, int white_elo, int black_elo, const char *eco, const char *blob_buf, int blob_len, int nbr_moves, const uint64_t *hashes  );
+int  db_primitive_compress_moves( int nbr_moves, thc::Move *moves, char *blob_buf, int blob_buf_len );
+
+// What an append does with a near duplicate of a game already in the database
+//  (same moves, same players allowing for different spellings, same year)
+#define DUPLICATES_SKIP 0
+#define DUPLICATES_FLAG 1   // insert it anyway, and record it in table duplicate_games
+void db_primitive_set_duplicate_mode( int mode );
+void db_primitive_report_duplicates();
+
+// Table opening_tree has next move stats for the positions in the first
+//  OPENING_TREE_PLIES plies of every game (an Elo of 0 is unknown)
+#define OPENING_TREE_PLIES 20
+
+// Named profiles of SQLite pragmas applied when a connection is opened; page
+//  size (a new database only), page cache size, memory mapped I/O (read-only
+//  connections), journal mode and synchronous level (writers)
+#define DB_PROFILE_INTERACTIVE_READ 0   // the default, a big page cache, memory mapped reads
+#define DB_PROFILE_BULK_BUILD       1   // no rollback journal or syncs while creating a new database,
+                                        //  a failed build must be redone
+#define DB_PROFILE_LOW_MEMORY       2   // a small page cache, no memory mapping
+#define NBR_DB_PROFILES             3
+const char *db_primitive_profile_name( int profile );      // eg "bulk build"
+int  db_primitive_profile_lookup( const char *name, int default_profile );  // case, '-' and '_' ignored
+void db_primitive_profile_apply( sqlite3 *handle, int profile, bool read_only, bool creating );
+
+// Profile for the database the db_primitive_xxx() functions work on, DB_PROFILE_INTERACTIVE_READ by default
+void db_primitive_set_profile( int profile );
+
+// Memory budget (bytes) for sorting position rows in a bulk build, 0 = in memory buckets
+void db_primitive_set_sort_budget( size_t budget );
+
+// Call back with the compressed moves of every game
+void db_primitive_for_each_game_blob( void (*callback)( void *context, int game_id, const char *blob, int blob_len ), void *context );
+
+// Binary position index file (database file name + ".idx")
+void db_primitive_build_position_index();
 
 int  db_primitive_random_test_program();
 void db_primitive_show_games( bool connect );
@@ -0,0 +1,350 @@
+/****************************************************************************
+ *  Next move statistics and transpositions for a position, calculated
+ *  over the games loaded from the database
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_WARNINGS
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include "thc.h"
+#include "CompressMoves.h"
+#include "DbStats.h"
+
+// Not worth starting a thread for fewer games than this
+#define MIN_GAMES_PER_WORKER 2000
+
+// Each worker's results for its slice of the cache
+struct STATS_SLICE
+{
+    std::vector<DB_GAME_INFO> games;
+    std::vector<PATH_TO_POSITION> transpositions;  // in the order found
+    std::map< uint32_t, MOVE_STATS > stats;
+};
+
+// The known paths to the position, a trie over the bytes of their blobs. A
+//  game reaches the position by a known path if walking down the trie with the
+//  game's blob comes to the end of a path, so matching a game against all
+//  the paths takes one step per move rather than a comparison per path
+class PathTrie
+{
+public:
+    PathTrie() { nodes.resize(1); }
+
+    // The shortest known path that is a prefix of blob[0...len-1], -1 if none
+    int Find( const char *blob, size_t len ) const
+    {
+        int node = 0;
+        for( size_t i=0; nodes[node].path_idx<0; i++ )
+        {
+            if( i >= len )
+                return -1;
+            node = Child( node, blob[i] );
+            if( node < 0 )
+                return -1;
+        }
+        return nodes[node].path_idx;
+    }
+
+    void Insert( const char *blob, size_t len, int path_idx )
+    {
+        int node = 0;
+        for( size_t i=0; i<len; i++ )
+        {
+            int child = Child( node, blob[i] );
+            if( child < 0 )
+            {
+                child = (int)nodes.size();
+                nodes[node].children.push_back( std::make_pair(blob[i],child) );
+                nodes.resize( nodes.size()+1 );
+            }
+            node = child;
+        }
+        nodes[node].path_idx = path_idx;
+    }
+
+private:
+    struct NODE
+    {
+        NODE() { path_idx = -1; }
+        int path_idx;
+        std::vector< std::pair<char,int> > children;   // a few moves at most nodes
+    };
+    std::vector<NODE> nodes;
+
+    int Child( int node, char c ) const
+    {
+        const std::vector< std::pair<char,int> > &children = nodes[node].children;
+        for( size_t i=0; i<children.size(); i++ )
+        {
+            if( children[i].first == c )
+                return children[i].second;
+        }
+        return -1;
+    }
+};
+
+// Replay a game's blob up to the position, returns the length of the path to
+//  the position (with press left in the position) or -1 if the game doesn't
+//  reach it. If the offset of the position is known (offset>=0) the game is
+//  only decompressed that far, and the position checked once at the end
+static int path_length( const std::string &str_blob, int offset, const thc::ChessRules &cr_to_match, uint64_t hash_to_match,
+                        bool exact, size_t maxlen, CompressMoves &press )
+{
+    const char *blob = str_blob.c_str();
+    size_t nbr=0;
+    if( offset >= 0 )
+    {
+        while( nbr < (size_t)offset )
+        {
+            thc::Move mv;
+            int nbr_used = press.decompress_move( blob, mv );
+            if( nbr_used == 0 )
+                return -1;
+            blob += nbr_used;
+            nbr += nbr_used;
+        }
+        bool found = (nbr==(size_t)offset && press.cr.Hash64Calculate()==hash_to_match && (exact || press.cr==cr_to_match));
+        return found ? (int)nbr : -1;
+    }
+    size_t len = str_blob.length();
+    uint64_t hash = press.cr.Hash64Calculate();
+    bool found = (hash==hash_to_match && (exact || press.cr==cr_to_match) );
+    while( !found && nbr<len && (exact || nbr<maxlen) )
+    {
+        thc::ChessPosition cr_hash = press.cr;
+        thc::Move mv;
+        int nbr_used = press.decompress_move( blob, mv );
+        if( nbr_used == 0 )
+            break;
+        blob += nbr_used;
+        nbr += nbr_used;
+        hash = cr_hash.Hash64Update( hash, mv );
+        if( hash == hash_to_match && (exact || press.cr==cr_to_match) )
+            found = true;
+    }
+    return found ? (int)nbr : -1;
+}
+
+// The slice's transpositions start with the paths already known (from games
+//  processed earlier), so games that follow them don't need to be replayed
+static void stats_worker( const std::vector<DB_GAME_INFO> *cache, size_t begin, size_t end,
+                          thc::ChessRules cr_to_match, bool exact, STATS_SLICE *slice )
+{
+    std::vector<PATH_TO_POSITION> &transpositions = slice->transpositions;
+    uint64_t gbl_hash = cr_to_match.Hash64Calculate();
+    PathTrie known;
+    size_t maxlen = 1000000;   // absurdly large until a match found
+    for( size_t i=0; i<transpositions.size(); i++ )
+    {
+        known.Insert( transpositions[i].blob.c_str(), transpositions[i].blob.length(), (int)i );
+        maxlen = transpositions[i].blob.length() + 8;
+    }
+    for( size_t i=begin; i<end; i++ )
+    {
+        const DB_GAME_INFO &info = (*cache)[i];
+
+        // Search for a match to this game, if the offset of the position in the
+        //  game is known only a path of exactly that length can match. If the
+        //  offset is wrong somehow it is ignored
+        int offset = info.position_offset;
+        if( offset > (int)info.str_blob.length() )
+            offset = -1;
+        int found_idx = known.Find( info.str_blob.c_str(), offset>=0 ? offset : info.str_blob.length() );
+        if( found_idx>=0 && offset>=0 && transpositions[found_idx].blob.length()!=(size_t)offset )
+        {
+            offset = -1;
+            found_idx = known.Find( info.str_blob.c_str(), info.str_blob.length() );
+        }
+
+        // If none so far add the one from this game
+        if( found_idx < 0 )
+        {
+            PATH_TO_POSITION ptp;
+            int nbr = path_length( info.str_blob, offset, cr_to_match, gbl_hash, exact, maxlen, ptp.press );
+            if( nbr<0 && offset>=0 )
+            {
+                ptp.press = CompressMoves();
+                nbr = path_length( info.str_blob, -1, cr_to_match, gbl_hash, exact, maxlen, ptp.press );
+                if( nbr >= 0 )
+                    found_idx = known.Find( info.str_blob.c_str(), nbr );
+            }
+            if( found_idx<0 && nbr>=0 )
+            {
+                maxlen = nbr+8;
+                ptp.blob = info.str_blob.substr(0,nbr);
+                found_idx = transpositions.size();
+                transpositions.push_back(ptp);
+                known.Insert( ptp.blob.c_str(), ptp.blob.length(), found_idx );
+            }
+        }
+
+        if( found_idx >= 0 )
+        {
+            slice->games.push_back(info);
+            slice->games.back().transpo_nbr = found_idx;   // renumbered once merged
+            PATH_TO_POSITION *p = &transpositions[found_idx];
+            p->frequency++;
+            size_t len = p->blob.length();
+            if( len < info.str_blob.length() ) // must be more moves
+            {
+                const char *compress_move_ptr = info.str_blob.c_str()+len;
+                thc::Move mv;
+                p->press.decompress_move_stay( compress_move_ptr, mv );
+                uint32_t imv = 0;
+                memcpy( &imv, &mv, sizeof(mv) ); // FIXME
+                std::map< uint32_t, MOVE_STATS >::iterator it = slice->stats.find(imv);
+                if( it == slice->stats.end() )
+                {
+                    MOVE_STATS empty;
+                    empty.nbr_games = 0;
+                    empty.nbr_white_wins = 0;
+                    empty.nbr_black_wins = 0;
+                    empty.nbr_draws = 0;
+                    empty.nbr_elo = 0;
+                    empty.elo_total = 0;
+                    it = slice->stats.insert( std::make_pair(imv,empty) ).first;
+                }
+                it->second.nbr_games++;
+                if( info.result == "1-0" )
+                    it->second.nbr_white_wins++;
+                else if( info.result== "0-1" )
+                    it->second.nbr_black_wins++;
+                else if( info.result== "1/2-1/2" )
+                    it->second.nbr_draws++;
+            }
+        }
+    }
+}
+
+void db_stats_calculate( const std::vector<DB_GAME_INFO> &cache, const thc::ChessRules &cr_to_match, bool exact,
+                         std::vector<DB_GAME_INFO> &games,
+                         std::vector<PATH_TO_POSITION> &transpositions,
+                         std::map< uint32_t, MOVE_STATS > &stats )
+{
+    games.clear();
+    transpositions.clear();
+    stats.clear();
+    db_stats_calculate_more( cache, 0, cr_to_match, exact, games, transpositions, stats );
+}
+
+void db_stats_calculate_more( const std::vector<DB_GAME_INFO> &cache, size_t begin, const thc::ChessRules &cr_to_match, bool exact,
+                              std::vector<DB_GAME_INFO> &games,
+                              std::vector<PATH_TO_POSITION> &transpositions,
+                              std::map< uint32_t, MOVE_STATS > &stats )
+{
+    static_assert( sizeof(uint32_t) == sizeof(thc::Move), "Move stats are keyed by the move's 32 bit image" );
+    if( begin >= cache.size() )
+        return;
+
+    // Contiguous slices, so that concatenating the results keeps cache order
+    size_t nbr_new = cache.size() - begin;
+    int nbr_workers = std::thread::hardware_concurrency();
+    if( nbr_workers < 1 )
+        nbr_workers = 1;
+    int max_workers = (int)(nbr_new/MIN_GAMES_PER_WORKER);
+    if( nbr_workers > max_workers )
+        nbr_workers = max_workers>1 ? max_workers : 1;
+    std::vector<STATS_SLICE> slices(nbr_workers);
+    for( int i=0; i<nbr_workers; i++ )
+    {
+        slices[i].transpositions = transpositions;
+        for( size_t j=0; j<transpositions.size(); j++ )
+            slices[i].transpositions[j].frequency = 0;
+    }
+    if( nbr_workers == 1 )
+        stats_worker( &cache, begin, cache.size(), cr_to_match, exact, &slices[0] );
+    else
+    {
+        std::vector<std::thread> workers;
+        for( int i=0; i<nbr_workers; i++ )
+        {
+            size_t slice_begin = begin + (nbr_new*i) / nbr_workers;
+            size_t slice_end   = begin + (nbr_new*(i+1)) / nbr_workers;
+            workers.push_back( std::thread( stats_worker, &cache, slice_begin, slice_end, cr_to_match, exact, &slices[i] ) );
+        }
+        for( int i=0; i<nbr_workers; i++ )
+            workers[i].join();
+    }
+
+    // Merge into the earlier results, the same path can be found by more
+    //  than one worker. Each game's transpo_nbr becomes its path's index
+    //  in merged (from 1), the earlier games' indexes are unchanged
+    size_t nbr_earlier = games.size();
+    size_t nbr_games = nbr_earlier;
+    for( int i=0; i<nbr_workers; i++ )
+        nbr_games += slices[i].games.size();
+    games.reserve( nbr_games );
+    std::vector<PATH_TO_POSITION> merged;
+    merged.swap( transpositions );
+    std::map< std::string, int > known;
+    for( size_t i=0; i<merged.size(); i++ )
+        known[ merged[i].blob ] = (int)i;
+    for( int i=0; i<nbr_workers; i++ )
+    {
+        STATS_SLICE &slice = slices[i];
+        std::vector<int> remap( slice.transpositions.size() );
+        for( unsigned int j=0; j<slice.transpositions.size(); j++ )
+        {
+            PATH_TO_POSITION &ptp = slice.transpositions[j];
+            std::map< std::string, int >::iterator it = known.find(ptp.blob);
+            if( it != known.end() )
+            {
+                merged[it->second].frequency += ptp.frequency;
+                remap[j] = it->second;
+            }
+            else
+            {
+                remap[j] = known[ptp.blob] = merged.size();
+                merged.push_back(ptp);
+            }
+        }
+        size_t first = games.size();
+        games.insert( games.end(), std::make_move_iterator(slice.games.begin()), std::make_move_iterator(slice.games.end()) );
+        for( size_t j=first; j<games.size(); j++ )
+            games[j].transpo_nbr = remap[ games[j].transpo_nbr ] + 1;
+        std::map< uint32_t, MOVE_STATS >::iterator it;
+        for( it=slice.stats.begin(); it!=slice.stats.end(); it++ )
+        {
+            std::map< uint32_t, MOVE_STATS >::iterator dst = stats.find(it->first);
+            if( dst == stats.end() )
+                stats.insert( *it );
+            else
+            {
+                dst->second.nbr_games      += it->second.nbr_games;
+                dst->second.nbr_white_wins += it->second.nbr_white_wins;
+                dst->second.nbr_black_wins += it->second.nbr_black_wins;
+                dst->second.nbr_draws      += it->second.nbr_draws;
+                dst->second.nbr_elo        += it->second.nbr_elo;
+                dst->second.elo_total      += it->second.elo_total;
+            }
+        }
+    }
+
+    // Most frequent first, ties in the order found, then each game's
+    //  transpo_nbr is its path's place in that order (from 1). The earlier
+    //  games only need renumbering if the order has changed
+    std::vector< std::pair<int,int> > order;   // (-frequency, index found)
+    for( size_t i=0; i<merged.size(); i++ )
+        order.push_back( std::make_pair(-merged[i].frequency,(int)i) );
+    std::sort( order.begin(), order.end() );
+    std::vector<int> rank( merged.size() );
+    transpositions.reserve( merged.size() );
+    bool reordered = false;
+    for( size_t i=0; i<order.size(); i++ )
+    {
+        rank[ order[i].second ] = i;
+        if( order[i].second != (int)i )
+            reordered = true;
+        transpositions.push_back( merged[ order[i].second ] );
+    }
+    for( size_t i=(reordered?0:nbr_earlier); i<games.size(); i++ )
+        games[i].transpo_nbr = rank[ games[i].transpo_nbr-1 ] + 1;
+}
@@ -0,0 +1,52 @@
+/****************************************************************************
+ *  Next move statistics and transpositions for a position, calculated
+ *  over the games loaded from the database
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef DB_STATS_H
+#define DB_STATS_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "thc.h"
+#include "CompressMoves.h"
+#include "Database.h"
+
+// Individual path to a given position
+struct PATH_TO_POSITION
+{
+    PATH_TO_POSITION() { frequency=0; }
+    int frequency;
+    std::string blob;
+    CompressMoves press;    // Each of the different blobs has its own decompressor - necessary for situations where
+    //  for example the knights have swapped places - position is same but compressor state is not
+
+    // Sort according to frequency
+    bool operator < (const PATH_TO_POSITION& ptp)  const { return frequency < ptp.frequency; }
+    bool operator > (const PATH_TO_POSITION& ptp)  const { return frequency > ptp.frequency; }
+    bool operator == (const PATH_TO_POSITION& ptp) const { return frequency == ptp.frequency; }
+};
+
+// Find the games in cache that reach cr_to_match, in cache order, with the
+//  paths to the position (most frequent first) and stats for each next move,
+//  keyed by the move's 32 bit image. Each game's transpo_nbr is set to its
+//  path's place in transpositions (from 1). The cache is split between worker threads.
+//  With exact==false (an old database) hash matches are confirmed by comparing
+//  positions and a game is abandoned a few moves past the shortest path found
+void db_stats_calculate( const std::vector<DB_GAME_INFO> &cache, const thc::ChessRules &cr_to_match, bool exact,
+                         std::vector<DB_GAME_INFO> &games,
+                         std::vector<PATH_TO_POSITION> &transpositions,
+                         std::map< uint32_t, MOVE_STATS > &stats );
+
+// For games loaded in batches, add the games cache[begin...] to the results
+//  of an earlier call for the same position over cache[0...begin-1]. Only
+//  the new games are replayed, games that follow a known path aren't replayed
+void db_stats_calculate_more( const std::vector<DB_GAME_INFO> &cache, size_t begin, const thc::ChessRules &cr_to_match, bool exact,
+                              std::vector<DB_GAME_INFO> &games,
+                              std::vector<PATH_TO_POSITION> &transpositions,
+                              std::map< uint32_t, MOVE_STATS > &stats );
+
+#endif // DB_STATS_H
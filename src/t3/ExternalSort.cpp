@@ -0,0 +1,177 @@
+/****************************************************************************
+ *  External (disk based) sort of (key, game_id) records, memory use is
+ *  bounded by a budget, sorted runs spill to temporary files and are
+ *  then k-way merged
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <algorithm>
+#include <functional>
+#include "ExternalSort.h"
+
+#define MIN_RECORDS 4096
+
+ExternalSort::ExternalSort( size_t memory_budget, const char *temp_prefix )
+{
+    this->temp_prefix = temp_prefix;
+    buf_capacity = memory_budget / sizeof(SORT_RECORD);
+    if( buf_capacity < MIN_RECORDS )
+        buf_capacity = MIN_RECORDS;
+    buf.reserve( buf_capacity );
+    nbr_records = 0;
+    buf_idx = 0;
+    nbr_read = 0;
+    merging = false;
+    failed = false;
+}
+
+ExternalSort::~ExternalSort()
+{
+    Reset();
+}
+
+// Sort the records in memory and write them out as a run
+void ExternalSort::Spill()
+{
+    if( runs.size() == 0 )
+        failed = false;     // the first run of a new sort
+    std::sort( buf.begin(), buf.end() );
+    RUN run;
+    char suffix[40];
+    sprintf( suffix, ".run%d", (int)runs.size() );
+    run.filename = temp_prefix + suffix;
+    run.file = fopen( run.filename.c_str(), "w+b" );
+    run.idx = 0;
+    if( !run.file )
+    {
+        printf( "Cannot open %s\n", run.filename.c_str() );
+        failed = true;
+    }
+    else
+    {
+        size_t nbr = fwrite( &buf[0], sizeof(SORT_RECORD), buf.size(), run.file );
+        if( nbr != buf.size() || fflush(run.file)!=0 )
+        {
+            printf( "External sort, write to %s FAILED\n", run.filename.c_str() );
+            failed = true;
+        }
+    }
+    nbr_records += buf.size();
+    runs.push_back(run);
+    buf.clear();
+}
+
+// Read the next block of a run, return false if the run is exhausted
+bool ExternalSort::Fill( int run_idx )
+{
+    RUN &run = runs[run_idx];
+    run.block.resize( run.block.capacity() );
+    size_t nbr = run.file ? fread( &run.block[0], sizeof(SORT_RECORD), run.block.size(), run.file ) : 0;
+    if( run.file && ferror(run.file) )
+    {
+        printf( "External sort, read from %s FAILED\n", run.filename.c_str() );
+        failed = true;
+    }
+    run.block.resize(nbr);
+    run.idx = 0;
+    return nbr > 0;
+}
+
+bool ExternalSort::Next( SORT_RECORD &rec )
+{
+    if( !merging )
+    {
+        merging = true;
+        buf_idx = 0;
+        nbr_read = 0;
+        if( runs.size() == 0 )
+        {
+            // Everything fitted in memory
+            failed = false;
+            std::sort( buf.begin(), buf.end() );
+            nbr_records = buf.size();
+        }
+        else
+        {
+            if( buf.size() > 0 )
+                Spill();
+
+            // The merge gets the whole budget, shared between the runs
+            std::vector<SORT_RECORD> empty;
+            buf.swap(empty);
+            size_t block_size = buf_capacity / runs.size();
+            if( block_size < MIN_RECORDS )
+                block_size = MIN_RECORDS;
+            for( size_t i=0; i<runs.size(); i++ )
+            {
+                if( runs[i].file )
+                    fseek( runs[i].file, 0, SEEK_SET );
+                runs[i].block.reserve( block_size );
+                if( Fill(i) )
+                    heap.push_back( std::pair<SORT_RECORD,int>(runs[i].block[0],i) );
+            }
+            std::make_heap( heap.begin(), heap.end(), std::greater< std::pair<SORT_RECORD,int> >() );
+        }
+    }
+
+    // In memory
+    if( runs.size() == 0 )
+    {
+        if( buf_idx < buf.size() )
+        {
+            rec = buf[buf_idx++];
+            nbr_read++;
+            return true;
+        }
+    }
+
+    // K-way merge
+    else if( heap.size() > 0 )
+    {
+        std::pop_heap( heap.begin(), heap.end(), std::greater< std::pair<SORT_RECORD,int> >() );
+        rec = heap.back().first;
+        int i = heap.back().second;
+        heap.pop_back();
+        RUN &run = runs[i];
+        run.idx++;
+        if( run.idx < run.block.size() || Fill(i) )
+        {
+            heap.push_back( std::pair<SORT_RECORD,int>(run.block[run.idx],i) );
+            std::push_heap( heap.begin(), heap.end(), std::greater< std::pair<SORT_RECORD,int> >() );
+        }
+        nbr_read++;
+        return true;
+    }
+
+    // All done, ready to start again. A run that was cut short loses records
+    //  without any read error
+    if( nbr_read != nbr_records )
+    {
+        printf( "External sort, %lu of %lu records read back\n", (unsigned long)nbr_read, (unsigned long)nbr_records );
+        failed = true;
+    }
+    Reset();
+    return false;
+}
+
+void ExternalSort::Reset()
+{
+    for( size_t i=0; i<runs.size(); i++ )
+    {
+        if( runs[i].file )
+        {
+            fclose( runs[i].file );
+            remove( runs[i].filename.c_str() );
+        }
+    }
+    runs.clear();
+    heap.clear();
+    buf.clear();
+    buf.reserve( buf_capacity );
+    buf_idx = 0;
+    nbr_records = 0;
+    merging = false;
+}
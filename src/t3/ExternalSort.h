@@ -0,0 +1,85 @@
+/****************************************************************************
+ *  External (disk based) sort of (key, game_id) records, memory use is
+ *  bounded by a budget, sorted runs spill to temporary files and are
+ *  then k-way merged
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef EXTERNAL_SORT_H
+#define EXTERNAL_SORT_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Records sort by key (unsigned), then game_id
+struct SORT_RECORD
+{
+    uint64_t key;
+    int      game_id;
+    int      blob_offset;   // carried along (it fits in what would be padding), not a sort key
+    bool operator < ( const SORT_RECORD &rhs ) const
+        { return key<rhs.key || (key==rhs.key && game_id<rhs.game_id); }
+    bool operator > ( const SORT_RECORD &rhs ) const
+        { return rhs < *this; }
+};
+
+class ExternalSort
+{
+public:
+
+    // Runs are written to temporary files named temp_prefix.run0, .run1 etc.
+    ExternalSort( size_t memory_budget, const char *temp_prefix );
+    ~ExternalSort();
+
+    // Phase 1, add records in any order
+    void Add( uint64_t key, int game_id, int blob_offset=0 )
+    {
+        SORT_RECORD rec;
+        rec.key = key;
+        rec.game_id = game_id;
+        rec.blob_offset = blob_offset;
+        buf.push_back(rec);
+        if( buf.size() >= buf_capacity )
+            Spill();
+    }
+    size_t Count() { return nbr_records + (merging ? 0 : buf.size()); }
+
+    // Phase 2, retrieve the records in order, then start again at phase 1
+    bool Next( SORT_RECORD &rec );
+    int  NbrRuns() { return (int)runs.size(); }
+
+    // False if a run couldn't be written or read back, so records have been
+    //  lost. Stays false after Next() returns false, until the next sort starts
+    bool Ok() { return !failed; }
+
+private:
+    void Spill();
+    void Reset();
+    bool Fill( int run_idx );
+
+    std::string temp_prefix;
+    size_t buf_capacity;
+    size_t nbr_records;
+    std::vector<SORT_RECORD> buf;
+    size_t buf_idx;
+    size_t nbr_read;    // records returned by Next() so far
+    bool merging;
+    bool failed;
+
+    // A sorted run on disk, and the current block of it being merged
+    struct RUN
+    {
+        FILE *file;
+        std::string filename;
+        std::vector<SORT_RECORD> block;
+        size_t idx;
+    };
+    std::vector<RUN> runs;
+
+    // Merge heap (smallest at front) of (record, run index)
+    std::vector< std::pair<SORT_RECORD,int> > heap;
+};
+
+#endif // EXTERNAL_SORT_H
@@ -0,0 +1,75 @@
+/****************************************************************************
+ *  Sorted lists of game ids, and the set operations that combine the lists
+ *  for each criterion of a search
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#include <algorithm>
+#include <iterator>
+#include "GameIdList.h"
+
+// Galloping is worthwhile when one list is this many times longer
+#define GALLOP_RATIO 16
+
+void game_ids_sort( GAME_ID_LIST &ids )
+{
+    std::sort( ids.begin(), ids.end() );
+    ids.erase( std::unique(ids.begin(),ids.end()), ids.end() );
+}
+
+// Index of the first id >= target in big[from...], stepping 1,2,4,8.. ids
+//  ahead to bracket it then binary searching the bracket
+static size_t gallop( const GAME_ID_LIST &big, size_t from, int target )
+{
+    size_t step = 1;
+    size_t hi = from;
+    while( hi<big.size() && big[hi]<target )
+    {
+        from = hi+1;
+        hi += step;
+        step *= 2;
+    }
+    if( hi > big.size() )
+        hi = big.size();
+    return std::lower_bound( big.begin()+from, big.begin()+hi, target ) - big.begin();
+}
+
+void game_ids_intersect( const GAME_ID_LIST &a, const GAME_ID_LIST &b, GAME_ID_LIST &both )
+{
+    both.clear();
+    const GAME_ID_LIST &little = a.size()<=b.size() ? a : b;
+    const GAME_ID_LIST &big    = a.size()<=b.size() ? b : a;
+    if( little.size()*GALLOP_RATIO < big.size() )
+    {
+        size_t idx = 0;
+        for( size_t i=0; i<little.size() && idx<big.size(); i++ )
+        {
+            idx = gallop( big, idx, little[i] );
+            if( idx<big.size() && big[idx]==little[i] )
+                both.push_back( little[i] );
+        }
+    }
+    else
+        std::set_intersection( a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(both) );
+}
+
+static bool shorter( const GAME_ID_LIST &a, const GAME_ID_LIST &b )
+{
+    return a.size() < b.size();
+}
+
+void game_ids_intersect_all( std::vector<GAME_ID_LIST> &lists, GAME_ID_LIST &all )
+{
+    all.clear();
+    if( lists.size() == 0 )
+        return;
+    std::sort( lists.begin(), lists.end(), shorter );
+    all = lists[0];
+    GAME_ID_LIST temp;
+    for( size_t i=1; i<lists.size() && all.size()>0; i++ )
+    {
+        game_ids_intersect( all, lists[i], temp );
+        all.swap( temp );
+    }
+}
@@ -0,0 +1,27 @@
+/****************************************************************************
+ *  Sorted lists of game ids, and the set operations that combine the lists
+ *  for each criterion of a search
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef GAME_ID_LIST_H
+#define GAME_ID_LIST_H
+#include <vector>
+
+// The games that match a criterion, ascending game ids without duplicates
+typedef std::vector<int> GAME_ID_LIST;
+
+// Sort and remove duplicates, for a list that wasn't read in game id order
+void game_ids_sort( GAME_ID_LIST &ids );
+
+// The games in both lists. If one list is much shorter than the other its
+//  games are found in the longer list with a galloping (exponential then
+//  binary) search rather than by stepping through every game of both
+void game_ids_intersect( const GAME_ID_LIST &a, const GAME_ID_LIST &b, GAME_ID_LIST &both );
+
+// The games in every list, shortest lists first so the intermediate results
+//  are as short as possible. The lists are reordered
+void game_ids_intersect_all( std::vector<GAME_ID_LIST> &lists, GAME_ID_LIST &all );
+
+#endif // GAME_ID_LIST_H
@@ -730,7 +730,6 @@ void GameLogic::CmdNextGame()
             CompressMoves press;
             for( int nbr=0; nbr<len;  )
             {
-                thc::ChessRules cr = press.cr;
                 thc::Move mv;
                 int nbr_used = press.decompress_move( blob, mv );
                 if( nbr_used == 0 )
@@ -779,7 +778,6 @@ void GameLogic::CmdPreviousGame()
             CompressMoves press;
             for( int nbr=0; nbr<len;  )
             {
-                thc::ChessRules cr = press.cr;
                 thc::Move mv;
                 int nbr_used = press.decompress_move( blob, mv );
                 if( nbr_used == 0 )
@@ -20,6 +20,7 @@
 #include "PgnFiles.h"
 #include "Lang.h"
 #include "GamesCache.h"
+#include "PgnSource.h"
 #include <stdio.h>
 using namespace std;
 
@@ -65,81 +66,23 @@ bool GamesCache::Load( FILE *pgn_file )
     bool ok=true;
     GameDocument gd;
     game_nbr=0;
-    int fposn_base = 0;
-    gd.fposn0 = fposn_base;
-    const int BUFSIZE=10000;
-    char buf[BUFSIZE+5];
-    int req;
-    int len = fread(buf,1,req=BUFSIZE,pgn_file);
-    bool nomore = (len!=req);
-    const char *beg = buf;
-    const char *end = buf + (len>=0?len:0);
-    const char *s = beg;
-    bool done = (s>=end);
-    while( !done )
-    {
-        bool have_line=false;
-        const char *line = s;
-        while( s < end )
-        {
-            if( *s=='\r' || *s=='\n' )
-            {
-                have_line = true;
-                break;
-            }
-            s++;
-        }
-        if( !have_line )
-        {
-            // ragged, incomplete line
-            if( nomore )
-            {
-                done = true;
-                if( s > line )
-                    have_line = true;   // accept ragged final line with no "\n"
-            }
-            else
-            {
 
-                // move the incomplete line to the start of buffer and refill
-                fposn_base += (line-buf);
-                const char *src = line;
-                char *dst = buf;
-                int count = s-line;
-                req = BUFSIZE-count;
-                for( int i=0; i<count; i++ )
-                    *dst++ = *src++;
-                len = fread(buf+count,1,req,pgn_file);
-                nomore = (len!=req);
-                s = buf;
-                end = buf + count + (len>=0?len:0);
-            }    
-        }
-        if( have_line )
-        {
-            char *make_c_str = (char *)s;
-            char save = *make_c_str;
-            *make_c_str = '\0';
-            LoadLine( gd, fposn_base +(line-buf), line );
-            *make_c_str = save;
-            if( *s=='\r' && *(s+1)=='\n' )
-                s += 2;
-            else if( *s=='\n' && *(s+1)=='\r' )     // not so likely...
-                s += 2;
-            else
-                s++;
-        }
-    }
+    // Lines come straight from the memory mapped file where possible, and
+    //  their file offsets come from pointer arithmetic
+    PgnSource source;
+    source.Open(pgn_file);
+    gd.fposn0 = source.Offset();
+    PGN_SPAN line;
+    while( source.GetLine(line) )
+        LoadLine( gd, line.offset, line.ptr, line.len );
 
     // terminate last game
-    fseek(pgn_file,0,SEEK_END);
-    long filelen = ftell(pgn_file);
+    LoadLine( gd, source.Offset(), NULL, 0 );
     fseek(pgn_file,0,SEEK_SET);
-    LoadLine( gd, filelen, NULL );
     return ok;
 }
             
-void GamesCache::LoadLine( GameDocument &gd, int fposn, const char *line )
+void GamesCache::LoadLine( GameDocument &gd, long fposn, const char *line, size_t len )
 {            
     bool end_of_game=false;
     if( !line )     // end of file ?
@@ -180,18 +123,19 @@ void GamesCache::LoadLine( GameDocument &gd, int fposn, const char *line )
     else
     {
         const char *s = line;
-        while( *s==' ' || *s=='\t' )
+        const char *end = line+len;
+        while( s<end && (*s==' ' || *s=='\t') )
             s++;
         switch( state )
         {
             case PREFIX:
             {
                 bool stay_in_prefix=true;
-                if( *s == '[' && Tagline(gd,s) )
+                if( s<end && *s=='[' && Tagline(gd,s,end) )
                     stay_in_prefix = false;
                 if( stay_in_prefix )
                 {
-                    gd.prefix_txt += s;
+                    gd.prefix_txt.append( s, end-s );
                     gd.prefix_txt += "\r\n";
                 }
                 else
@@ -208,14 +152,14 @@ void GamesCache::LoadLine( GameDocument &gd, int fposn, const char *line )
             }
             case HEADER:
             {
-                if( *s == '[' )
-                    Tagline(gd,s);
-                else if( *s )
+                if( s<end && *s=='[' )
+                    Tagline(gd,s,end);
+                else if( s < end )
                 {
                     state = INGAME;
                     gd.fposn2 = fposn;
                     gd.game_nbr = game_nbr++;
-                    gd.moves_txt = s;
+                    gd.moves_txt.assign( s, end-s );
                     LangLine( gd.moves_txt, NULL, LangGet() );  // English -> Current language
                     int len = gd.moves_txt.length();
                     if( len>=1 && gd.moves_txt[len-1] == '*' )
@@ -226,7 +170,7 @@ void GamesCache::LoadLine( GameDocument &gd, int fposn, const char *line )
             }
             case INGAME:
             {
-                if( *s == '\0' )
+                if( s == end )
                 {
                     gd.fposn3 = fposn;
                     end_of_game = true;
@@ -234,7 +178,7 @@ void GamesCache::LoadLine( GameDocument &gd, int fposn, const char *line )
                 }
                 else if( *s == '[' )
                 {
-                    if( Tagline(gd,s) )
+                    if( Tagline(gd,s,end) )
                     {
                         gd.fposn3 = fposn;
                         end_of_game = true;
@@ -258,9 +202,9 @@ void GamesCache::LoadLine( GameDocument &gd, int fposn, const char *line )
     }
 }
 
-// Check whether text s is a valid header, return true if it is,
-//  add info to a GameDocument, optionally clearing it first
-bool GamesCache::Tagline( GameDocument &gd,  const char *s )
+// Check whether text s (up to end) is a valid header, return true if
+//  it is, add info to a GameDocument, optionally clearing it first
+bool GamesCache::Tagline( GameDocument &gd,  const char *s, const char *end )
 {
     const char *tag_begin, *tag_end, *val_begin, *val_end;
     bool is_header = false;
@@ -269,13 +213,13 @@ bool GamesCache::Tagline( GameDocument &gd,  const char *s )
     s++;
 
     // Skip whitespace
-    while( *s==' ' || *s=='\t' )
+    while( s<end && (*s==' ' || *s=='\t') )
         s++;
 
     // Is there a tag before a leading " ?
     tag_begin = s;
     bool tag=false;
-    while( *s && *s!=']' && *s!=' ' && *s!='\t' && *s!='\"' )
+    while( s<end && *s && *s!=']' && *s!=' ' && *s!='\t' && *s!='\"' )
     {
         tag = true;    // at least 1 non-whitespace
         s++;
@@ -286,7 +230,7 @@ bool GamesCache::Tagline( GameDocument &gd,  const char *s )
 
         // Make sure there is whitespace, but skip it
         tag = false;
-        while( *s==' ' || *s=='\t' )
+        while( s<end && (*s==' ' || *s=='\t') )
         {
             tag = true;  // at least 1 whitespace
             s++;
@@ -294,17 +238,17 @@ bool GamesCache::Tagline( GameDocument &gd,  const char *s )
     }
 
     // If there is a tag, then whitespace, then a leading "
-    if( tag && *s=='\"')
+    if( tag && s<end && *s=='\"')
     {
         s++;
         val_begin = s;
 
         // Skip to 2nd " or end of string
-        while( *s && *s!='\"' )
+        while( s<end && *s && *s!='\"' )
             s++;
 
         // If we have a 2nd " then we have a tag and a val, i.e. a header
-        if( *s == '\"' )        
+        if( s<end && *s=='\"' )        
         {
             is_header = true;
             val_end = s;
@@ -26,7 +26,7 @@ public:
     bool Load( std::string &filename );
     bool Reload() { return Load(pgn_filename); }
     bool Load( FILE *pgn_file );
-    void LoadLine(  GameDocument &gd, int fposn, const char *line );
+    void LoadLine(  GameDocument &gd, long fposn, const char *line, size_t len );
     bool FileCreate( std::string &filename, GameDocument &gd );
     void FileSave( GamesCache *gc_clipboard );
     void FileSaveAs( std::string &filename, GamesCache *gc_clipboard );
@@ -56,9 +56,9 @@ private:     // Helpers
     bool loaded;
     int  pgn_handle;
 
-    // Check whether text s is a valid header, return true if it is,
-    //  add info to a GameDocument, optionally clearing it first
-    bool Tagline( GameDocument &gd,  const char *s );
+    // Check whether text s (up to end) is a valid header, return true if
+    //  it is, add info to a GameDocument, optionally clearing it first
+    bool Tagline( GameDocument &gd,  const char *s, const char *end );
 };
 
 #endif    // GAMES_CACHE_H
@@ -15,6 +15,8 @@
 #include "Appdefs.h"
 #include "DbPrimitives.h"
 #include "DbMaintenance.h"
+#include "Repository.h"
+#include "Objects.h"
 #include "MaintenanceDialog.h"
 
 // MaintenanceDialog type definition
@@ -31,6 +33,8 @@ EVT_BUTTON( ID_MAINTENANCE_CMD_3, MaintenanceDialog::OnMaintenanceDecompress )
 EVT_BUTTON( ID_MAINTENANCE_CMD_4, MaintenanceDialog::OnMaintenanceVerify )
 EVT_BUTTON( ID_MAINTENANCE_CMD_5, MaintenanceDialog::OnMaintenanceCreate )
 EVT_BUTTON( ID_MAINTENANCE_CMD_6, MaintenanceDialog::OnMaintenanceExtraIndexes )
+EVT_BUTTON( ID_MAINTENANCE_CMD_7, MaintenanceDialog::OnMaintenancePositionIndex )
+EVT_BUTTON( ID_MAINTENANCE_CMD_8, MaintenanceDialog::OnMaintenanceVerifyDatabase )
 
 EVT_BUTTON( wxID_HELP, MaintenanceDialog::OnHelpClick )
 EVT_FILEPICKER_CHANGED( ID_TEMP_ENGINE_PICKER, MaintenanceDialog::OnFilePicked )
@@ -111,24 +115,34 @@ void MaintenanceDialog::CreateControls()
     top_sizer->Add(box_sizer, 0, wxALIGN_CENTER_HORIZONTAL|wxALL, 5);
     
     // A friendly message
-    wxStaticText* descr = new wxStaticText( this, wxID_STATIC,
+    wxString database_file    = objs.repository->database.m_file;
+    wxString maintenance_file = objs.repository->database.m_maintenance_file;
+    db_primitive_set_database_file( maintenance_file.c_str() );
+    db_primitive_set_profile( db_primitive_profile_lookup( objs.repository->database.m_build_profile.c_str(), DB_PROFILE_INTERACTIVE_READ ) );
+    wxString msg =
            "This panel is a placeholder for a proper database management facility.\n"
            "At the moment the only functionality offered is some database\n"
            "test and rebuild functions. Be careful with these, experts only !\n"
            "For example, feedback is text output to the debug console in the\n"
            "developer IDE !\n"
-           "For now the files involved are mainly hardwired at compile time - to\n"
-           "change them, change the source code and recompile! See files\n"
-           "DbPrimitives.h and DbMaintenance.cpp.\n\n"
-           "Before rebuilding the database, manually delete the maintenance database;\n"
-            DB_MAINTENANCE_FILE "\n"
-           "Then use the append from .pgn button, for each .pgn you wish to add\n"
-           "(a file picker GUI control does let you select that .pgn, at the\n"
-           "moment avoid .pgn files with overlapping games). Then add extra indexes\n"
-           "Finally manually replace the production database;\n"
-            DB_FILE "\n"
-           "With the newly created maintenance database and restart Tarrasch.\n"
-           , wxDefaultPosition, wxDefaultSize, 0 );
+           "The files involved are set by DatabaseFile and DatabaseMaintenanceFile\n"
+           "in the Tarrasch .ini file, along with DatabaseReadProfile and\n"
+           "DatabaseBuildProfile (\"interactive read\", \"bulk build\" or \"low memory\",\n"
+           "SQLite settings) (the same functions are available without\n"
+           "the GUI, see the t3db command line program).\n\n"
+           "Before rebuilding the database, manually delete the maintenance database;\n";
+    msg += maintenance_file + "\n";
+    msg += "Then use the append from .pgn button, for each .pgn you wish to add\n"
+           "(a file picker GUI control does let you select that .pgn, games\n"
+           "already in the database are skipped). Then add extra indexes (for\n"
+           "a database built by an older version this also rebuilds the position\n"
+           "indexes, which the game list needs to page quickly)\n"
+           "and optionally build the binary position index file (faster position\n"
+           "lookups, copy it along with the database, it has an extra .idx suffix)\n"
+           "Finally manually replace the production database;\n";
+    msg += database_file + "\n";
+    msg += "With the newly created maintenance database and restart Tarrasch.\n";
+    wxStaticText* descr = new wxStaticText( this, wxID_STATIC, msg, wxDefaultPosition, wxDefaultSize, 0 );
     box_sizer->Add(descr, 0, wxALIGN_LEFT|wxALL, 5);
     
     // Spacer
@@ -140,8 +154,7 @@ void MaintenanceDialog::CreateControls()
     box_sizer->Add(file_label, 0, wxALIGN_LEFT|wxALL, 5);
     
     // File picker control
-    wxString   database_file = DB_MAINTENANCE_FILE;
-    wxFileName fn( database_file );
+    wxFileName fn( maintenance_file );
     wxString directory = fn.GetPath();
     wxFileName fn2( directory, "example.pgn" );
     pgn_filename = fn2.GetFullPath();
@@ -279,7 +292,7 @@ void MaintenanceDialog::CreateControls()
     wxButton* button_cmd_3 = new wxButton( this, ID_MAINTENANCE_CMD_3, wxT("&Test decompress file .qgn -> .pgn"),
                                           wxDefaultPosition, wxDefaultSize, 0 );
     db_vert->Add( button_cmd_3, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
-    wxButton* button_cmd_4 = new wxButton( this, ID_MAINTENANCE_CMD_4, wxT("&Test move compression algorithm"),
+    wxButton* button_cmd_4 = new wxButton( this, ID_MAINTENANCE_CMD_4, wxT("&Verify move compression, .pgn"),
                                           wxDefaultPosition, wxDefaultSize, 0 );
     db_vert->Add( button_cmd_4, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
     wxButton* button_cmd_5 = new wxButton( this, ID_MAINTENANCE_CMD_5, wxT("&DANGER append to database from .pgn"),
@@ -288,6 +301,12 @@ void MaintenanceDialog::CreateControls()
     wxButton* button_cmd_6 = new wxButton( this, ID_MAINTENANCE_CMD_6, wxT("&DANGER database add extra indexes"),
                                           wxDefaultPosition, wxDefaultSize, 0 );
     db_vert->Add( button_cmd_6, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
+    wxButton* button_cmd_7 = new wxButton( this, ID_MAINTENANCE_CMD_7, wxT("&Build binary position index file"),
+                                          wxDefaultPosition, wxDefaultSize, 0 );
+    db_vert->Add( button_cmd_7, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
+    wxButton* button_cmd_8 = new wxButton( this, ID_MAINTENANCE_CMD_8, wxT("V&erify move compression, database"),
+                                          wxDefaultPosition, wxDefaultSize, 0 );
+    db_vert->Add( button_cmd_8, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
     
     
     // A dividing line before the OK and Cancel buttons
@@ -396,19 +415,25 @@ void MaintenanceDialog::OnMaintenanceSpeed( wxCommandEvent& WXUNUSED(event) )
 // wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_2
 void MaintenanceDialog::OnMaintenanceCompress( wxCommandEvent& WXUNUSED(event) )
 {
-    db_maintenance_compress_pgn();
+    wxFileName qgn( pgn_filename );
+    qgn.SetExt( "qgn" );
+    db_maintenance_compress_pgn( pgn_filename.c_str(), qgn.GetFullPath().c_str() );
 }
 
 // wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_3
 void MaintenanceDialog::OnMaintenanceDecompress( wxCommandEvent& WXUNUSED(event) )
 {
-    db_maintenance_decompress_pgn();
+    wxFileName qgn( pgn_filename );
+    qgn.SetExt( "qgn" );
+    wxFileName out( pgn_filename );
+    out.SetName( out.GetName() + "-decompressed" );
+    db_maintenance_decompress_pgn( qgn.GetFullPath().c_str(), out.GetFullPath().c_str() );
 }
 
 // wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_4
 void MaintenanceDialog::OnMaintenanceVerify( wxCommandEvent& WXUNUSED(event) )
 {
-    db_maintenance_verify_compression();
+    db_maintenance_verify_compression_pgn( pgn_filename.c_str() );
 }
 
 // wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_5
@@ -423,6 +448,18 @@ void MaintenanceDialog::OnMaintenanceExtraIndexes( wxCommandEvent& WXUNUSED(even
     db_maintenance_create_extra_indexes();
 }
 
+// wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_7
+void MaintenanceDialog::OnMaintenancePositionIndex( wxCommandEvent& WXUNUSED(event) )
+{
+    db_maintenance_create_position_index();
+}
+
+// wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_8
+void MaintenanceDialog::OnMaintenanceVerifyDatabase( wxCommandEvent& WXUNUSED(event) )
+{
+    db_maintenance_verify_compression_database();
+}
+
 
 
 
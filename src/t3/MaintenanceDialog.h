@@ -35,7 +35,8 @@ enum
     ID_TEMP_CUSTOM3A        = 10016,
     ID_TEMP_CUSTOM3B        = 10017,
     ID_TEMP_CUSTOM4A        = 10018,
-    ID_TEMP_CUSTOM4B        = 10019
+    ID_TEMP_CUSTOM4B        = 10019,
+    ID_MAINTENANCE_CMD_8    = 10020
 };
 
 // MaintenanceDialog class declaration
@@ -103,6 +104,12 @@ public:
     // wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_6
     void OnMaintenanceExtraIndexes( wxCommandEvent& event );
     
+    // wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_7
+    void OnMaintenancePositionIndex( wxCommandEvent& event );
+    
+    // wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_MAINTENANCE_CMD_8
+    void OnMaintenanceVerifyDatabase( wxCommandEvent& event );
+    
     // wxEVT_COMMAND_BUTTON_CLICKED event handler for wxID_HELP
     void OnHelpClick( wxCommandEvent& event );
     
@@ -19,9 +19,14 @@ using namespace thc;
 #define nbrof(array) ( sizeof(array) / sizeof((array)[0]) )
 
 // Constructor
-PgnRead::PgnRead( char callback_code )
+PgnRead::PgnRead( char callback_code, void *callback_context )
 {
     this->callback_code = callback_code;
+    this->callback_context = callback_context;
+    source  = NULL;
+    mem_ptr = NULL;
+    mem_end = NULL;
+    nag_value = 0;
     round   [0] = '\0';
     white_elo[0] = '\0';
     black_elo[0] = '\0';
@@ -129,19 +134,48 @@ void PgnRead::debug_dump()
 }
 
 bool PgnRead::Process( FILE *infile )
+{
+    bool aborted;
+    PgnSource pgn_source;
+    pgn_source.Open(infile);
+    if( pgn_source.IsMapped() )
+        aborted = Process( pgn_source.MappedData(), pgn_source.MappedLength() );
+    else
+    {
+        source  = &pgn_source;
+        mem_ptr = NULL;
+        mem_end = NULL;
+        aborted = ProcessInner();
+        source  = NULL;
+    }
+    FileOver();
+    return aborted;
+}
+
+// No FileOver() report, a chunk is typically one of many from a larger file
+bool PgnRead::Process( const char *buf, size_t len )
+{
+    source  = NULL;
+    mem_ptr = buf;
+    mem_end = buf+len;
+    bool aborted = ProcessInner();
+    mem_ptr = NULL;
+    mem_end = NULL;
+    return aborted;
+}
+
+bool PgnRead::ProcessInner()
 {
     bool aborted = false;
     char buf[FIELD_BUFLEN+10];
-    static char comment_buf[10000];
     int ch, comment_ch=0, previous_ch=0, push_back=0, len=0, move_number=0;
     STATE state=INIT, old_state, save_state=INIT;
-    static int nag_value;
     //fseek(infile,0,SEEK_END);
     //unsigned long file_len=ftell(infile);
     //rewind(infile);
 
     // Loop through characters
-    ch = fgetc(infile);
+    ch = GetCh();
     //int old_percent = -1;
     //unsigned char modulo_256=0;
     while( ch != EOF )
@@ -526,7 +560,7 @@ bool PgnRead::Process( FILE *infile )
         else
         {
             do {
-                ch = fgetc(infile);
+                ch = GetCh();
             } while ( ch == '\r' );
             if( ch==EOF &&  (
                                 state==MOVE_NUMBER ||
@@ -541,7 +575,6 @@ bool PgnRead::Process( FILE *infile )
                 GameOver();
         }
     }
-    FileOver();
     return aborted;
 }
 
@@ -685,7 +718,7 @@ void PgnRead::GameOver()
     STACK_ELEMENT *s;
     s = &stack_array[0];
     if( !fen_flag )
-        hook_gameover( callback_code, event, site, date, round, white, black, result, white_elo, black_elo, eco, s->nbr_moves, s->big_move_array, s->big_hash_array  );
+        hook_gameover( callback_code, callback_context, event, site, date, round, white, black, result, white_elo, black_elo, eco, s->nbr_moves, s->big_move_array, s->big_hash_array  );
     //printf( "GameOver()\n" );
     stack_idx = 0;
     ChessRules temp;
@@ -7,13 +7,14 @@
 #ifndef PGN_READ_H
 #define PGN_READ_H
 #include "thc.h"
+#include "PgnSource.h"
 #include <vector>
 #include <algorithm>
 
 #define FIELD_BUFLEN 200
 
 // Callback
-void hook_gameover( char callback_code, const char *event, const char *site, const char *date, const char *round,
+void hook_gameover( char callback_code, void *callback_context, const char *event, const char *site, const char *date, const char *round,
                    const char *white, const char *black, const char *result, const char *white_elo, const char *black_elo, const char *eco,
                    int nbr_moves, thc::Move *moves, uint64_t *hashes );
 
@@ -23,12 +24,29 @@ class PgnRead
 public:
 
     // Constructor
-    PgnRead( char callback_code );
+    PgnRead( char callback_code, void *callback_context=NULL );
 
+    // Read a whole .pgn file
     bool Process( FILE *infile );
 
+    // Read a chunk of .pgn text already in memory (comprising whole games)
+    bool Process( const char *buf, size_t len );
+
 private:
     char callback_code;
+    void *callback_context;
+
+    // Source of characters, either a (non mappable) file or a memory buffer
+    PgnSource *source;
+    const char *mem_ptr;
+    const char *mem_end;
+    inline int GetCh()
+    {
+        if( source )
+            return source->GetCh();
+        return mem_ptr<mem_end ? (unsigned char)*mem_ptr++ : EOF;
+    }
+    bool ProcessInner();
 
     // PGN parsing stuff, still old school
     char fen    [ FIELD_BUFLEN + 10];
@@ -50,6 +68,8 @@ private:
     char move_order_type[FIELD_BUFLEN + 10];
 
     // Misc
+    char comment_buf[10000];
+    int nag_value;
     bool fen_flag;
     int nbr_games;
     FILE *debug_log_file_txt;
@@ -0,0 +1,230 @@
+/****************************************************************************
+ *  Memory mapped (zero copy) source of .pgn text, with a fallback to
+ *  buffered reads for pipes and other files that can't be mapped
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "PgnSource.h"
+#ifdef THC_WINDOWS
+#include <io.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#define READ_SIZE 65536     // buffered reads only
+
+PgnSource::PgnSource()
+{
+    file = NULL;
+    map_addr = NULL;
+    map_len = 0;
+#ifdef THC_WINDOWS
+    map_handle = NULL;
+#endif
+    data = NULL;
+    data_len = 0;
+    data_offset = 0;
+    pos = 0;
+    anchor = 0;
+    eof = true;
+    moves_seen = false;
+    in_comment = false;
+}
+
+PgnSource::~PgnSource()
+{
+    Close();
+}
+
+bool PgnSource::Open( FILE *file )
+{
+    Close();
+    this->file = file;
+    long start = ftell(file);   // -1 for pipes
+#ifdef THC_WINDOWS
+    HANDLE fh = (HANDLE)_get_osfhandle( _fileno(file) );
+    LARGE_INTEGER size;
+    if( start>=0 && fh!=INVALID_HANDLE_VALUE && GetFileType(fh)==FILE_TYPE_DISK &&
+        GetFileSizeEx(fh,&size) && size.QuadPart>start && (unsigned long long)size.QuadPart<=(size_t)-1 )
+    {
+        map_handle = CreateFileMapping( fh, NULL, PAGE_READONLY, 0, 0, NULL );
+        if( map_handle )
+        {
+            map_addr = MapViewOfFile( map_handle, FILE_MAP_READ, 0, 0, 0 );
+            if( map_addr )
+                map_len = (size_t)size.QuadPart;
+            else
+            {
+                CloseHandle(map_handle);
+                map_handle = NULL;
+            }
+        }
+    }
+#else
+    int fd = fileno(file);
+    struct stat st;
+    if( start>=0 && fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>start && (unsigned long long)st.st_size<=(size_t)-1 )
+    {
+        void *addr = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( addr != MAP_FAILED )
+        {
+            map_addr = addr;
+            map_len = (size_t)st.st_size;
+            madvise( addr, map_len, MADV_SEQUENTIAL );
+        }
+    }
+#endif
+    if( map_addr )
+    {
+        data = (const char *)map_addr + start;
+        data_len = map_len - start;
+        data_offset = start;
+        eof = true;
+    }
+    else
+    {
+        data = NULL;
+        data_len = 0;
+        data_offset = (start>0 ? start : 0);
+        eof = false;
+    }
+    pos = 0;
+    anchor = 0;
+    moves_seen = false;
+    in_comment = false;
+    return !ferror(file);
+}
+
+void PgnSource::Close()
+{
+    if( map_addr )
+    {
+#ifdef THC_WINDOWS
+        UnmapViewOfFile( map_addr );
+        CloseHandle( map_handle );
+        map_handle = NULL;
+#else
+        munmap( map_addr, map_len );
+#endif
+        map_addr = NULL;
+        map_len = 0;
+    }
+    std::vector<char> empty;
+    buf.swap(empty);
+    file = NULL;
+    data = NULL;
+    data_len = 0;
+    data_offset = 0;
+    pos = 0;
+    anchor = 0;
+    eof = true;
+}
+
+// Buffered reads only, discard data before anchor and read some more,
+//  return false if there is no more
+bool PgnSource::Refill()
+{
+    if( eof )
+        return false;
+    size_t keep = data_len - anchor;
+    if( anchor > 0 )
+        memmove( &buf[0], &buf[anchor], keep );
+    data_offset += (long)anchor;
+    pos -= anchor;
+    anchor = 0;
+    if( buf.size() < keep+READ_SIZE )
+        buf.resize( keep+READ_SIZE );
+    size_t nbr = fread( &buf[keep], 1, buf.size()-keep, file );
+    data = &buf[0];
+    data_len = keep + nbr;
+    if( nbr == 0 )
+        eof = true;
+    return nbr > 0;
+}
+
+// Advance pos past the next line, return the line, excluding its terminator
+bool PgnSource::NextLine( size_t &line_begin, size_t &line_end )
+{
+    size_t scan = pos;
+    for(;;)
+    {
+        while( scan<data_len && data[scan]!='\n' && data[scan]!='\r' )
+            scan++;
+
+        // Need to see the character after the terminator, in case it's "\r\n" or "\n\r"
+        bool found = (scan < data_len);
+        if( eof || (found && scan+1<data_len) )
+            break;
+        long old_offset = data_offset;
+        Refill();
+        scan -= (size_t)(data_offset-old_offset);
+    }
+    if( pos >= data_len )
+        return false;
+    line_begin = pos;
+    line_end = scan;
+    if( scan < data_len )
+    {
+        char c = data[scan++];
+        if( scan<data_len && ((c=='\r' && data[scan]=='\n') || (c=='\n' && data[scan]=='\r')) )
+            scan++;
+    }
+    pos = scan;
+    return true;
+}
+
+bool PgnSource::GetLine( PGN_SPAN &line )
+{
+    size_t line_begin, line_end;
+    anchor = pos;
+    if( !NextLine(line_begin,line_end) )
+        return false;
+    line.ptr    = data + line_begin;
+    line.len    = line_end - line_begin;
+    line.offset = data_offset + (long)line_begin;
+    return true;
+}
+
+bool PgnSource::GetGames( PGN_SPAN &span, size_t min_len )
+{
+    size_t line_begin, line_end;
+    anchor = pos;
+    while( NextLine(line_begin,line_end) )
+    {
+        const char *s = data + line_begin;
+        if( line_end>line_begin && *s=='[' && !in_comment )
+        {
+            if( moves_seen && line_begin>anchor && line_begin-anchor>=min_len )
+            {
+                pos = line_begin;   // tag line starts the next span
+                break;
+            }
+            moves_seen = false;
+        }
+        else
+        {
+            for( const char *t=s; t<data+line_end; t++ )
+            {
+                if( *t == '{' )
+                    in_comment = true;
+                else if( *t == '}' )
+                    in_comment = false;
+                else if( !isspace((unsigned char)*t) )
+                    moves_seen = true;
+            }
+        }
+    }
+    if( pos == anchor )
+        return false;
+    span.ptr    = data + anchor;
+    span.len    = pos - anchor;
+    span.offset = data_offset + (long)anchor;
+    return true;
+}
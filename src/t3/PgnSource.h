@@ -0,0 +1,87 @@
+/****************************************************************************
+ *  Memory mapped (zero copy) source of .pgn text, with a fallback to
+ *  buffered reads for pipes and other files that can't be mapped
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef PGN_SOURCE_H
+#define PGN_SOURCE_H
+#include <stdio.h>
+#include <vector>
+#include "Portability.h"
+
+// A span of text, not '\0' terminated, and its offset in the file
+struct PGN_SPAN
+{
+    const char *ptr;
+    size_t      len;
+    long        offset;
+};
+
+class PgnSource
+{
+public:
+    PgnSource();
+    ~PgnSource();
+
+    // Read from the current position of file. Returns false only if the file
+    //  can't be read at all. The file must stay open until Close()
+    bool Open( FILE *file );
+    void Close();
+
+    // If mapped, all spans stay valid until Close(), otherwise a span is only
+    //  valid until the next call to GetLine(), GetGames() or GetCh()
+    bool IsMapped() { return map_addr!=NULL; }
+
+    // If mapped, the whole of the text
+    const char *MappedData()    { return data; }
+    size_t      MappedLength()  { return data_len; }
+
+    // Next line, without its terminator ("\n", "\r\n", "\n\r" or "\r"),
+    //  returns false at end of file
+    bool GetLine( PGN_SPAN &line );
+
+    // Next span of whole games, at least min_len long unless it's the
+    //  last span, returns false at end of file
+    bool GetGames( PGN_SPAN &span, size_t min_len );
+
+    // Next character, or EOF
+    inline int GetCh()
+    {
+        if( pos < data_len )
+            return (unsigned char)data[pos++];
+        anchor = pos;
+        if( !Refill() )
+            return EOF;
+        return (unsigned char)data[pos++];
+    }
+
+    // Offset in file of the next character
+    long Offset() { return data_offset + (long)pos; }
+
+private:
+    bool Refill();
+    bool NextLine( size_t &line_begin, size_t &line_end );
+
+    FILE *file;
+    void *map_addr;
+    size_t map_len;
+#ifdef THC_WINDOWS
+    HANDLE map_handle;
+#endif
+    std::vector<char> buf;  // buffered reads only
+    const char *data;       // the text that is currently available
+    size_t data_len;
+    long   data_offset;     // file offset of data[0]
+    size_t pos;             // next character in data
+    size_t anchor;          // Refill() must preserve data[anchor] onwards
+    bool   eof;             // data includes the last of the file
+
+    // GetGames() state, splits at a tag line that follows some movetext
+    //  (a tag line inside a multi-line comment doesn't count)
+    bool moves_seen;
+    bool in_comment;
+};
+
+#endif // PGN_SOURCE_H
@@ -0,0 +1,477 @@
+/****************************************************************************
+ *  Binary position index file kept alongside the database, a memory mapped
+ *  sorted array of 64 bit position hashes each with a compressed list of
+ *  the games that reach the position
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "thc.h"
+#include "CompressMoves.h"
+#include "ExternalSort.h"
+#include "PositionIndex.h"
+#ifndef THC_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#define NBR_FANOUT ((1<<POSITION_INDEX_FANOUT_BITS)+1)
+#define HASH_LO_MASK 0x0000ffffffffffffULL
+#define REF_LIST     0x80000000U
+
+// Little endian fields and varints in the entries and posting lists
+static inline uint32_t get32( const unsigned char *p )
+{
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static inline uint64_t get48( const unsigned char *p )
+{
+    return get32(p) | ((uint64_t)p[4]<<32) | ((uint64_t)p[5]<<40);
+}
+
+static inline void put_le( std::vector<unsigned char> &buf, uint64_t val, int nbr_bytes )
+{
+    for( int i=0; i<nbr_bytes; i++ )
+    {
+        buf.push_back( (unsigned char)(val&0xff) );
+        val >>= 8;
+    }
+}
+
+static inline uint32_t get_varint( const unsigned char *&p )
+{
+    uint32_t val = 0;
+    for( int shift=0; ; shift+=7 )
+    {
+        unsigned char c = *p++;
+        val |= (uint32_t)(c&0x7f) << shift;
+        if( (c&0x80) == 0 )
+            break;
+    }
+    return val;
+}
+
+static inline void put_varint( std::vector<unsigned char> &buf, uint32_t val )
+{
+    while( val >= 0x80 )
+    {
+        buf.push_back( (unsigned char)(val|0x80) );
+        val >>= 7;
+    }
+    buf.push_back( (unsigned char)val );
+}
+
+// Decode a block of nbr game ids starting with first_game_id
+static void decode_block( const unsigned char *p, int first_game_id, int nbr, int *game_ids )
+{
+    int bits = *p++;
+    uint32_t mask = bits>=32 ? 0xffffffff : ((1U<<bits)-1);
+    uint64_t acc = 0;
+    int nbr_bits = 0;
+    int game_id = first_game_id;
+    game_ids[0] = game_id;
+    for( int i=1; i<nbr; i++ )
+    {
+        while( nbr_bits < bits )
+        {
+            acc |= (uint64_t)(*p++) << nbr_bits;
+            nbr_bits += 8;
+        }
+        game_id += (int)(acc&mask) + 1;
+        acc >>= bits;
+        nbr_bits -= bits;
+        game_ids[i] = game_id;
+    }
+}
+
+static void encode_block( const int *game_ids, int nbr, std::vector<unsigned char> &buf )
+{
+    uint32_t max_gap = 0;
+    for( int i=1; i<nbr; i++ )
+    {
+        uint32_t gap = game_ids[i] - game_ids[i-1] - 1;
+        if( gap > max_gap )
+            max_gap = gap;
+    }
+    int bits = 0;
+    while( bits<32 && (max_gap>>bits) != 0 )
+        bits++;
+    buf.push_back( (unsigned char)bits );
+    uint64_t acc = 0;
+    int nbr_bits = 0;
+    for( int i=1; i<nbr; i++ )
+    {
+        acc |= (uint64_t)(uint32_t)(game_ids[i] - game_ids[i-1] - 1) << nbr_bits;
+        nbr_bits += bits;
+        while( nbr_bits >= 8 )
+        {
+            buf.push_back( (unsigned char)(acc&0xff) );
+            acc >>= 8;
+            nbr_bits -= 8;
+        }
+    }
+    if( nbr_bits > 0 )
+        buf.push_back( (unsigned char)(acc&0xff) );
+}
+
+PositionIndex::PositionIndex()
+{
+    map_addr = NULL;
+    map_len = 0;
+#ifdef THC_WINDOWS
+    file_handle = INVALID_HANDLE_VALUE;
+    map_handle = NULL;
+#endif
+    header = NULL;
+    fanout = NULL;
+    entries = NULL;
+    data = NULL;
+}
+
+PositionIndex::~PositionIndex()
+{
+    Close();
+}
+
+bool PositionIndex::Open( const char *filename )
+{
+    Close();
+#ifdef THC_WINDOWS
+    file_handle = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    if( file_handle == INVALID_HANDLE_VALUE )
+        return false;
+    LARGE_INTEGER size;
+    if( GetFileSizeEx(file_handle,&size) && size.QuadPart>=(LONGLONG)sizeof(POSITION_INDEX_HEADER) &&
+        (unsigned long long)size.QuadPart<=(size_t)-1 )
+    {
+        map_handle = CreateFileMapping( file_handle, NULL, PAGE_READONLY, 0, 0, NULL );
+        if( map_handle )
+        {
+            map_addr = MapViewOfFile( map_handle, FILE_MAP_READ, 0, 0, 0 );
+            if( map_addr )
+                map_len = (size_t)size.QuadPart;
+        }
+    }
+    if( !map_addr )
+    {
+        Close();
+        return false;
+    }
+#else
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 )
+        return false;
+    struct stat st;
+    if( fstat(fd,&st)==0 && st.st_size>=(off_t)sizeof(POSITION_INDEX_HEADER) && (unsigned long long)st.st_size<=(size_t)-1 )
+    {
+        void *addr = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+        if( addr != MAP_FAILED )
+        {
+            map_addr = addr;
+            map_len = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+    if( !map_addr )
+        return false;
+#endif
+
+    // Validate
+    header = (const POSITION_INDEX_HEADER *)map_addr;
+    uint64_t expected = sizeof(POSITION_INDEX_HEADER) + NBR_FANOUT*sizeof(uint64_t) + header->nbr_hashes*HASH_ENTRY_SIZE + header->data_len;
+    if( 0 != memcmp(header->magic,POSITION_INDEX_MAGIC,8) || header->version!=POSITION_INDEX_VERSION ||
+        header->fanout_bits!=POSITION_INDEX_FANOUT_BITS || expected!=map_len )
+    {
+        printf( "Position index %s is invalid\n", filename );
+        Close();
+        return false;
+    }
+    fanout  = (const uint64_t *)(header+1);
+    entries = (const unsigned char *)(fanout + NBR_FANOUT);
+    data    = entries + header->nbr_hashes*HASH_ENTRY_SIZE;
+    return true;
+}
+
+void PositionIndex::Close()
+{
+    if( map_addr )
+    {
+#ifdef THC_WINDOWS
+        UnmapViewOfFile( map_addr );
+#else
+        munmap( map_addr, map_len );
+#endif
+    }
+#ifdef THC_WINDOWS
+    if( map_handle )
+        CloseHandle( map_handle );
+    if( file_handle != INVALID_HANDLE_VALUE )
+        CloseHandle( file_handle );
+    map_handle = NULL;
+    file_handle = INVALID_HANDLE_VALUE;
+#endif
+    map_addr = NULL;
+    map_len = 0;
+    header = NULL;
+    fanout = NULL;
+    entries = NULL;
+    data = NULL;
+}
+
+int PositionIndex::Lookup( uint64_t hash, POSTING_LIST &list )
+{
+    memset( &list, 0, sizeof(list) );
+    if( !map_addr )
+        return 0;
+
+    // Binary search the entries with the same top bits
+    uint64_t top = hash >> (64-POSITION_INDEX_FANOUT_BITS);
+    uint64_t target = hash & HASH_LO_MASK;
+    uint64_t lo = fanout[top];
+    uint64_t hi = fanout[top+1];
+    while( lo < hi )
+    {
+        uint64_t mid = lo + (hi-lo)/2;
+        if( get48(entries+mid*HASH_ENTRY_SIZE) < target )
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    if( lo>=fanout[top+1] || get48(entries+lo*HASH_ENTRY_SIZE)!=target )
+        return 0;
+    uint32_t ref = get32( entries + lo*HASH_ENTRY_SIZE + 6 );
+    if( (ref&REF_LIST) == 0 )
+    {
+        list.count = 1;
+        list.first_game_id = (int)ref;
+        return 1;
+    }
+
+    // Posting list header
+    const unsigned char *p = data + (ref&~REF_LIST);
+    list.count = (int)get_varint(p);
+    int nbr_blocks = (list.count+POSITION_INDEX_BLOCK_SIZE-1) / POSITION_INDEX_BLOCK_SIZE;
+    if( nbr_blocks > 1 )
+    {
+        list.skip_table = p;
+        list.blocks = p + nbr_blocks*8;
+    }
+    else
+    {
+        list.first_game_id = (int)get_varint(p);
+        list.blocks = p;
+    }
+    return list.count;
+}
+
+void PositionIndex::GameIds( const POSTING_LIST &list, int first, int nbr, std::vector<int> &game_ids )
+{
+    if( first < 0 )
+    {
+        nbr += first;
+        first = 0;
+    }
+    if( first+nbr > list.count )
+        nbr = list.count - first;
+    if( nbr <= 0 )
+        return;
+    if( !list.blocks )
+    {
+        game_ids.push_back( list.first_game_id );
+        return;
+    }
+    int buf[POSITION_INDEX_BLOCK_SIZE];
+    int last = first+nbr-1;
+    for( int block=first/POSITION_INDEX_BLOCK_SIZE; block<=last/POSITION_INDEX_BLOCK_SIZE; block++ )
+    {
+        int base = block*POSITION_INDEX_BLOCK_SIZE;
+        int len = list.count-base < POSITION_INDEX_BLOCK_SIZE ? list.count-base : POSITION_INDEX_BLOCK_SIZE;
+        if( list.skip_table )
+        {
+            const unsigned char *skip = list.skip_table + block*8;
+            decode_block( list.blocks+get32(skip+4), (int)get32(skip), len, buf );
+        }
+        else
+            decode_block( list.blocks, list.first_game_id, len, buf );
+        int from = first>base ? first-base : 0;
+        int to   = last<base+len-1 ? last-base : len-1;
+        game_ids.insert( game_ids.end(), buf+from, buf+to+1 );
+    }
+}
+
+PositionIndexBuilder::PositionIndexBuilder( const char *filename, size_t memory_budget )
+{
+    this->filename = filename;
+    sorter = new ExternalSort( memory_budget, filename );
+}
+
+PositionIndexBuilder::~PositionIndexBuilder()
+{
+    delete sorter;
+}
+
+// Replay the game, one record for each position reached
+void PositionIndexBuilder::AddGame( int game_id, const char *blob, int blob_len )
+{
+    CompressMoves press;
+    uint64_t hash = press.cr.Hash64Calculate();
+    for( int nbr=0; nbr<blob_len; )
+    {
+        thc::ChessPosition cr = press.cr;
+        thc::Move mv;
+        int nbr_used = press.decompress_move( blob, mv );
+        if( nbr_used == 0 )
+            break;
+        blob += nbr_used;
+        nbr += nbr_used;
+        hash = cr.Hash64Update( hash, mv );
+        sorter->Add( hash, game_id );
+    }
+}
+
+// Write a position's entry, and its posting list if more than one game
+bool PositionIndexBuilder::WriteEntry( FILE *f, FILE *dat, uint64_t hash, const std::vector<int> &game_ids, uint64_t &data_len )
+{
+    std::vector<unsigned char> buf;
+    put_le( buf, hash&HASH_LO_MASK, 6 );
+    if( game_ids.size() == 1 )
+    {
+        put_le( buf, (uint32_t)game_ids[0], 4 );
+        return 1 == fwrite( &buf[0], HASH_ENTRY_SIZE, 1, f );
+    }
+    if( data_len >= REF_LIST )
+    {
+        printf( "Position index too large\n" );
+        return false;
+    }
+    put_le( buf, REF_LIST|(uint32_t)data_len, 4 );
+    if( 1 != fwrite( &buf[0], HASH_ENTRY_SIZE, 1, f ) )
+        return false;
+
+    // Posting list
+    buf.clear();
+    int count = (int)game_ids.size();
+    put_varint( buf, count );
+    int nbr_blocks = (count+POSITION_INDEX_BLOCK_SIZE-1) / POSITION_INDEX_BLOCK_SIZE;
+    if( nbr_blocks == 1 )
+    {
+        put_varint( buf, game_ids[0] );
+        encode_block( &game_ids[0], count, buf );
+    }
+    else
+    {
+        std::vector<unsigned char> blocks;
+        for( int base=0; base<count; base+=POSITION_INDEX_BLOCK_SIZE )
+        {
+            put_le( buf, (uint32_t)game_ids[base], 4 );
+            put_le( buf, (uint32_t)blocks.size(), 4 );
+            int len = count-base < POSITION_INDEX_BLOCK_SIZE ? count-base : POSITION_INDEX_BLOCK_SIZE;
+            encode_block( &game_ids[base], len, blocks );
+        }
+        buf.insert( buf.end(), blocks.begin(), blocks.end() );
+    }
+    data_len += buf.size();
+    return buf.size() == fwrite( &buf[0], 1, buf.size(), dat );
+}
+
+// Write the sorted records to a temporary file, then replace the index file
+bool PositionIndexBuilder::Finish( int64_t max_rowid )
+{
+    std::string tmp_filename = filename + ".tmp";
+    std::string dat_filename = filename + ".dat.tmp";
+    FILE *f   = fopen( tmp_filename.c_str(), "w+b" );
+    FILE *dat = fopen( dat_filename.c_str(), "w+b" );
+    if( !f || !dat )
+    {
+        printf( "Cannot open %s\n", !f ? tmp_filename.c_str() : dat_filename.c_str() );
+        if( f )
+            fclose(f);
+        if( dat )
+            fclose(dat);
+        return false;
+    }
+
+    // Leave room for the header and fanout table, write the entries after them
+    //  and the posting lists to a second file for now
+    POSITION_INDEX_HEADER header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, POSITION_INDEX_MAGIC, 8 );
+    header.version     = POSITION_INDEX_VERSION;
+    header.fanout_bits = POSITION_INDEX_FANOUT_BITS;
+    header.max_rowid   = max_rowid;
+    std::vector<uint64_t> fanout( NBR_FANOUT, 0 );
+    fseek( f, sizeof(header) + NBR_FANOUT*sizeof(uint64_t), SEEK_SET );
+    bool ok = true;
+    uint64_t nbr = 0;
+    uint64_t nbr_hashes = 0;
+    uint64_t data_len = 0;
+    std::vector<int> game_ids;
+    SORT_RECORD rec;
+    uint64_t hash = 0;
+    for(;;)
+    {
+        bool more = sorter->Next(rec);
+        if( game_ids.size()>0 && (!more || rec.key!=hash) )
+        {
+            if( ok )
+                ok = WriteEntry( f, dat, hash, game_ids, data_len );
+            fanout[ (hash>>(64-POSITION_INDEX_FANOUT_BITS)) + 1 ]++;
+            nbr_hashes++;
+            game_ids.clear();
+        }
+        if( !more )
+            break;
+        if( game_ids.size()>0 && rec.game_id==game_ids.back() )
+            continue;   // position repeated within a game
+        hash = rec.key;
+        game_ids.push_back( rec.game_id );
+        nbr++;
+    }
+    for( int i=1; i<NBR_FANOUT; i++ )
+        fanout[i] += fanout[i-1];
+    header.nbr_entries = nbr;
+    header.nbr_hashes  = nbr_hashes;
+    header.data_len    = data_len;
+
+    // Append the posting lists
+    static char buf[65536];
+    fseek( dat, 0, SEEK_SET );
+    size_t len;
+    while( ok && (len=fread(buf,1,sizeof(buf),dat)) > 0 )
+    {
+        if( len != fwrite(buf,1,len,f) )
+            ok = false;
+    }
+    fclose(dat);
+    remove( dat_filename.c_str() );
+
+    // Header and fanout last
+    fseek( f, 0, SEEK_SET );
+    if( 1!=fwrite(&header,sizeof(header),1,f) || NBR_FANOUT!=fwrite(&fanout[0],sizeof(uint64_t),NBR_FANOUT,f) )
+        ok = false;
+    if( 0 != fclose(f) )
+        ok = false;
+    if( ok )
+    {
+        remove( filename.c_str() );
+        ok = (0 == rename( tmp_filename.c_str(), filename.c_str() ));
+    }
+    if( !ok )
+    {
+        printf( "Writing %s FAILED\n", filename.c_str() );
+        remove( tmp_filename.c_str() );
+    }
+    else
+        printf( "Position index %s, %lu entries, %lu positions, %lu bytes of posting lists\n", filename.c_str(),
+                        (unsigned long)nbr, (unsigned long)nbr_hashes, (unsigned long)data_len );
+    return ok;
+}
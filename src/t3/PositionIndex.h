@@ -0,0 +1,118 @@
+/****************************************************************************
+ *  Binary position index file kept alongside the database, a memory mapped
+ *  sorted array of 64 bit position hashes each with a compressed list of
+ *  the games that reach the position
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef POSITION_INDEX_H
+#define POSITION_INDEX_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Portability.h"
+
+class ExternalSort;
+
+// The index file is the database file name with this suffix
+#define POSITION_INDEX_SUFFIX ".idx"
+
+/*
+    File layout;
+        POSITION_INDEX_HEADER
+        uint64_t fanout[(1<<fanout_bits)+1]  index of first entry with those top bits of hash
+        entries[nbr_hashes]                  sorted by hash, HASH_ENTRY_SIZE bytes each
+        data[data_len]                       posting lists of positions reached by more than one game
+
+    An entry is the low 48 bits of the hash (the top 16 are implied by the
+    fanout) then a 32 bit reference, both little endian. If the top bit of
+    the reference is clear it is the position's only game id, otherwise the
+    rest is the offset of the position's posting list in data.
+
+    A posting list is a varint count, then the game ids in ascending order in
+    blocks of POSITION_INDEX_BLOCK_SIZE. With more than one block there is a
+    skip table of (uint32 first game id, uint32 offset of block from end of
+    table) for each block, with one block the first game id is a varint. A
+    block is a bit width byte, then for each game id after the first (game id
+    - previous game id - 1) bitpacked at that width, least significant bit
+    first. So a run of consecutive game ids packs down to zero bits.
+
+    A game that reaches the same position more than once has only one entry
+ */
+#define POSITION_INDEX_MAGIC    "T3POSIDX"
+#define POSITION_INDEX_VERSION  3   // 2 = hashes include the side to move, 3 = compressed posting lists
+#define POSITION_INDEX_FANOUT_BITS 16
+#define POSITION_INDEX_BLOCK_SIZE  128
+#define HASH_ENTRY_SIZE 10
+
+struct POSITION_INDEX_HEADER
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t fanout_bits;
+    uint64_t nbr_entries;   // (position,game) pairs
+    int64_t  max_rowid;     // of the games table when built, a different value means the index is stale
+    uint64_t nbr_hashes;    // distinct positions
+    uint64_t data_len;
+    uint64_t reserved[2];
+};
+
+// The games that reach a position, from PositionIndex::Lookup(), decode them
+//  with PositionIndex::GameIds()
+struct POSTING_LIST
+{
+    int count;
+    int first_game_id;                  // if only one block
+    const unsigned char *skip_table;    // NULL if only one block
+    const unsigned char *blocks;
+};
+
+class PositionIndex
+{
+public:
+    PositionIndex();
+    ~PositionIndex();
+
+    // Returns false if the file is missing or invalid
+    bool Open( const char *filename );
+    void Close();
+    bool IsOpen()       { return map_addr!=NULL; }
+    int64_t MaxRowid()  { return header ? header->max_rowid : -1; }
+
+    // Find the games that reach a position, returns the number of games
+    int Lookup( uint64_t hash, POSTING_LIST &list );
+
+    // Decode games first ... first+nbr-1 of a position's games (ascending
+    //  order), only the blocks that hold them are decoded. Appends to game_ids
+    void GameIds( const POSTING_LIST &list, int first, int nbr, std::vector<int> &game_ids );
+
+private:
+    void *map_addr;
+    size_t map_len;
+#ifdef THC_WINDOWS
+    HANDLE file_handle;
+    HANDLE map_handle;
+#endif
+    const POSITION_INDEX_HEADER *header;
+    const uint64_t *fanout;
+    const unsigned char *entries;
+    const unsigned char *data;
+};
+
+// Builds an index file from the games in a database, feed it every game
+class PositionIndexBuilder
+{
+public:
+    PositionIndexBuilder( const char *filename, size_t memory_budget );
+    ~PositionIndexBuilder();
+    void AddGame( int game_id, const char *blob, int blob_len );
+    bool Finish( int64_t max_rowid );
+private:
+    bool WriteEntry( FILE *f, FILE *dat, uint64_t hash, const std::vector<int> &game_ids, uint64_t &data_len );
+    std::string filename;
+    ExternalSort *sorter;
+};
+
+#endif // POSITION_INDEX_H
@@ -0,0 +1,312 @@
+/****************************************************************************
+ *  Binary .qgn file, games with compressed header fields and compressed
+ *  moves, in checksummed blocks with an index of the blocks at the end
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <string.h>
+#include "Portability.h"
+#include "QgnFile.h"
+
+// The player name and elo fields can be coded as the previous game's other colour
+static const int other_colour[QGN_NBR_FIELDS] = { QGN_BLACK, QGN_BLACK_ELO, QGN_WHITE, QGN_WHITE_ELO, -1, -1, -1, -1, -1, -1 };
+
+static bool seek( FILE *file, uint64_t offset )
+{
+#ifdef THC_WINDOWS
+    return 0 == _fseeki64( file, (__int64)offset, SEEK_SET );
+#else
+    return 0 == fseeko( file, (off_t)offset, SEEK_SET );
+#endif
+}
+
+struct CRC_TABLE
+{
+    uint32_t table[256];
+    CRC_TABLE()
+    {
+        for( uint32_t i=0; i<256; i++ )
+        {
+            uint32_t c = i;
+            for( int j=0; j<8; j++ )
+                c = (c&1) ? (0xedb88320 ^ (c>>1)) : (c>>1);
+            table[i] = c;
+        }
+    }
+};
+
+uint32_t qgn_crc32( const char *buf, size_t len )
+{
+    static CRC_TABLE crc;
+    uint32_t c = 0xffffffff;
+    const unsigned char *p = (const unsigned char *)buf;
+    while( len-- )
+        c = crc.table[(c^*p++)&0xff] ^ (c>>8);
+    return c ^ 0xffffffff;
+}
+
+static void put_varint( std::string &s, uint64_t n )
+{
+    while( n >= 0x80 )
+    {
+        s += (char)(0x80 | (n&0x7f));
+        n >>= 7;
+    }
+    s += (char)n;
+}
+
+// Returns false if the varint runs past end
+static bool get_varint( const char *&p, const char *end, uint64_t &n )
+{
+    n = 0;
+    for( int shift=0; p<end && shift<64; shift+=7 )
+    {
+        unsigned char c = (unsigned char)*p++;
+        n |= ((uint64_t)(c&0x7f)) << shift;
+        if( !(c&0x80) )
+            return true;
+    }
+    return false;
+}
+
+QgnWriter::QgnWriter()
+{
+    file = NULL;
+    ok = false;
+    offset = 0;
+    nbr_games = 0;
+    block_games = 0;
+}
+
+QgnWriter::~QgnWriter()
+{
+    if( file )
+        Close();
+}
+
+bool QgnWriter::Open( const char *filename )
+{
+    file = fopen( filename, "wb" );
+    if( !file )
+        return false;
+    ok = true;
+    offset = 0;
+    nbr_games = 0;
+    block_games = 0;
+    block.clear();
+    block_offsets.clear();
+    QGN_FILE_HEADER header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, QGN_MAGIC, sizeof(header.magic) );
+    header.version = QGN_VERSION;
+    header.games_per_block = QGN_GAMES_PER_BLOCK;
+    Write( &header, sizeof(header) );
+    return ok;
+}
+
+void QgnWriter::Write( const void *buf, size_t len )
+{
+    if( len>0 && fwrite(buf,len,1,file)!=1 )
+        ok = false;
+    offset += len;
+}
+
+bool QgnWriter::AddGame( const QGN_GAME &game )
+{
+    std::string record;
+    for( int i=0; i<QGN_NBR_FIELDS; i++ )
+    {
+        const std::string &field = game.fields[i];
+        int other = other_colour[i];
+        if( block_games>0 && field==last.fields[i] )
+            record += (char)QGN_CODE_SAME;
+        else if( block_games>0 && other>=0 && field.length()>0 && field==last.fields[other] )
+            record += (char)QGN_CODE_OTHER;
+        else if( field.length() == 0 )
+            record += (char)QGN_CODE_EMPTY;
+        else
+        {
+            record += (char)QGN_CODE_TEXT;
+            put_varint( record, field.length() );
+            record += field;
+        }
+    }
+    put_varint( record, game.blob.length() );
+    record += game.blob;
+    put_varint( block, record.length() );
+    block += record;
+    last = game;
+    nbr_games++;
+    if( ++block_games == QGN_GAMES_PER_BLOCK )
+        FlushBlock();
+    return ok;
+}
+
+void QgnWriter::FlushBlock()
+{
+    if( block_games == 0 )
+        return;
+    QGN_BLOCK_HEADER bh;
+    memset( &bh, 0, sizeof(bh) );
+    bh.nbr_games = block_games;
+    bh.len = (uint32_t)block.length();
+    bh.checksum = qgn_crc32( block.c_str(), block.length() );
+    block_offsets.push_back( offset );
+    Write( &bh, sizeof(bh) );
+    Write( block.c_str(), block.length() );
+    block.clear();
+    block_games = 0;
+}
+
+bool QgnWriter::Close()
+{
+    if( !file )
+        return false;
+    FlushBlock();
+    QGN_TRAILER trailer;
+    memset( &trailer, 0, sizeof(trailer) );
+    trailer.index_offset = offset;
+    trailer.nbr_games = nbr_games;
+    trailer.nbr_blocks = (uint32_t)block_offsets.size();
+    size_t index_len = block_offsets.size() * sizeof(uint64_t);
+    if( index_len > 0 )
+    {
+        trailer.index_checksum = qgn_crc32( (const char *)&block_offsets[0], index_len );
+        Write( &block_offsets[0], index_len );
+    }
+    else
+        trailer.index_checksum = qgn_crc32( "", 0 );
+    memcpy( trailer.magic, QGN_MAGIC, sizeof(trailer.magic) );
+    Write( &trailer, sizeof(trailer) );
+    if( fclose(file) != 0 )
+        ok = false;
+    file = NULL;
+    return ok;
+}
+
+QgnReader::QgnReader()
+{
+    file = NULL;
+    memset( &header, 0, sizeof(header) );
+    memset( &trailer, 0, sizeof(trailer) );
+}
+
+QgnReader::~QgnReader()
+{
+    Close();
+}
+
+void QgnReader::Close()
+{
+    if( file )
+        fclose( file );
+    file = NULL;
+    block_offsets.clear();
+    memset( &trailer, 0, sizeof(trailer) );
+}
+
+bool QgnReader::Open( const char *filename )
+{
+    Close();
+    file = fopen( filename, "rb" );
+    if( !file )
+        return false;
+    bool ok = (1 == fread( &header, sizeof(header), 1, file )) &&
+              0 == memcmp( header.magic, QGN_MAGIC, sizeof(header.magic) ) &&
+              header.version == QGN_VERSION &&
+              header.games_per_block > 0;
+#ifdef THC_WINDOWS
+    ok = ok && 0 == _fseeki64( file, -(__int64)sizeof(trailer), SEEK_END );
+#else
+    ok = ok && 0 == fseeko( file, -(off_t)sizeof(trailer), SEEK_END );
+#endif
+    ok = ok && (1 == fread( &trailer, sizeof(trailer), 1, file )) &&
+              0 == memcmp( trailer.magic, QGN_MAGIC, sizeof(trailer.magic) ) &&
+              trailer.nbr_games <= (uint64_t)trailer.nbr_blocks * header.games_per_block;
+    if( ok )
+    {
+        block_offsets.resize( trailer.nbr_blocks );
+        size_t index_len = block_offsets.size() * sizeof(uint64_t);
+        if( index_len > 0 )
+            ok = seek( file, trailer.index_offset ) &&
+                 1 == fread( &block_offsets[0], index_len, 1, file ) &&
+                 trailer.index_checksum == qgn_crc32( (const char *)&block_offsets[0], index_len );
+    }
+    if( !ok )
+        Close();
+    return ok;
+}
+
+bool QgnReader::ReadBlock( int block_nbr, QGN_BLOCK &block )
+{
+    if( !file || block_nbr<0 || block_nbr>=NbrBlocks() )
+        return false;
+    if( !seek(file,block_offsets[block_nbr]) || 1!=fread(&block.header,sizeof(block.header),1,file) )
+        return false;
+    if( block.header.len > trailer.index_offset )
+        return false;
+    block.data.resize( block.header.len );
+    return block.header.len==0 || 1==fread( &block.data[0], block.header.len, 1, file );
+}
+
+bool QgnReader::DecodeBlock( const QGN_BLOCK &block, std::vector<QGN_GAME> &games, uint32_t max_games )
+{
+    games.clear();
+    if( block.header.len!=block.data.length() || block.header.checksum!=qgn_crc32(block.data.c_str(),block.data.length()) )
+        return false;
+    const char *p   = block.data.c_str();
+    const char *end = p + block.data.length();
+    uint32_t nbr_games = block.header.nbr_games<max_games ? block.header.nbr_games : max_games;
+    games.resize( nbr_games );
+    for( uint32_t n=0; n<nbr_games; n++ )
+    {
+        QGN_GAME &game = games[n];
+        uint64_t len;
+        if( !get_varint(p,end,len) || len>(uint64_t)(end-p) )
+            return false;
+        const char *record_end = p + len;
+        for( int i=0; i<QGN_NBR_FIELDS; i++ )
+        {
+            if( p >= record_end )
+                return false;
+            int code = *p++;
+            int other = other_colour[i];
+            if( code==QGN_CODE_SAME && n>0 )
+                game.fields[i] = games[n-1].fields[i];
+            else if( code==QGN_CODE_OTHER && n>0 && other>=0 )
+                game.fields[i] = games[n-1].fields[other];
+            else if( code == QGN_CODE_EMPTY )
+                game.fields[i].clear();
+            else if( code == QGN_CODE_TEXT )
+            {
+                if( !get_varint(p,record_end,len) || len>(uint64_t)(record_end-p) )
+                    return false;
+                game.fields[i].assign( p, (size_t)len );
+                p += len;
+            }
+            else
+                return false;
+        }
+        if( !get_varint(p,record_end,len) || len!=(uint64_t)(record_end-p) )
+            return false;
+        game.blob.assign( p, (size_t)len );
+        p += len;
+    }
+    return true;
+}
+
+bool QgnReader::ReadGame( uint64_t game_nbr, QGN_GAME &game )
+{
+    if( game_nbr >= NbrGames() )
+        return false;
+    QGN_BLOCK block;
+    std::vector<QGN_GAME> games;
+    uint32_t idx = (uint32_t)(game_nbr % header.games_per_block);
+    if( !ReadBlock( (int)(game_nbr/header.games_per_block), block ) || !DecodeBlock(block,games,idx+1) || games.size()<=idx )
+        return false;
+    game = games[idx];
+    return true;
+}
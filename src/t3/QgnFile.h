@@ -0,0 +1,147 @@
+/****************************************************************************
+ *  Binary .qgn file, games with compressed header fields and compressed
+ *  moves, in checksummed blocks with an index of the blocks at the end
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#ifndef QGN_FILE_H
+#define QGN_FILE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+    File layout;
+        QGN_FILE_HEADER
+        Blocks, each QGN_BLOCK_HEADER then len bytes of game records
+        uint64_t block_offsets[nbr_blocks]
+        QGN_TRAILER
+    A block holds up to games_per_block games (only the last block can have
+    fewer), so game N is in block N/games_per_block. Each game record is;
+        varint record length
+        for each of the QGN_NBR_FIELDS header fields, a QGN_CODE_xxx byte,
+         followed by varint length and text if the code is QGN_CODE_TEXT
+        varint blob length, then the CompressMoves bytes
+    Header fields are coded relative to the previous game in the same block,
+    so each block decodes independently. Integers are stored in the native
+    byte order, as for the position index file.
+ */
+#define QGN_MAGIC           "T3QGNBIN"
+#define QGN_VERSION         1
+#define QGN_GAMES_PER_BLOCK 1000
+
+// Header fields, in the order they are stored
+enum
+{
+    QGN_WHITE,
+    QGN_WHITE_ELO,
+    QGN_BLACK,
+    QGN_BLACK_ELO,
+    QGN_RESULT,
+    QGN_DATE,
+    QGN_EVENT,
+    QGN_SITE,
+    QGN_ROUND,
+    QGN_ECO,
+    QGN_NBR_FIELDS
+};
+
+// Header field codes
+#define QGN_CODE_SAME   0   // same as the previous game
+#define QGN_CODE_OTHER  1   // same as the previous game's other colour (player names and elos only)
+#define QGN_CODE_EMPTY  2
+#define QGN_CODE_TEXT   3   // varint length and text follow
+
+struct QGN_FILE_HEADER
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t games_per_block;
+    uint64_t reserved[2];
+};
+
+struct QGN_BLOCK_HEADER
+{
+    uint32_t nbr_games;
+    uint32_t len;
+    uint32_t checksum;      // crc32 of the len bytes that follow
+    uint32_t reserved;
+};
+
+struct QGN_TRAILER
+{
+    uint64_t index_offset;
+    uint64_t nbr_games;
+    uint32_t nbr_blocks;
+    uint32_t index_checksum;    // crc32 of block_offsets[]
+    char     magic[8];
+};
+
+struct QGN_GAME
+{
+    std::string fields[QGN_NBR_FIELDS];
+    std::string blob;   // compressed moves, any length
+};
+
+struct QGN_BLOCK
+{
+    QGN_BLOCK_HEADER header;
+    std::string data;
+};
+
+uint32_t qgn_crc32( const char *buf, size_t len );
+
+class QgnWriter
+{
+public:
+    QgnWriter();
+    ~QgnWriter();
+    bool Open( const char *filename );
+    bool AddGame( const QGN_GAME &game );
+    bool Close();   // writes the index and trailer, returns false if any write failed
+    uint64_t NbrGames() { return nbr_games; }
+private:
+    void FlushBlock();
+    void Write( const void *buf, size_t len );
+    FILE *file;
+    bool ok;
+    uint64_t offset;
+    uint64_t nbr_games;
+    std::vector<uint64_t> block_offsets;
+    std::string block;
+    uint32_t block_games;
+    QGN_GAME last;
+};
+
+class QgnReader
+{
+public:
+    QgnReader();
+    ~QgnReader();
+
+    // Returns false if the file is missing, not a binary .qgn, or the index is bad
+    bool Open( const char *filename );
+    void Close();
+    uint64_t NbrGames()     { return trailer.nbr_games; }
+    int      NbrBlocks()    { return (int)block_offsets.size(); }
+
+    // Raw block, the checksum is not tested until it is decoded (so that can
+    //  be done in parallel)
+    bool ReadBlock( int block_nbr, QGN_BLOCK &block );
+
+    // Returns false if the checksum fails or the block is malformed
+    static bool DecodeBlock( const QGN_BLOCK &block, std::vector<QGN_GAME> &games, uint32_t max_games=0xffffffff );
+
+    // One seek, then decode within the block, game_nbr counts from 0
+    bool ReadGame( uint64_t game_nbr, QGN_GAME &game );
+
+private:
+    FILE *file;
+    QGN_FILE_HEADER header;
+    QGN_TRAILER trailer;
+    std::vector<uint64_t> block_offsets;
+};
+
+#endif // QGN_FILE_H
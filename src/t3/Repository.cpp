@@ -64,6 +64,12 @@ Repository::Repository( bool use_defaults )
         config->Read("LogFile",              &log.m_file                );
         ReadBool    ("LogEnabled",            log.m_enabled             );
 
+        // Database
+        config->Read("DatabaseFile",            &database.m_file             );
+        config->Read("DatabaseMaintenanceFile", &database.m_maintenance_file );
+        config->Read("DatabaseReadProfile",     &database.m_read_profile     );
+        config->Read("DatabaseBuildProfile",    &database.m_build_profile    );
+
         // Engine
         config->Read("EngineExeFile",         &engine.m_file            );
         ReadBool    ("EnginePonder",           engine.m_ponder          );
@@ -190,6 +196,12 @@ Repository::~Repository()
     config->Write("NonVolatileCol10",                 nv.m_col10 );
     config->Write("NonVolatileDocDir",                nv.m_doc_dir );
 
+    // Database
+    config->Write("DatabaseFile",            database.m_file             );
+    config->Write("DatabaseMaintenanceFile", database.m_maintenance_file );
+    config->Write("DatabaseReadProfile",     database.m_read_profile     );
+    config->Write("DatabaseBuildProfile",    database.m_build_profile    );
+
     // Engine
     config->Write("EngineExeFile",      engine.m_file   );
     config->Write("EnginePonder",       (int)engine.m_ponder     );
@@ -8,6 +8,7 @@
 #define REPOSITORY_H
 #include "Appdefs.h"
 #include "Portability.h"
+#include "DbPrimitives.h"
 #include "wx/wx.h"
 #include "wx/utils.h"
 
@@ -120,6 +121,21 @@ struct LogConfig
     }
 };
 
+struct DatabaseConfig
+{
+    wxString    m_file;                 // used for position searches
+    wxString    m_maintenance_file;     // built by the maintenance commands
+    wxString    m_read_profile;         // SQLite pragmas for searches, see DB_PROFILE_XXX in DbPrimitives.h
+    wxString    m_build_profile;        //  and for the maintenance commands
+    DatabaseConfig()
+    {
+        m_file             = DB_FILE;
+        m_maintenance_file = DB_MAINTENANCE_FILE;
+        m_read_profile     = db_primitive_profile_name( DB_PROFILE_INTERACTIVE_READ );
+        m_build_profile    = db_primitive_profile_name( DB_PROFILE_INTERACTIVE_READ );
+    }
+};
+
 struct EngineConfig
 {
     wxString    m_file;
@@ -241,6 +257,7 @@ public:
     TrainingConfig  training;
     GeneralConfig   general;
     EngineConfig    engine;
+    DatabaseConfig  database;
     NonVolatile     nv;
 
 private:
@@ -1939,6 +1939,8 @@ uint64_t ChessPosition::Hash64Calculate()
             c = 'a';
         hash ^= hash64_lookup[i][c-'B'];
     }
+    if( !white )
+        hash ^= HASH64_BLACK_TO_MOVE;
     return hash;
 }
 
@@ -2100,6 +2102,7 @@ uint64_t ChessPosition::Hash64Update( uint64_t hash_in, Move move )
             break;
         }
     }
+    hash ^= HASH64_BLACK_TO_MOVE;     // the other side to move
     return hash;
 }
 
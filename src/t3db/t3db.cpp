@@ -0,0 +1,233 @@
+/****************************************************************************
+ *  t3db - Command line (no GUI) database maintenance for Tarrasch
+ *  Author:  Bill Forster
+ *  License: MIT license. Full text of license is in associated file LICENSE
+ *  Copyright 2010-2014, Bill Forster <billforsternz at gmail dot com>
+ ****************************************************************************/
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "thc.h"
+#include "DebugPrintf.h"
+#include "PositionIndex.h"
+#include "DbPrimitives.h"
+#include "DbMaintenance.h"
+
+static const char *usage_txt =
+"usage: t3db [options] command [files]\n"
+"options:\n"
+"  -d database      database file (default " DB_MAINTENANCE_FILE ")\n"
+"  -b megabytes     memory budget for sorting position rows, 0 = in memory buckets\n"
+"  -p profile       SQLite settings, interactive-read (default), low-memory or bulk-build\n"
+"                   (no journal or syncs, only while creating a new database)\n"
+"  -f               flag near duplicate games rather than skipping them\n"
+"  -t               machine readable timing, one JSON object per step on stderr\n"
+"commands:\n"
+"  create pgn...        create a new database from .pgn files\n"
+"  append pgn...        append .pgn files to the database\n"
+"  index                build the binary position index file (database + .idx)\n"
+"  extra-indexes        add extra indexes to the database\n"
+"  compress pgn qgn     compress a .pgn file to a .qgn file\n"
+"  decompress qgn pgn   decompress a .qgn file to a .pgn file\n"
+"  verify [pgn]         verify move compression over a .pgn file, or the database\n"
+"  speed                database speed tests\n";
+
+// Functions the GUI would otherwise provide
+int DebugPrintfInner( const char *fmt, ... )
+{
+    va_list args;
+    va_start( args, fmt );
+    int ret = vprintf( fmt, args );
+    va_end( args );
+    return ret;
+}
+
+int DebugPrintfInnerTime( const char *fmt, ... )
+{
+    time_t rawtime;
+    time( &rawtime );
+    char buf[80];
+    strftime( buf, sizeof(buf), "%H:%M:%S", localtime(&rawtime) );
+    printf( "%s: ", buf );
+    va_list args;
+    va_start( args, fmt );
+    int ret = vprintf( fmt, args );
+    va_end( args );
+    return ret;
+}
+
+int DebugPrintfInnerVoid( const char *fmt, ... )
+{
+    return 0;
+}
+
+#ifndef THC_WINDOWS
+unsigned long GetTickCount()
+{
+    return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+#endif
+
+void ReportOnProgress( bool init, int multipv, std::vector<thc::Move> &pv, int score_cp, int depth )
+{
+}
+
+// Machine readable timing
+static bool timing;
+static std::chrono::steady_clock::time_point start_time;
+
+static std::string json_str( const char *s )
+{
+    std::string out = "\"";
+    for( ; *s; s++ )
+    {
+        if( *s=='"' || *s=='\\' )
+            out += '\\';
+        if( (unsigned char)*s >= ' ' )
+            out += *s;
+    }
+    return out + "\"";
+}
+
+static void timing_begin()
+{
+    start_time = std::chrono::steady_clock::now();
+}
+
+// extra is either empty or more "name":value pairs, with a leading comma
+static void timing_end( const char *command, const char *file, const std::string &extra )
+{
+    double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start_time ).count();
+    if( timing )
+    {
+        fprintf( stderr, "{\"command\":%s,\"file\":%s,\"seconds\":%.3f%s}\n",
+                 json_str(command).c_str(), json_str(file).c_str(), elapsed, extra.c_str() );
+        fflush( stderr );
+    }
+}
+
+static std::string json_int( const char *name, long value )
+{
+    char buf[100];
+    sprintf( buf, ",\"%s\":%ld", name, value );
+    return buf;
+}
+
+static int usage()
+{
+    fprintf( stderr, "%s", usage_txt );
+    return 2;
+}
+
+int main( int argc, char *argv[] )
+{
+    int i;
+    for( i=1; i<argc && argv[i][0]=='-'; i++ )
+    {
+        if( 0==strcmp(argv[i],"-t") )
+            timing = true;
+        else if( 0==strcmp(argv[i],"-f") )
+            db_primitive_set_duplicate_mode( DUPLICATES_FLAG );
+        else if( 0==strcmp(argv[i],"-d") && i+1<argc )
+            db_primitive_set_database_file( argv[++i] );
+        else if( 0==strcmp(argv[i],"-p") && i+1<argc )
+        {
+            int profile = db_primitive_profile_lookup( argv[++i], -1 );
+            if( profile < 0 )
+                return usage();
+            db_primitive_set_profile( profile );
+        }
+        else if( 0==strcmp(argv[i],"-b") && i+1<argc )
+            db_primitive_set_sort_budget( (size_t)atol(argv[++i]) * 1024 * 1024 );
+        else
+            return usage();
+    }
+    if( i >= argc )
+        return usage();
+    const char *command = argv[i++];
+    int nbr_args = argc-i;
+    char **args = argv+i;
+    const char *db = db_primitive_get_database_file();
+    int ret = 0;
+    if( 0==strcmp(command,"create") || 0==strcmp(command,"append") )
+    {
+        if( nbr_args < 1 )
+            return usage();
+        if( 0 == strcmp(command,"create") )
+        {
+            FILE *f = fopen( db, "rb" );
+            if( f )
+            {
+                fclose(f);
+                fprintf( stderr, "%s already exists, use append\n", db );
+                return 1;
+            }
+            std::string idx = std::string(db) + POSITION_INDEX_SUFFIX;
+            remove( idx.c_str() );
+        }
+        for( int j=0; j<nbr_args; j++ )
+        {
+            timing_begin();
+            int nbr_added = db_maintenance_create_or_append_to_database( args[j] );
+            timing_end( command, args[j], json_int("games_added",nbr_added) );
+            if( nbr_added < 0 )
+                ret = 1;
+        }
+    }
+    else if( 0==strcmp(command,"index") && nbr_args==0 )
+    {
+        timing_begin();
+        db_maintenance_create_position_index();
+        timing_end( command, db, "" );
+    }
+    else if( 0==strcmp(command,"extra-indexes") && nbr_args==0 )
+    {
+        timing_begin();
+        db_maintenance_create_extra_indexes();
+        timing_end( command, db, "" );
+    }
+    else if( 0==strcmp(command,"compress") && nbr_args==2 )
+    {
+        timing_begin();
+        bool ok = db_maintenance_compress_pgn( args[0], args[1] );
+        timing_end( command, args[0], "" );
+        if( !ok )
+            ret = 1;
+    }
+    else if( 0==strcmp(command,"decompress") && nbr_args==2 )
+    {
+        timing_begin();
+        int nbr_games = db_maintenance_decompress_pgn( args[0], args[1] );
+        timing_end( command, args[0], json_int("games",nbr_games) );
+        if( nbr_games < 0 )
+            ret = 1;
+    }
+    else if( 0==strcmp(command,"verify") && nbr_args<=1 )
+    {
+        timing_begin();
+        int nbr_failures;
+        if( nbr_args == 1 )
+            nbr_failures = db_maintenance_verify_compression_pgn( args[0] );
+        else
+            nbr_failures = db_maintenance_verify_compression_database();
+        timing_end( command, nbr_args==1 ? args[0] : db, json_int("failures",nbr_failures) );
+        if( nbr_failures != 0 )
+            ret = 1;
+    }
+    else if( 0==strcmp(command,"speed") && nbr_args==0 )
+    {
+        timing_begin();
+        db_maintenance_speed_tests();
+        timing_end( command, db, "" );
+    }
+    else
+        return usage();
+    return ret;
+}
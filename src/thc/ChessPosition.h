@@ -181,7 +181,9 @@ public:
     // Incremental hash value update
     uint32_t HashUpdate( uint32_t hash_in, Move move );
     
-    // Calculate a hash value for position (64 bit version)
+    // Calculate a hash value for position (64 bit version), unlike the
+    //  32 bit version it includes the side to move
+    static const uint64_t HASH64_BLACK_TO_MOVE = 0x9d39247e33776d41ULL;
     uint64_t Hash64Calculate();
     
     // Incremental hash value update (64 bit version)